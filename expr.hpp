@@ -2,37 +2,1121 @@
 
 // expression language
 
+#include "expr_ops.hpp"
+#include "expr_simd.hpp"
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <map>
 #include <memory>
+#include <new>
+#include <optional>
 #include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
+
+// Define EXPR_PROFILE to 1 to make each node count its evaluations by 
+// eval() & the time they take, for the reports in expr_profile.hpp. 
+// It is off by default, and costs nothing when off
+#ifndef EXPR_PROFILE
+#define EXPR_PROFILE 0
+#endif
+
+#if EXPR_PROFILE
+#include <chrono>
+#endif
+
+/// The kinds of expression node
+enum class node_kind { constant, bin_op, cond, var };
+
+/// The value types the compiled engines know how to store directly;
+/// every other type is boxed
+enum class value_kind { boolean, integer, real, other };
+
+/// Untyped storage for a single value, used by the compiled engines.
+/// bool, int & double are stored inline, other values are referenced 
+/// through `ptr` and owned by a value_pool
+union cell {
+    bool b;
+    int i;
+    double d;
+    const void* ptr;
+};
+
+/// Keeps boxed values alive for as long as the cells that point to them
+class value_pool {
+    std::vector<std::shared_ptr<const void>> boxes;
+
+public:
+    /// stores a copy of v, returning a pointer which is valid as long as 
+    /// this pool (or a copy of it) is
+    template<typename T>
+    const T* keep(const T& v) {
+        auto box = std::make_shared<const T>(v);
+        boxes.push_back(box);
+        return box.get();
+    }
+};
+
+/// Converts values of type T to and from cells
+template<typename T>
+struct value_traits {
+    static constexpr value_kind kind = value_kind::other;
+    static T get(const cell& c) { return *static_cast<const T*>(c.ptr); }
+    static cell put(const T& v, value_pool& pool) {
+        cell c;
+        c.ptr = pool.keep(v);
+        return c;
+    }
+};
+
+template<>
+struct value_traits<bool> {
+    static constexpr value_kind kind = value_kind::boolean;
+    static bool get(const cell& c) { return c.b; }
+    static cell put(bool v, value_pool&) {
+        cell c;
+        c.b = v;
+        return c;
+    }
+};
+
+template<>
+struct value_traits<int> {
+    static constexpr value_kind kind = value_kind::integer;
+    static int get(const cell& c) { return c.i; }
+    static cell put(int v, value_pool&) {
+        cell c;
+        c.i = v;
+        return c;
+    }
+};
+
+template<>
+struct value_traits<double> {
+    static constexpr value_kind kind = value_kind::real;
+    static double get(const cell& c) { return c.d; }
+    static cell put(double v, value_pool&) {
+        cell c;
+        c.d = v;
+        return c;
+    }
+};
+
+/// The values of the variables of an expression, indexed by the slots a 
+/// var_scope assigned them. Setting a variable replaces its old value, so 
+/// one env can be refilled for each input record
+class env {
+    /// The value of each variable
+    std::vector<cell> vals;
+    /// Owns the boxed value of each variable, if any
+    std::vector<std::shared_ptr<const void>> boxes;
+
+public:
+    env() = default;
+
+    /// an environment for n variables
+    explicit env(std::size_t n) 
+    : vals(n) {}
+
+    /// sets the variable in slot to v
+    template<typename T>
+    void set(std::size_t slot, const T& v) {
+        assert(slot < vals.size());
+        if constexpr ( value_traits<T>::kind == value_kind::other ) {
+            if ( boxes.size() < vals.size() ) boxes.resize(vals.size());
+            auto box = std::make_shared<const T>(v);
+            vals[slot].ptr = box.get();
+            boxes[slot] = std::move(box);
+        } else {
+            value_pool unused;
+            vals[slot] = value_traits<T>::put(v, unused);
+        }
+    }
+
+    /// the value of the variable in slot, which must be of type T
+    template<typename T>
+    T get(std::size_t slot) const {
+        return value_traits<T>::get(vals[slot]);
+    }
+
+    /// the value of the variable in slot, as a cell
+    const cell& operator[] (std::size_t slot) const { return vals[slot]; }
+
+    /// the values of the variables, as cells
+    const cell* data() const { return vals.data(); }
+
+    /// the number of variables
+    std::size_t size() const { return vals.size(); }
+};
+
+/// The values of the variables of an expression for many rows at once, 
+/// for batch evaluation: column s is an array holding the value of the 
+/// variable in slot s for each row. The arrays are borrowed, and must 
+/// outlive the evaluation
+class columns {
+    /// The array for each slot
+    std::vector<const void*> arrays;
+
+public:
+    columns() = default;
+
+    /// columns for n variables
+    explicit columns(std::size_t n) 
+    : arrays(n, nullptr) {}
+
+    /// sets the values of the variable in slot, one per row
+    template<typename T>
+    void set(std::size_t slot, const T* values) {
+        assert(slot < arrays.size());
+        arrays[slot] = values;
+    }
+
+    /// the values of the variable in slot, which must be of type T
+    template<typename T>
+    const T* get(std::size_t slot) const {
+        assert(slot < arrays.size() && arrays[slot]);
+        return static_cast<const T*>(arrays[slot]);
+    }
+
+    /// the number of variables
+    std::size_t size() const { return arrays.size(); }
+};
+
+/// The number of rows batch evaluation works on at a time
+constexpr std::size_t batch_block_rows = 1024;
+
+/// A set of rows evaluated together in batch mode: rows first + sel[i] for 
+/// i < n, or rows first + i if sel is null. Values for the rows are 
+/// stored densely, the i'th at index i
+struct row_block {
+    std::size_t first;
+    const std::uint32_t* sel;
+    std::size_t n;
+
+    /// the index of the i'th row
+    std::size_t row(std::size_t i) const { return first + (sel ? sel[i] : i); }
+};
+
+/// The rows of a block where a mask is (or is not) set
+class row_subset {
+    /// The positions of the rows in the parent block
+    std::unique_ptr<std::uint32_t[]> pos;
+    /// The offsets of the rows from the parent block's first row
+    std::unique_ptr<std::uint32_t[]> sel;
+
+public:
+    /// The selected rows
+    row_block rows;
+
+    /// selects the rows i of parent where mask[i] == want
+    row_subset(const row_block& parent, const bool* mask, bool want)
+    : pos(new std::uint32_t[parent.n]), sel(new std::uint32_t[parent.n]),
+      rows{parent.first, sel.get(), 0} {
+        for (std::size_t i = 0; i < parent.n; ++i) {
+            if ( mask[i] != want ) continue;
+            pos[rows.n] = std::uint32_t(i);
+            sel[rows.n] = parent.sel ? parent.sel[i] : std::uint32_t(i);
+            ++rows.n;
+        }
+    }
+
+    /// stores the values computed for the selected rows at their positions 
+    /// in the parent block's values
+    template<typename T>
+    void scatter(const T* values, T* out) const {
+        for (std::size_t i = 0; i < rows.n; ++i) out[pos[i]] = values[i];
+    }
+};
+
+/// Mixes v into the hash h
+inline std::size_t hash_combine(std::size_t h, std::size_t v) {
+    return h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2));
+}
+
+template<typename T, typename = void>
+struct is_hashable : std::false_type {};
+template<typename T>
+struct is_hashable<T, std::void_t<decltype(std::hash<T>{}(std::declval<const T&>()))>> 
+    : std::true_type {};
+
+template<typename T, typename = void>
+struct is_equality_comparable : std::false_type {};
+template<typename T>
+struct is_equality_comparable<T, 
+    std::void_t<decltype(std::declval<const T&>() == std::declval<const T&>())>> 
+    : std::true_type {};
+
+/// Hashes a constant; values of types without a std::hash all hash alike
+template<typename T>
+std::size_t value_hash(const T& v) {
+    if constexpr ( std::is_floating_point_v<T> ) {
+        // consistent with value_equal, which compares representations
+        unsigned long long bits = 0;
+        std::memcpy(&bits, &v, sizeof(v) < sizeof(bits) ? sizeof(v) : sizeof(bits));
+        return std::hash<unsigned long long>{}(bits);
+    } else if constexpr ( is_hashable<T>::value ) {
+        return std::hash<T>{}(v);
+    } else {
+        (void)v;
+        return 0;
+    }
+}
+
+/// The heap memory owned by a value, beyond sizeof(v). Only std::string's 
+/// is known; overload this for other types holding heap memory
+template<typename T>
+std::size_t heap_bytes(const T& v) {
+    (void)v;
+    return 0;
+}
+
+inline std::size_t heap_bytes(const std::string& v) {
+    // short strings are stored in the object itself
+    const char* p = v.data();
+    const char* self = reinterpret_cast<const char*>(&v);
+    bool inside = p >= self && p < self + sizeof(v);
+    return inside ? 0 : v.capacity() + 1;
+}
+
+/// The size of the block holding a T made by std::make_shared, which also 
+/// holds the reference counts
+template<typename T>
+constexpr std::size_t shared_block_bytes() {
+    return sizeof(T) + 2 * sizeof(void*);
+}
+
+/// The heap memory a std::function holding an F allocates. Both libstdc++ 
+/// & libc++ store small trivially copyable callables (e.g. function 
+/// pointers) in the std::function itself, and others on the heap
+template<typename F>
+constexpr std::size_t function_heap_bytes() {
+    using D = std::decay_t<F>;
+    bool local = std::is_trivially_copyable_v<D>
+        && sizeof(D) <= 2 * sizeof(void*)
+        && alignof(D) <= alignof(void*);
+    return local ? 0 : sizeof(D);
+}
+
+/// Are two constants interchangeable? Floating-point values must have the 
+/// same representation, so 0.0 and -0.0 differ; values of types without an 
+/// == are never interchangeable
+template<typename T>
+bool value_equal(const T& a, const T& b) {
+    if constexpr ( std::is_floating_point_v<T> ) {
+        return std::memcmp(&a, &b, sizeof(T)) == 0;
+    } else if constexpr ( is_equality_comparable<T>::value ) {
+        return a == b;
+    } else {
+        return &a == &b;
+    }
+}
+
+/// Prints a constant as expr_parser reads it back: doubles with a decimal
+/// point & as many digits as they need to be read back exactly (or, for
+/// infinities & NaN, as a division giving them), and strings quoted, with
+/// `"`, `\`, newlines & tabs escaped
+template<typename T>
+void print_value(std::ostream& out, const T& v) {
+    if constexpr ( std::is_same_v<T, bool> ) {
+        out << (v ? "true" : "false");
+    } else if constexpr ( std::is_same_v<T, double> ) {
+        if ( std::isnan(v) ) {
+            out << "(0.0 / 0.0)";
+        } else if ( std::isinf(v) ) {
+            out << (v > 0 ? "(1.0 / 0.0)" : "(-1.0 / 0.0)");
+        } else {
+            char buf[32];
+            for (int digits = 15; ; ++digits) {
+                std::snprintf(buf, sizeof buf, "%.*g", digits, v);
+                if ( digits == 17 || std::strtod(buf, nullptr) == v ) break;
+            }
+            out << buf;
+            if ( !std::strpbrk(buf, ".e") ) out << ".0";
+        }
+    } else if constexpr ( std::is_same_v<T, std::string> ) {
+        out << '"';
+        for (char c : v) {
+            switch ( c ) {
+            case '"': out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n"; break;
+            case '\t': out << "\\t"; break;
+            default: out << c;
+            }
+        }
+        out << '"';
+    } else {
+        out << v;
+    }
+}
+
+/// Kinds of the `cell` fields named in EXPR_CELL_OPS
+constexpr value_kind cell_kind_b = value_kind::boolean;
+constexpr value_kind cell_kind_i = value_kind::integer;
+constexpr value_kind cell_kind_d = value_kind::real;
+
+/// Finds the EXPR_CELL_OPS entry implementing built-in operator o on 
+/// operands of kind `arg`, producing `res`; returns -1 if there is none
+inline int find_cell_op(op o, value_kind arg, value_kind res) {
+    if ( arg == value_kind::other || res == value_kind::other ) return -1;
+    int i = 0;
+#define EXPR_FIND_CELL_OP(name, code, a, r, sym) \
+    if ( o == op::code && arg == cell_kind_##a && res == cell_kind_##r ) { \
+        return i; \
+    } \
+    ++i;
+    EXPR_CELL_OPS(EXPR_FIND_CELL_OP)
+#undef EXPR_FIND_CELL_OP
+    return -1;
+}
+
+/// A binary operator lifted to work on cells; 
+/// boxed results are stored in the pool argument
+using cell_fn = std::function<cell(cell, cell, value_pool&)>;
+
+template<typename T> class expr;
+template<typename T> class const_expr;
+template<typename T> class closure;
+
+#if EXPR_PROFILE
+/// The evaluations of a node by eval(), counted from any number of threads.
+/// Copies of a node start with fresh counts
+struct node_stats {
+    /// The number of evaluations
+    std::atomic<std::uint64_t> count{0};
+    /// The time they took, including their operands' evaluations, in ns
+    std::atomic<std::uint64_t> ns{0};
+
+    node_stats() = default;
+    node_stats(const node_stats&) {}
+    node_stats& operator= (const node_stats&) { return *this; }
+
+    void reset() {
+        count.store(0, std::memory_order_relaxed);
+        ns.store(0, std::memory_order_relaxed);
+    }
+};
+
+/// Times one evaluation of a node, adding it to the node's stats
+class profile_scope {
+    node_stats& stats;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit profile_scope(node_stats& s)
+    : stats(s), start(std::chrono::steady_clock::now()) {}
+
+    profile_scope(const profile_scope&) = delete;
+    profile_scope& operator= (const profile_scope&) = delete;
+
+    ~profile_scope() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        stats.count.fetch_add(1, std::memory_order_relaxed);
+        stats.ns.fetch_add(std::uint64_t(ns), std::memory_order_relaxed);
+    }
+};
+
+/// Starts timing the evaluation of the node `this`, until the end of the
+/// enclosing scope
+#define EXPR_PROFILE_EVAL() profile_scope expr_profile_scope_(this->stats)
+#else
+#define EXPR_PROFILE_EVAL()
+#endif
+
+/// Allocates the memory for expression nodes, which `new` & clone() get 
+/// through it. Replacing it (e.g. with an allocation_counter) lets callers
+/// account for or pool node allocations. `deallocate` receives memory from
+/// any earlier allocator as well, so replacements should forward to the 
+/// allocator they replace
+struct node_allocator {
+    void* (*allocate)(std::size_t bytes, void* context);
+    void (*deallocate)(void* p, std::size_t bytes, void* context);
+    void* context;
+};
+
+namespace detail {
+
+inline void* default_allocate(std::size_t bytes, void*) {
+    return ::operator new(bytes);
+}
+
+inline void default_deallocate(void* p, std::size_t, void*) {
+    ::operator delete(p);
+}
+
+inline node_allocator& current_node_allocator() {
+    static node_allocator a{default_allocate, default_deallocate, nullptr};
+    return a;
+}
+
+}
+
+/// the allocator for expression nodes
+inline const node_allocator& get_node_allocator() {
+    return detail::current_node_allocator();
+}
+
+/// makes `a` the node allocator, returning the previous one.
+/// It must not be changed while other threads are allocating nodes
+inline node_allocator set_node_allocator(const node_allocator& a) {
+    node_allocator old = detail::current_node_allocator();
+    detail::current_node_allocator() = a;
+    return old;
+}
+
+/// Counts the node allocations & frees made while it exists, forwarding 
+/// them to the allocator it replaces, e.g.
+///
+///     allocation_counter count;
+///     std::unique_ptr<expr<int>> copy{tree.clone()};
+///     assert(count.allocations() == number of nodes in tree);
+///
+/// Counters may be nested, and must be destroyed in the reverse order 
+/// they were made
+class allocation_counter {
+    node_allocator previous;
+    std::atomic<std::size_t> n_allocs{0};
+    std::atomic<std::size_t> n_frees{0};
+    std::atomic<std::size_t> n_allocated{0};
+    std::atomic<std::size_t> n_freed{0};
+
+    static void* allocate(std::size_t bytes, void* context) {
+        auto c = static_cast<allocation_counter*>(context);
+        c->n_allocs.fetch_add(1, std::memory_order_relaxed);
+        c->n_allocated.fetch_add(bytes, std::memory_order_relaxed);
+        return c->previous.allocate(bytes, c->previous.context);
+    }
+
+    static void deallocate(void* p, std::size_t bytes, void* context) {
+        auto c = static_cast<allocation_counter*>(context);
+        c->n_frees.fetch_add(1, std::memory_order_relaxed);
+        c->n_freed.fetch_add(bytes, std::memory_order_relaxed);
+        c->previous.deallocate(p, bytes, c->previous.context);
+    }
+
+public:
+    allocation_counter()
+    : previous(set_node_allocator(node_allocator{allocate, deallocate, this})) {}
+
+    allocation_counter(const allocation_counter&) = delete;
+    allocation_counter& operator= (const allocation_counter&) = delete;
+
+    ~allocation_counter() { set_node_allocator(previous); }
+
+    /// the number of nodes allocated
+    std::size_t allocations() const { return n_allocs.load(); }
+
+    /// the number of nodes freed
+    std::size_t frees() const { return n_frees.load(); }
+
+    /// the bytes allocated for nodes
+    std::size_t allocated_bytes() const { return n_allocated.load(); }
+
+    /// the bytes of nodes freed
+    std::size_t freed_bytes() const { return n_freed.load(); }
+};
+
+/// Tracks the shared storage & nodes already counted by memory_usage()
+using memory_seen = std::unordered_set<const void*>;
+
+class expr_node;
+
+/// The structural hashes of the nodes already hashed by hash()
+using hash_memo = std::unordered_map<const expr_node*, std::size_t>;
+
+/// The pairs of nodes equals() has already found to be identical
+using equals_memo = std::set<std::pair<const expr_node*, const expr_node*>>;
+
+/// Untyped view of an expression node.
+/// Passes which only need the shape of a tree (e.g. the compilers) walk it 
+/// through this interface rather than knowing the template types of each node
+class expr_node {
+public:
+    /// the kind of this node
+    virtual node_kind kind() const = 0;
+
+    /// the type this node evaluates to
+    virtual value_kind result_kind() const = 0;
+
+    /// the C++ type this node evaluates to
+    virtual const std::type_info& result_type() const = 0;
+
+    /// the number of operands of this node
+    virtual std::size_t arity() const = 0;
+
+    /// the i'th operand of this node
+    virtual const expr_node& operand(std::size_t i) const {
+        (void)i;
+        return unimplemented<const expr_node&>();
+    }
+
+    /// the value of a constant node; boxed values are kept alive by the pool
+    virtual cell value(value_pool& pool) const {
+        (void)pool;
+        return unimplemented<cell>();
+    }
+
+    /// the slot of a variable node
+    virtual std::size_t slot() const {
+        return unimplemented<std::size_t>();
+    }
+
+    /// the opcode of a binary node
+    virtual op opcode() const {
+        return unimplemented<op>();
+    }
+
+    /// the operator of a binary node, lifted to work on cells
+    virtual cell_fn cell_op() const {
+        return unimplemented<cell_fn>();
+    }
+
+    /// the name of a variable node, or the printed name of a binary 
+    /// node's operator
+    virtual const char* symbol() const {
+        return unimplemented<const char*>();
+    }
+
+    /// evaluates the expression, storing the value in a cell;
+    /// boxed values are kept alive by the pool
+    virtual cell eval_cell(value_pool& pool) const = 0;
+
+    /// makes a new node of the same kind, type & operator as this one, 
+    /// with the given operands (which must have the same types as this 
+    /// node's operands). The new node takes ownership of the operands;
+    /// it should be deleted by the caller
+    virtual expr_node* rebuild(expr_node* const* operands) const = 0;
+
+    /// as rebuild(), but the new node only borrows its operands, which 
+    /// must outlive it
+    virtual expr_node* share(const expr_node* const* operands) const = 0;
+
+    /// makes a new constant node with the same type as this node, 
+    /// holding v; it should be deleted by the caller
+    virtual expr_node* make_constant(const cell& v) const = 0;
+
+    /// hashes the parts of this node other than its operands
+    virtual std::size_t local_hash() const = 0;
+
+    /// do this node & o match, other than their operands? 
+    /// Matching nodes have the same C++ type & operator, or equal values
+    virtual bool local_equals(const expr_node& o) const = 0;
+
+    /// is this node's own operation deterministic & free of side effects,
+    /// so that its value depends only on its operands? Only custom
+    /// operators not wrapped in pure_op() are not
+    virtual bool local_pure() const { return true; }
+
+    /// structural hash of the tree rooted at this node. Shared subtrees
+    /// are hashed once, so this takes time linear in the distinct nodes
+    std::size_t hash() const {
+        hash_memo memo;
+        return hash(memo);
+    }
+
+    /// as hash(), reusing & adding to the hashes of the nodes in memo
+    std::size_t hash(hash_memo& memo) const {
+        if ( arity() == 0 ) return local_hash();
+        auto it = memo.find(this);
+        if ( it != memo.end() ) return it->second;
+        std::size_t h = local_hash();
+        for (std::size_t i = 0; i < arity(); ++i) {
+            h = hash_combine(h, operand(i).hash(memo));
+        }
+        memo.emplace(this, h);
+        return h;
+    }
+
+    /// are the trees rooted at this node & o structurally identical? Each
+    /// pair of shared subtrees is compared once
+    bool equals(const expr_node& o) const {
+        equals_memo memo;
+        return equals(o, memo);
+    }
+
+    /// as equals(), skipping the pairs of nodes memo holds, which are
+    /// known to be identical, & adding those found to be
+    bool equals(const expr_node& o, equals_memo& memo) const {
+        if ( this == &o ) return true;
+        if ( !local_equals(o) ) return false;
+        if ( arity() == 0 ) return true;
+        if ( memo.count({ this, &o }) ) return true;
+        for (std::size_t i = 0; i < arity(); ++i) {
+            if ( !operand(i).equals(o.operand(i), memo) ) return false;
+        }
+        memo.insert({ this, &o });
+        return true;
+    }
+
+    /// prints the expression
+    virtual void print(std::ostream&) const = 0;
+
+    /// the bytes of memory owned by this node, other than its operands: 
+    /// the node itself & any heap storage it holds. Storage shared with 
+    /// other nodes is added to `seen`, and is not counted if it is there
+    virtual std::size_t local_memory(memory_seen& seen) const = 0;
+
+    /// the bytes of memory owned by the tree rooted at this node: its 
+    /// nodes (each counted once, in a DAG), their values & names and the
+    /// storage of their custom operators
+    std::size_t memory_usage() const {
+        memory_seen seen;
+        return memory_usage(seen);
+    }
+
+    /// as memory_usage(), but skipping the nodes & storage in `seen`, so 
+    /// the memory held by many trees can be totalled
+    std::size_t memory_usage(memory_seen& seen) const {
+        if ( !seen.insert(this).second ) return 0;
+        std::size_t n = local_memory(seen);
+        for (std::size_t i = 0; i < arity(); ++i) {
+            n += operand(i).memory_usage(seen);
+        }
+        return n;
+    }
+
+    static void* operator new(std::size_t bytes) {
+        const node_allocator& a = get_node_allocator();
+        return a.allocate(bytes, a.context);
+    }
+
+    static void operator delete(void* p, std::size_t bytes) {
+        const node_allocator& a = get_node_allocator();
+        a.deallocate(p, bytes, a.context);
+    }
+
+#if EXPR_PROFILE
+    /// the evaluations of this node by eval() so far
+    const node_stats& profile() const { return stats; }
+
+    /// zeroes the stats of the tree rooted at this node
+    void reset_profile() const {
+        stats.reset();
+        for (std::size_t i = 0; i < arity(); ++i) operand(i).reset_profile();
+    }
+#endif
+
+    // ensures that subclasses are deleted properly
+    virtual ~expr_node() = default;
+
+#if EXPR_PROFILE
+protected:
+    mutable node_stats stats;
+#endif
+};
+
+/// Deletes operands which are owned by their parent node. Operands are 
+/// normally owned, but the nodes built by an expr_factory share operands 
+/// owned by the factory
+struct operand_deleter {
+    bool owned = true;
+
+    void operator() (const expr_node* e) const {
+        if ( owned ) delete e;
+    }
+};
+
+/// A pointer to an operand of type T, which is deleted with its parent 
+/// unless it is borrowed
+template<typename T>
+using operand_ptr = std::unique_ptr<expr<T>, operand_deleter>;
+
+/// Borrows an operand owned elsewhere
+template<typename T>
+operand_ptr<T> borrow(const expr<T>* e) {
+    return operand_ptr<T>(const_cast<expr<T>*>(e), operand_deleter{false});
+}
+
+/// Finds the EXPR_CELL_OPS entry implementing binary node e; 
+/// returns -1 if there is none and e must be run through its cell_op()
+inline int find_cell_op(const expr_node& e) {
+    if ( e.kind() != node_kind::bin_op || e.opcode() == op::custom ) return -1;
+    value_kind arg = e.operand(0).result_kind();
+    if ( e.operand(1).result_kind() != arg ) return -1;
+    return find_cell_op(e.opcode(), arg, e.result_kind());
+}
+
+/// Is e a boolean && or || whose right operand must only be evaluated if 
+/// the left one does not decide the result?
+inline bool is_short_circuit(const expr_node& e) {
+    return e.kind() == node_kind::bin_op && is_logical(e.opcode())
+        && e.result_kind() == value_kind::boolean
+        && e.operand(0).result_kind() == value_kind::boolean
+        && e.operand(1).result_kind() == value_kind::boolean;
+}
+
+/// Conditionals whose branches have at most this many nodes between them 
+/// are evaluated without branching in batch mode, if that is safe
+constexpr std::size_t blend_max_nodes = 16;
+
+/// Can e be evaluated on rows where its value is not needed? Custom 
+/// operators may have side effects, integer division may trap, and other
+/// integer arithmetic may overflow, which is undefined, so trees with
+/// them cannot. Each node visited is taken from `budget`, and trees larger
+/// than the budget cannot either
+inline bool can_speculate(const expr_node& e, std::size_t& budget) {
+    if ( budget == 0 ) return false;
+    --budget;
+    if ( e.kind() == node_kind::bin_op ) {
+        op o = e.opcode();
+        if ( o == op::custom ) return false;
+        bool arithmetic = !is_comparison(o) && !is_logical(o);
+        if ( arithmetic && e.operand(0).result_kind() != value_kind::real ) {
+            return false;
+        }
+    }
+    for (std::size_t i = 0; i < e.arity(); ++i) {
+        if ( !can_speculate(e.operand(i), budget) ) return false;
+    }
+    return true;
+}
+
+/// A compiled closure producing a T from the variable cells: a function
+/// called directly with the closure's captured state
+template<typename T>
+struct closure_ref {
+    T (*call)(const void* self, const cell* vars);
+    const void* self;
+
+    T operator() (const cell* vars) const { return call(self, vars); }
+};
+
+/// Storage for the closures an expression is compiled to, allocated one 
+/// after another in large blocks. Closures only capture trivially 
+/// destructible state; anything they point to which needs an owner is 
+/// kept here too
+class closure_buffer {
+    /// The bytes in each block
+    static constexpr std::size_t block_size = 4096;
+
+    /// The blocks; closures never move once placed
+    std::vector<std::unique_ptr<unsigned char[]>> blocks;
+    /// The bytes used in the last block
+    std::size_t used = block_size;
+    /// The bytes used by closures
+    std::size_t total = 0;
+    /// Owns boxed constants
+    value_pool pool;
+    /// Owns the custom operators the closures call
+    std::vector<std::shared_ptr<const void>> owned;
+    /// The number of env slots the closures read
+    std::size_t n_vars = 0;
+
+    template<typename T, typename F>
+    static T invoke(const void* self, const cell* vars) {
+        return (*static_cast<const F*>(self))(vars);
+    }
+
+public:
+    /// moves f into the buffer, returning a reference calling it
+    template<typename T, typename F>
+    closure_ref<T> make(F f) {
+        static_assert(std::is_trivially_destructible_v<F>,
+            "closures are never destroyed");
+        static_assert(alignof(F) <= alignof(std::max_align_t) 
+            && sizeof(F) <= block_size, "closure does not fit a block");
+        used = (used + alignof(F) - 1) / alignof(F) * alignof(F);
+        if ( used + sizeof(F) > block_size ) {
+            blocks.emplace_back(new unsigned char[block_size]);
+            used = 0;
+        }
+        void* p = blocks.back().get() + used;
+        used += sizeof(F);
+        total += sizeof(F);
+        return closure_ref<T>{&invoke<T, F>, new (p) F(std::move(f))};
+    }
+
+    /// keeps a copy of v as long as the buffer, returning a pointer to it
+    template<typename T>
+    const T* keep(const T& v) { return pool.keep(v); }
+
+    /// keeps p alive as long as the buffer
+    void retain(std::shared_ptr<const void> p) { owned.push_back(std::move(p)); }
+
+    /// notes that a closure reads env slot s
+    void use_slot(std::size_t s) {
+        if ( s >= n_vars ) n_vars = s + 1;
+    }
+
+    /// the number of env slots the closures read
+    std::size_t slots() const { return n_vars; }
+
+    /// the bytes used by closures
+    std::size_t size() const { return total; }
+};
+
+/// How eval_parallel() divides the work of evaluating a tree: which nodes 
+/// evaluate their operands concurrently, and on what threads. 
+/// parallel_plan in expr_parallel.hpp is the usual implementation
+class parallel_eval {
+public:
+    /// What a node does in eval_parallel()
+    enum mode {
+        /// evaluates as eval() does
+        sequential,
+        /// evaluates its operands in turn, with eval_parallel()
+        descend,
+        /// evaluates its two operands concurrently, with eval_parallel()
+        fork
+    };
+
+    /// what node e does
+    virtual mode at(const expr_node& e) const = 0;
+
+    /// calls a() & b(), concurrently if a thread is free to, returning 
+    /// once both have returned. An exception thrown by either is rethrown
+    template<typename A, typename B>
+    void both(A&& a, B&& b) const {
+        run_both(&call<A>, &a, &call<B>, &b);
+    }
+
+protected:
+    using task_fn = void (*)(void*);
+
+    virtual void run_both(task_fn a, void* a_arg, 
+                          task_fn b, void* b_arg) const = 0;
+
+    ~parallel_eval() = default;
+
+private:
+    template<typename F>
+    static void call(void* f) {
+        (*static_cast<std::remove_reference_t<F>*>(f))();
+    }
+};
+
+/// How eval_cached() reuses the values of subtrees: which nodes take their
+/// value from a cache, and the cache. cached_plan in expr_cache.hpp is the
+/// usual implementation
+class cached_eval {
+public:
+    /// What a node does in eval_cached()
+    enum mode {
+        /// evaluates as eval() does
+        direct,
+        /// evaluates its operands with eval_cached()
+        descend,
+        /// takes its value from the cache, evaluating it with eval() & 
+        /// caching it if it is not there
+        cached
+    };
+
+    /// what node e does
+    virtual mode at(const expr_node& e) const = 0;
+
+    /// the value of e, a cached node of type T
+    template<typename T>
+    T value(const expr<T>& e, const env& vars) const {
+        std::shared_ptr<const void> v = find(e, vars, &compute<T>);
+        return *static_cast<const T*>(v.get());
+    }
+
+    /// evaluates a node of type T with eval(), boxing its value
+    using compute_fn = std::shared_ptr<const void> (*)(const expr_node& e, 
+                                                       const env& vars);
+
+protected:
+    /// the boxed value of the cached node e, computed with compute if it 
+    /// is not cached
+    virtual std::shared_ptr<const void> find(const expr_node& e, 
+                                             const env& vars, 
+                                             compute_fn compute) const = 0;
+
+    ~cached_eval() = default;
+
+private:
+    template<typename T>
+    static std::shared_ptr<const void> compute(const expr_node& e, 
+                                               const env& vars) {
+        return std::make_shared<const T>(static_cast<const expr<T>&>(e).eval(vars));
+    }
+};
+
+/// All expressions of type T.
+///
+/// Any number of threads may evaluate one tree at once, with eval(), 
+/// eval_batch(), eval_parallel(), eval_cached() or its compiled forms' 
+/// run(): evaluation only reads the tree, keeps intermediate values on the 
+/// evaluating thread, and counts profiling stats (with EXPR_PROFILE) in 
+/// lock-free atomics; result caches lock themselves. 
+/// Custom operators' callables are then called concurrently too, so must 
+/// be safe to call so; wrap ones that keep state, such as memo tables, in 
+/// per_thread(). Building, assigning to or destroying a tree, and 
+/// set_simd_level() & set_node_allocator(), must not overlap evaluation
+template<typename T>
+class expr : public expr_node {
+public:
+    /// evaluates the expression to a C++ value, reading its variables 
+    /// from vars
+    virtual T eval(const env& vars) const = 0;
+
+    /// evaluates an expression without variables to a C++ value
+    T eval() const {
+        return eval(env());
+    }
+
+    /// evaluates the expression as eval(vars) does, but evaluating the 
+    /// operands of the nodes p says to fork concurrently. The tree must 
+    /// not change meanwhile
+    virtual T eval_parallel(const env& vars, const parallel_eval& p) const {
+        (void)p;
+        return eval(vars);
+    }
+
+    /// evaluates the expression as eval(vars) does, but taking the values 
+    /// of the subtrees c caches from its cache. The tree must not change 
+    /// meanwhile
+    virtual T eval_cached(const env& vars, const cached_eval& c) const {
+        if ( c.at(*this) == cached_eval::cached ) return c.value(*this, vars);
+        return eval(vars);
+    }
+
+    /// evaluates the expression on the rows of a block, reading its 
+    /// variables from cols & storing the value for the i'th row in out[i]. 
+    /// Operands are evaluated on exactly the rows eval() would evaluate 
+    /// them for
+    virtual void eval_block(const columns& cols, const row_block& rows, 
+                            T* out) const = 0;
+
+    /// evaluates the expression on n rows, reading its variables from 
+    /// cols & storing the value for row i in out[i]. Each node works on a 
+    /// block of rows at a time, rather than one row per call
+    void eval_batch(const columns& cols, std::size_t n, T* out) const {
+        for (std::size_t first = 0; first < n; first += batch_block_rows) {
+            std::size_t m = std::min(batch_block_rows, n - first);
+            eval_block(cols, row_block{first, nullptr, m}, out + first);
+        }
+    }
+    
+    /// makes a deep copy of this expression node.
+    /// the clone should be deleted by the caller
+    virtual expr* clone() const = 0;
 
-/// Crashes with an "unimplemented" error, syntactically returning 
-/// a value of type N.
-template<typename N>
-N unimplemented() {
-    assert(!"unimplemented");
+    /// compiles the expression into closures in b, returning the root one
+    virtual closure_ref<T> lower_closure(closure_buffer& b) const = 0;
+
+    /// compiles the expression to nested, fully-typed closures, which 
+    /// call each other directly rather than through virtual calls
+    closure<T> compile_closure() const;
+
+    const std::type_info& result_type() const override { return typeid(T); }
+
+    value_kind result_kind() const override {
+        return value_traits<T>::kind;
+    }
+
+    cell eval_cell(value_pool& pool) const override {
+        return value_traits<T>::put(eval(), pool);
+    }
+
+    expr_node* make_constant(const cell& v) const override {
+        return new const_expr<T>(value_traits<T>::get(v));
+    }
+};
+
+/// Evaluates the short-circuiting && (o == op::land) or || of l & r on the 
+/// rows of a block; r is only evaluated on the rows l does not decide
+template<typename T, typename A, typename B>
+void eval_logic_block(op o, const expr<A>& l, const expr<B>& r,
+                      const columns& cols, const row_block& rows, T* out) {
+    bool decided = o == op::lor;
+    std::unique_ptr<A[]> lv{new A[rows.n]};
+    std::unique_ptr<bool[]> open{new bool[rows.n]};
+    l.eval_block(cols, rows, lv.get());
+    std::size_t n_open = 0;
+    for (std::size_t i = 0; i < rows.n; ++i) {
+        open[i] = bool(lv[i]) != decided;
+        n_open += open[i];
+        out[i] = T(decided);
+    }
+    if ( n_open == 0 ) return;
+    std::unique_ptr<B[]> rv{new B[n_open]};
+    std::unique_ptr<T[]> vals{new T[n_open]};
+    row_subset rest{rows, open.get(), true};
+    r.eval_block(cols, rest.rows, rv.get());
+    for (std::size_t i = 0; i < n_open; ++i) vals[i] = T(bool(rv[i]));
+    rest.scatter(vals.get(), out);
 }
 
-/// All expressions of type T
+/// An expression of type T compiled to closures: one per node, each a 
+/// lambda specialized for its node's types & operator which calls its 
+/// operands' closures directly, with constant & variable operands folded 
+/// into their parent. Only custom operators are still called through a 
+/// std::function. The closure owns everything it refers to, so it is 
+/// independent of the tree it was compiled from
 template<typename T>
-class expr {
+class closure {
+    /// The closures
+    closure_buffer buf;
+    /// The closure for the root
+    closure_ref<T> root;
+
 public:
-    /// evaluates the expression to a C++ value
-    virtual T eval() const = 0;
-    
-    /// prints the expression
-    virtual void print(std::ostream&) const = 0;
-    
-    /// makes a deep copy of this expression node.
-    /// the clone should be deleted by the caller
-    virtual expr* clone() const = 0;
+    /// compiles e; the closure does not refer to e afterward
+    explicit closure(const expr<T>& e)
+    : root(e.lower_closure(buf)) {}
 
-    // ensures that subclasses are deleted properly
-    virtual ~expr() = default;
+    /// runs the closure, producing the same value as eval() on the 
+    /// expression it was compiled from
+    T run() const {
+        assert(buf.slots() == 0);
+        return root(nullptr);
+    }
+
+    /// runs the closure on the variables vars, producing the same value as
+    /// eval(vars) on the expression it was compiled from
+    T run(const env& vars) const {
+        assert(vars.size() >= buf.slots());
+        return root(vars.data());
+    }
+
+    /// the bytes used by the closures
+    std::size_t size() const { return buf.size(); }
 };
 
+template<typename T>
+closure<T> expr<T>::compile_closure() const {
+    return closure<T>(*this);
+}
+
+/// Calls k with a callable producing the value of e from the variable 
+/// cells: e's closure, or for a constant or variable of an inline type, a 
+/// lambda reading it directly, which the caller's closure can inline
+template<typename A, typename K>
+auto with_operand(const expr<A>& e, closure_buffer& b, K&& k) {
+    if constexpr ( value_traits<A>::kind != value_kind::other ) {
+        if ( e.kind() == node_kind::constant ) {
+            A v = e.eval();
+            return k([v](const cell*) { return v; });
+        }
+        if ( e.kind() == node_kind::var ) {
+            std::size_t s = e.slot();
+            b.use_slot(s);
+            return k([s](const cell* vars) { 
+                return value_traits<A>::get(vars[s]); 
+            });
+        }
+    }
+    return k(e.lower_closure(b));
+}
+
 /// Prints an arbitrary expression
 template<typename T>
 std::ostream& operator<< (std::ostream& out, const expr<T>& expr) {
@@ -50,12 +1134,59 @@ public:
     const_expr(const T& v) 
     : val(v) {}
 
-    T eval() const override {
+    using expr<T>::eval;
+
+    T eval(const env&) const override {
+        EXPR_PROFILE_EVAL();
         return val;
     }
 
+    void eval_block(const columns&, const row_block& rows, 
+                    T* out) const override {
+        std::fill_n(out, rows.n, val);
+    }
+
+    closure_ref<T> lower_closure(closure_buffer& b) const override {
+        if constexpr ( value_traits<T>::kind != value_kind::other ) {
+            T v = val;
+            return b.make<T>([v](const cell*) { return v; });
+        } else {
+            const T* p = b.keep(val);
+            return b.make<T>([p](const cell*) { return *p; });
+        }
+    }
+
+    node_kind kind() const override { return node_kind::constant; }
+
+    std::size_t arity() const override { return 0; }
+
+    cell value(value_pool& pool) const override {
+        return value_traits<T>::put(val, pool);
+    }
+
+    const_expr* rebuild(expr_node* const*) const override {
+        return clone();
+    }
+
+    const_expr* share(const expr_node* const*) const override {
+        return clone();
+    }
+
+    std::size_t local_memory(memory_seen&) const override {
+        return sizeof(*this) + heap_bytes(val);
+    }
+
+    std::size_t local_hash() const override {
+        return hash_combine(std::size_t(node_kind::constant), value_hash(val));
+    }
+
+    bool local_equals(const expr_node& o) const override {
+        auto c = dynamic_cast<const const_expr*>(&o);
+        return c && value_equal(val, c->val);
+    }
+
     void print(std::ostream& out) const override {
-        out << val;
+        print_value(out, val);
     }
 
     const_expr* clone() const override {
@@ -63,44 +1194,316 @@ public:
     }
 };
 
+/// Variables of type T, read from the env passed to eval().
+/// Variables are resolved to slots when they are built (see var_scope), so 
+/// evaluating one indexes the env rather than looking up a name
+template<typename T>
+class var_expr : public expr<T> {
+    /// The index of the variable's value in the env
+    std::size_t index;
+    /// The name of the variable, shared by the nodes for it
+    std::shared_ptr<const std::string> var_name;
+
+public:
+    /// Constructs a variable read from slot s of the env, named n
+    var_expr(std::size_t s, std::shared_ptr<const std::string> n)
+    : index(s), var_name(std::move(n)) {}
+
+    var_expr(std::size_t s, const std::string& n)
+    : var_expr(s, std::make_shared<const std::string>(n)) {}
+
+    using expr<T>::eval;
+
+    T eval(const env& vars) const override {
+        EXPR_PROFILE_EVAL();
+        assert(index < vars.size());
+        return vars.template get<T>(index);
+    }
+
+    void eval_block(const columns& cols, const row_block& rows, 
+                    T* out) const override {
+        const T* col = cols.template get<T>(index);
+        if ( !rows.sel ) {
+            std::copy_n(col + rows.first, rows.n, out);
+            return;
+        }
+        for (std::size_t i = 0; i < rows.n; ++i) out[i] = col[rows.row(i)];
+    }
+
+    closure_ref<T> lower_closure(closure_buffer& b) const override {
+        std::size_t s = index;
+        b.use_slot(s);
+        return b.make<T>([s](const cell* vars) { 
+            return value_traits<T>::get(vars[s]); 
+        });
+    }
+
+    node_kind kind() const override { return node_kind::var; }
+
+    std::size_t arity() const override { return 0; }
+
+    std::size_t slot() const override { return index; }
+
+    /// the name of the variable
+    const std::string& name() const { return *var_name; }
+
+    const char* symbol() const override { return var_name->c_str(); }
+
+    var_expr* rebuild(expr_node* const*) const override {
+        return clone();
+    }
+
+    var_expr* share(const expr_node* const*) const override {
+        return clone();
+    }
+
+    std::size_t local_memory(memory_seen& seen) const override {
+        std::size_t n = sizeof(*this);
+        if ( seen.insert(var_name.get()).second ) {
+            n += shared_block_bytes<std::string>() + heap_bytes(*var_name);
+        }
+        return n;
+    }
+
+    std::size_t local_hash() const override {
+        return hash_combine(std::size_t(node_kind::var), index);
+    }
+
+    bool local_equals(const expr_node& o) const override {
+        auto v = dynamic_cast<const var_expr*>(&o);
+        return v && v->index == index;
+    }
+
+    void print(std::ostream& out) const override {
+        out << *var_name;
+    }
+
+    var_expr* clone() const override {
+        return new var_expr(*this);
+    }
+};
+
+/// Assigns dense env slots to variables by name as they are built. 
+/// Every variable a scope builds with the same name has the same slot, and 
+/// must have the same type
+class var_scope {
+    struct var_info {
+        /// The name, shared by the variable's nodes
+        std::shared_ptr<const std::string> name;
+        /// The type of the variable
+        const std::type_info* type;
+    };
+
+    /// The variables, by slot
+    std::vector<var_info> vars;
+    /// The slots of the variables, by name; ordered, so names can be looked
+    /// up as string_views without copying them
+    std::map<std::string, std::size_t, std::less<>> slots;
+
+public:
+    /// makes a node for the variable named n, of type T, giving it the next
+    /// free slot if it is new; it should be deleted by the caller
+    template<typename T>
+    var_expr<T>* var(std::string_view n) {
+        auto it = slots.find(n);
+        if ( it == slots.end() ) {
+            it = slots.emplace(std::string(n), vars.size()).first;
+            vars.push_back(var_info{
+                std::make_shared<const std::string>(n), &typeid(T)});
+        }
+        const var_info& v = vars[it->second];
+        assert(*v.type == typeid(T));
+        return new var_expr<T>(it->second, v.name);
+    }
+
+    /// declares the variable named n, of type T, without making a node for
+    /// it, returning its slot
+    template<typename T>
+    std::size_t declare(std::string_view n) {
+        delete var<T>(n);
+        return slot(n);
+    }
+
+    /// does the scope have a variable named n?
+    bool contains(std::string_view n) const {
+        return slots.find(n) != slots.end();
+    }
+
+    /// the slot of the variable named n, which must exist
+    std::size_t slot(std::string_view n) const {
+        auto it = slots.find(n);
+        assert(it != slots.end());
+        return it->second;
+    }
+
+    /// the name of the variable in slot s
+    const std::string& name(std::size_t s) const { return *vars[s].name; }
+
+    /// the type of the variable in slot s
+    const std::type_info& type(std::size_t s) const { return *vars[s].type; }
+
+    /// the number of variables
+    std::size_t size() const { return vars.size(); }
+
+    /// an environment with room for every variable of the scope
+    env make_env() const { return env(vars.size()); }
+
+    /// batch columns with room for every variable of the scope
+    columns make_columns() const { return columns(vars.size()); }
+};
+
+namespace detail {
+
+/// a number identifying a per_thread() wrapper
+inline std::uint64_t next_per_thread_id() {
+    static std::atomic<std::uint64_t> n{0};
+    return ++n;
+}
+
+}
+
+/// Wraps the callable f, for a custom operator, so that each thread calls 
+/// a copy of its own, made from f on the thread's first call. Callables 
+/// that keep state, such as memo tables, can then be called from many 
+/// threads at once without locks. A thread's copy lives until the thread 
+/// exits, or calls another per_thread() callable of the same type after 
+/// every copy of the wrapper is gone
+template<typename F>
+auto per_thread(F f) {
+    struct original {
+        F fn;
+        std::uint64_t id;
+    };
+    auto o = std::make_shared<const original>(
+        original{std::move(f), detail::next_per_thread_id()});
+    return [o](auto&&... args) -> decltype(auto) {
+        struct copy {
+            std::weak_ptr<const original> from;
+            F fn;
+        };
+        thread_local std::unordered_map<std::uint64_t, copy> copies;
+        auto it = copies.find(o->id);
+        if ( it == copies.end() ) {
+            for (auto c = copies.begin(); c != copies.end(); ) {
+                c = c->second.from.expired() ? copies.erase(c) : std::next(c);
+            }
+            it = copies.emplace(o->id, copy{o, o->fn}).first;
+        }
+        return it->second.fn(std::forward<decltype(args)>(args)...);
+    };
+}
+
+/// A callable for a custom operator declared pure, made by pure_op()
+template<typename F>
+struct pure_op_fn {
+    F fn;
+};
+
+template<typename F>
+struct is_pure_op : std::false_type {};
+template<typename F>
+struct is_pure_op<pure_op_fn<F>> : std::true_type {};
+
+/// Declares the callable f, for a custom operator, pure: its result 
+/// depends only on its operands, and calling it has no effects. The values 
+/// of subtrees without variables whose operators are all pure may be 
+/// cached (see result_cache); the custom operators of other subtrees are 
+/// called each time they are evaluated
+template<typename F>
+pure_op_fn<std::decay_t<F>> pure_op(F&& f) {
+    return { std::forward<F>(f) };
+}
+
 /// Binary operators returning type T, with left and right operands of types A & B.
 template<typename T, typename A, typename B>
 class bin_op_expr : public expr<T> {
-    /// The C++ function;
-    /// uses the std::function type to store a function with parameters of types 
-    /// A & B and return type T
-    std::function<T(A,B)> fn;
-    /// The name of the operator
-    std::string name;
+    /// An operator supplied as an arbitrary C++ function
+    struct custom_op {
+        /// The C++ function;
+        /// uses the std::function type to store a function with parameters 
+        /// of types A & B and return type T
+        std::function<T(A,B)> fn;
+        /// The name of the operator
+        std::string name;
+        /// The heap memory held by `fn`
+        std::size_t fn_bytes;
+        /// Was it declared pure, with pure_op()?
+        bool pure;
+    };
+
+    template<typename F>
+    static std::shared_ptr<const custom_op> make_custom(F&& f, 
+                                                        const std::string& n) {
+        using D = std::decay_t<F>;
+        if constexpr ( is_pure_op<D>::value ) {
+            using G = decltype(f.fn);
+            return std::make_shared<const custom_op>(custom_op{
+                std::forward<F>(f).fn, n, function_heap_bytes<G>(), true});
+        } else {
+            return std::make_shared<const custom_op>(custom_op{
+                std::forward<F>(f), n, function_heap_bytes<F>(), false});
+        }
+    }
+
+    /// The operator; built-in operators are applied directly, `custom` 
+    /// operators call through `custom`
+    op code;
+    /// The custom operator, if any. 
+    /// It is immutable, so copies of this node share it
+    std::shared_ptr<const custom_op> custom;
     /// The left operand
-    std::unique_ptr<expr<A>> left_arg;
+    operand_ptr<A> left_arg;
     /// The right operand
-    std::unique_ptr<expr<B>> right_arg;
+    operand_ptr<B> right_arg;
+
+    /// Constructs a node with the operator of o & the given operands
+    bin_op_expr(const bin_op_expr& o, operand_ptr<A> l, operand_ptr<B> r)
+    : code(o.code), custom(o.custom), 
+      left_arg(std::move(l)), right_arg(std::move(r)) {}
+
+    /// applies the operator, other than && or ||, to l & r
+    T apply(const A& l, const B& r) const {
+        if ( code == op::custom ) return custom->fn(l, r);
+        return apply_op<T, A, B>(code, l, r);
+    }
 
 public:
-    /// Constructs a binary operator expression.
+    /// Constructs a built-in binary operator expression.
+    /// Will delete the passed-in pointers
+    bin_op_expr(op o, expr<A>* l, expr<B>* r)
+    : bin_op_expr(o, operand_ptr<A>(l), operand_ptr<B>(r)) {}
+
+    /// Constructs a built-in binary operator expression with operands 
+    /// which may be borrowed
+    bin_op_expr(op o, operand_ptr<A> l, operand_ptr<B> r)
+    : code(o), left_arg(std::move(l)), right_arg(std::move(r)) {
+        assert(( op_supported<T, A, B>(o) ));
+    }
+
+    /// Constructs a custom binary operator expression.
     /// Will delete the passed-in pointers
     /// The template parameter allows any object which can be stored in a 
     /// std::function to be used to construct the function
     template<typename F>
     bin_op_expr(
         F&& f, const std::string& n, expr<A>* l, expr<B>* r)
-    : fn(f), name(n), left_arg(l), right_arg(r) {}
+    : code(op::custom), custom(make_custom(std::forward<F>(f), n)), 
+      left_arg(l), right_arg(r) {}
 
     bin_op_expr(const bin_op_expr& o)
-    : fn(o.fn), name(o.name), left_arg(o.left_arg->clone()), 
+    : code(o.code), custom(o.custom), left_arg(o.left_arg->clone()), 
       right_arg(o.right_arg->clone()) {}
     
     bin_op_expr& operator= (const bin_op_expr& o) {
         if ( &o == this ) return *this;
         
-        fn = o.fn;
-        name = o.name;
-        // there's no assignment operator from raw pointer to unique_ptr
-        // `reset` replaces the contained pointer, though, after deleting
-        // the previously-contained pointer
-        left_arg.reset(o.left_arg->clone());
-        right_arg.reset(o.right_arg->clone());
+        code = o.code;
+        custom = o.custom;
+        // there's no assignment operator from raw pointer to unique_ptr, 
+        // so assign freshly-owned pointers, which also replaces any 
+        // borrowed operands
+        left_arg = operand_ptr<A>(o.left_arg->clone());
+        right_arg = operand_ptr<B>(o.right_arg->clone());
         
         return *this;
     }
@@ -113,98 +1516,521 @@ public:
     bin_op_expr(bin_op_expr&&) = default;
     bin_op_expr& operator= (bin_op_expr&&) = default;
 
-    T eval() const override {
-        return fn(left_arg->eval(), right_arg->eval());
+    using expr<T>::eval;
+
+    T eval(const env& vars) const override {
+        EXPR_PROFILE_EVAL();
+        if ( code == op::custom ) {
+            return custom->fn(left_arg->eval(vars), right_arg->eval(vars));
+        }
+        if constexpr ( op_applies<op::land, T, A, B> ) {
+            // && and || only evaluate their right operand if the left one 
+            // doesn't decide the result
+            if ( code == op::land ) {
+                return left_arg->eval(vars) && right_arg->eval(vars);
+            }
+            if ( code == op::lor ) {
+                return left_arg->eval(vars) || right_arg->eval(vars);
+            }
+        }
+        return apply_op<T, A, B>(
+            code, left_arg->eval(vars), right_arg->eval(vars));
+    }
+
+    T eval_parallel(const env& vars, const parallel_eval& p) const override {
+        parallel_eval::mode m = p.at(*this);
+        if ( m == parallel_eval::sequential ) return eval(vars);
+        if constexpr ( op_applies<op::land, T, A, B> ) {
+            // never forked, as the right operand may not be evaluated
+            if ( code == op::land ) {
+                return left_arg->eval_parallel(vars, p) 
+                    && right_arg->eval_parallel(vars, p);
+            }
+            if ( code == op::lor ) {
+                return left_arg->eval_parallel(vars, p) 
+                    || right_arg->eval_parallel(vars, p);
+            }
+        }
+        if ( m == parallel_eval::descend ) {
+            return apply(left_arg->eval_parallel(vars, p), 
+                         right_arg->eval_parallel(vars, p));
+        }
+        std::optional<A> l;
+        std::optional<B> r;
+        p.both([&]{ l.emplace(left_arg->eval_parallel(vars, p)); },
+               [&]{ r.emplace(right_arg->eval_parallel(vars, p)); });
+        return apply(*l, *r);
+    }
+
+    T eval_cached(const env& vars, const cached_eval& c) const override {
+        cached_eval::mode m = c.at(*this);
+        if ( m == cached_eval::direct ) return eval(vars);
+        if ( m == cached_eval::cached ) return c.value(*this, vars);
+        if constexpr ( op_applies<op::land, T, A, B> ) {
+            if ( code == op::land ) {
+                return left_arg->eval_cached(vars, c) 
+                    && right_arg->eval_cached(vars, c);
+            }
+            if ( code == op::lor ) {
+                return left_arg->eval_cached(vars, c) 
+                    || right_arg->eval_cached(vars, c);
+            }
+        }
+        return apply(left_arg->eval_cached(vars, c), 
+                     right_arg->eval_cached(vars, c));
+    }
+
+    void eval_block(const columns& cols, const row_block& rows, 
+                    T* out) const override {
+        if constexpr ( op_applies<op::land, T, A, B> ) {
+            if ( code == op::land || code == op::lor ) {
+                eval_logic_block(code, *left_arg, *right_arg, cols, rows, out);
+                return;
+            }
+        }
+        std::unique_ptr<A[]> l{new A[rows.n]};
+        std::unique_ptr<B[]> r{new B[rows.n]};
+        left_arg->eval_block(cols, rows, l.get());
+        right_arg->eval_block(cols, rows, r.get());
+        if ( code == op::custom ) {
+            for (std::size_t i = 0; i < rows.n; ++i) {
+                out[i] = custom->fn(l[i], r[i]);
+            }
+            return;
+        }
+        apply_op_block<T, A, B>(code, l.get(), r.get(), rows.n, out);
+    }
+
+    closure_ref<T> lower_closure(closure_buffer& b) const override {
+        switch ( code ) {
+        case op::add:  return lower_op<op::add>(b);
+        case op::sub:  return lower_op<op::sub>(b);
+        case op::mul:  return lower_op<op::mul>(b);
+        case op::div:  return lower_op<op::div>(b);
+        case op::mod:  return lower_op<op::mod>(b);
+        case op::eq:   return lower_op<op::eq>(b);
+        case op::ne:   return lower_op<op::ne>(b);
+        case op::lt:   return lower_op<op::lt>(b);
+        case op::le:   return lower_op<op::le>(b);
+        case op::gt:   return lower_op<op::gt>(b);
+        case op::ge:   return lower_op<op::ge>(b);
+        case op::land: return lower_op<op::land>(b);
+        case op::lor:  return lower_op<op::lor>(b);
+        case op::custom: break;
+        }
+        b.retain(custom);
+        const std::function<T(A,B)>* fn = &custom->fn;
+        closure_ref<A> l = left_arg->lower_closure(b);
+        closure_ref<B> r = right_arg->lower_closure(b);
+        return b.make<T>([fn, l, r](const cell* vars) {
+            return (*fn)(l(vars), r(vars));
+        });
+    }
+
+    node_kind kind() const override { return node_kind::bin_op; }
+
+    std::size_t arity() const override { return 2; }
+
+    const expr_node& operand(std::size_t i) const override {
+        if ( i == 0 ) return *left_arg;
+        return *right_arg;
+    }
+
+    op opcode() const override { return code; }
+
+    bin_op_expr* rebuild(expr_node* const* operands) const override {
+        return new bin_op_expr(*this, 
+            operand_ptr<A>(static_cast<expr<A>*>(operands[0])),
+            operand_ptr<B>(static_cast<expr<B>*>(operands[1])));
+    }
+
+    bin_op_expr* share(const expr_node* const* operands) const override {
+        return new bin_op_expr(*this, 
+            borrow(static_cast<const expr<A>*>(operands[0])),
+            borrow(static_cast<const expr<B>*>(operands[1])));
+    }
+
+    std::size_t local_memory(memory_seen& seen) const override {
+        std::size_t n = sizeof(*this);
+        if ( custom && seen.insert(custom.get()).second ) {
+            n += shared_block_bytes<custom_op>() + heap_bytes(custom->name)
+               + custom->fn_bytes;
+        }
+        return n;
+    }
+
+    std::size_t local_hash() const override {
+        std::size_t h = hash_combine(std::size_t(node_kind::bin_op), 
+                                     std::size_t(code));
+        return hash_combine(h, std::hash<const void*>{}(custom.get()));
+    }
+
+    bool local_equals(const expr_node& o) const override {
+        auto b = dynamic_cast<const bin_op_expr*>(&o);
+        return b && b->code == code && b->custom == custom;
+    }
+
+    bool local_pure() const override { return !custom || custom->pure; }
+
+    cell_fn cell_op() const override {
+        if ( code == op::custom ) {
+            auto c = custom;
+            return [c](cell l, cell r, value_pool& pool) {
+                return value_traits<T>::put(
+                    c->fn(value_traits<A>::get(l), value_traits<B>::get(r)), 
+                    pool);
+            };
+        }
+        op o = code;
+        return [o](cell l, cell r, value_pool& pool) {
+            return value_traits<T>::put(
+                apply_op<T, A, B>(
+                    o, value_traits<A>::get(l), value_traits<B>::get(r)), 
+                pool);
+        };
+    }
+
+    /// compiles this node, with built-in operator O, into closures in b
+    template<op O>
+    closure_ref<T> lower_op(closure_buffer& b) const {
+        if constexpr ( !op_applies<O, T, A, B> ) {
+            (void)b;
+            return unimplemented<closure_ref<T>>();
+        } else {
+            return with_operand(*left_arg, b, [&](auto l) {
+                return with_operand(*right_arg, b, [&](auto r) {
+                    return b.make<T>([l, r](const cell* vars) -> T {
+                        // && and || only evaluate their right operand if 
+                        // the left one doesn't decide the result
+                        if constexpr ( O == op::land ) {
+                            return l(vars) && r(vars);
+                        } else if constexpr ( O == op::lor ) {
+                            return l(vars) || r(vars);
+                        } else {
+                            return op_fn<O>{}(l(vars), r(vars));
+                        }
+                    });
+                });
+            });
+        }
+    }
+
+    /// the printed name of the operator
+    const char* name() const {
+        if ( code == op::custom ) return custom->name.c_str();
+        return op_name(code);
     }
 
+    const char* symbol() const override { return name(); }
+
     void print(std::ostream& out) const override {
-        out << "(" << *left_arg << " " << name << " " << *right_arg << ")";
+        out << "(" << *left_arg << " " << name() << " " << *right_arg << ")";
     }
 
     bin_op_expr* clone() const override {
-        return new bin_op_expr(fn, name, left_arg->clone(), right_arg->clone());
+        return new bin_op_expr(*this);
     }
 };
 
-/// Conditional expressions returning type T
+/// Conditional expressions returning type T.
+/// Only the branch selected by the condition is evaluated
 template<typename T>
 class if_expr : public expr<T> {
     /// The conditional expression
-    expr<bool>* cond;
+    operand_ptr<bool> cond;
     /// The expression to evaluate to if the condition is true
-    expr<T>* true_branch;
+    operand_ptr<T> true_branch;
     /// The expression to evaluate to if the condition is false
-    expr<T>* false_branch;
+    operand_ptr<T> false_branch;
+    /// Are both branches evaluated & blended in batch mode, rather than 
+    /// each evaluated on its own rows?
+    bool blend = false;
+
+    /// decides whether to blend the branches in batch mode
+    void plan_blend() {
+        std::size_t budget = blend_max_nodes;
+        blend = value_traits<T>::kind != value_kind::other
+            && can_speculate(*true_branch, budget)
+            && can_speculate(*false_branch, budget);
+    }
 
 public:
+    /// Constructs a conditional expression.
+    /// Will delete the passed-in pointers
     if_expr(expr<bool>* c, expr<T>* t, expr<T>* f)
     : cond(c), 
       true_branch(t), 
-      false_branch(f) {}
+      false_branch(f) {
+        plan_blend();
+    }
 
-    ~if_expr() {
-        delete cond;
-        delete true_branch;
-        delete false_branch;
+    /// Constructs a conditional expression with operands which may be 
+    /// borrowed
+    if_expr(operand_ptr<bool> c, operand_ptr<T> t, operand_ptr<T> f)
+    : cond(std::move(c)), 
+      true_branch(std::move(t)), 
+      false_branch(std::move(f)) {
+        plan_blend();
     }
 
     if_expr(const if_expr& o) 
-    : cond(o.cond), 
-      true_branch(o.true_branch), 
-      false_branch(o.false_branch) {}
+    : cond(o.cond->clone()), 
+      true_branch(o.true_branch->clone()), 
+      false_branch(o.false_branch->clone()),
+      blend(o.blend) {}
 
     if_expr& operator= (const if_expr& o) {
         if(&o == this) return *this;
-        delete cond;
-        delete true_branch;
-        delete false_branch;
-        cond = o.cond;
-        true_branch = o.true_branch;
-        false_branch = o.false_branch;
-        o.cond = nullptr;
-        o.true_branch = nullptr;
-        o.false_branch = nullptr;
+        cond = operand_ptr<bool>(o.cond->clone());
+        true_branch = operand_ptr<T>(o.true_branch->clone());
+        false_branch = operand_ptr<T>(o.false_branch->clone());
+        blend = o.blend;
         return *this;
     }
 
-    if_expr(if_expr&& o) 
-    : cond(std::move(o.cond)), 
-      true_branch(o.true_branch), 
-      false_branch(o.false_branch) {
-        o.true_branch = o.false_branch = nullptr;
-    }
+    if_expr(if_expr&&) = default;
+    if_expr& operator= (if_expr&&) = default;
 
-    if_expr& operator= (if_expr&& o) {
-        if(&o == this) return *this;
+    using expr<T>::eval;
 
-        delete true_branch;
-        delete false_branch;
+    T eval(const env& vars) const override {
+        EXPR_PROFILE_EVAL();
+        if(cond->eval(vars)) {
+            return true_branch->eval(vars);
+        }
+        return false_branch->eval(vars);
+    }
 
-        cond = std::move(o.cond);
-        true_branch = o.true_branch;
-        false_branch = o.false_branch;
-        o.true_branch = o.false_branch = nullptr;
+    T eval_parallel(const env& vars, const parallel_eval& p) const override {
+        if ( p.at(*this) == parallel_eval::sequential ) return eval(vars);
+        if ( cond->eval_parallel(vars, p) ) {
+            return true_branch->eval_parallel(vars, p);
+        }
+        return false_branch->eval_parallel(vars, p);
+    }
 
-        return *this;
+    T eval_cached(const env& vars, const cached_eval& c) const override {
+        cached_eval::mode m = c.at(*this);
+        if ( m == cached_eval::direct ) return eval(vars);
+        if ( m == cached_eval::cached ) return c.value(*this, vars);
+        if ( cond->eval_cached(vars, c) ) {
+            return true_branch->eval_cached(vars, c);
+        }
+        return false_branch->eval_cached(vars, c);
     }
 
-    T eval() const override {
-        if(cond) {
-            return true_branch->eval();
+    void eval_block(const columns& cols, const row_block& rows, 
+                    T* out) const override {
+        std::unique_ptr<bool[]> c{new bool[rows.n]};
+        cond->eval_block(cols, rows, c.get());
+        std::size_t n_true = std::count(c.get(), c.get() + rows.n, true);
+        if ( n_true == rows.n ) return true_branch->eval_block(cols, rows, out);
+        if ( n_true == 0 ) return false_branch->eval_block(cols, rows, out);
+        std::unique_ptr<T[]> vals{new T[rows.n]};
+        if ( blend ) {
+            // small, safe branches are cheaper to evaluate on every row 
+            // than to split the rows between, and blending them has no 
+            // branches to mispredict
+            true_branch->eval_block(cols, rows, out);
+            false_branch->eval_block(cols, rows, vals.get());
+            select_block(c.get(), out, vals.get(), rows.n, out);
+            return;
         }
-        return false_branch->eval();
+        // each branch is evaluated on its own rows, then merged
+        row_subset t{rows, c.get(), true};
+        true_branch->eval_block(cols, t.rows, vals.get());
+        t.scatter(vals.get(), out);
+        row_subset f{rows, c.get(), false};
+        false_branch->eval_block(cols, f.rows, vals.get());
+        f.scatter(vals.get(), out);
+    }
+
+    closure_ref<T> lower_closure(closure_buffer& b) const override {
+        closure_ref<bool> c = cond->lower_closure(b);
+        closure_ref<T> t = true_branch->lower_closure(b);
+        closure_ref<T> f = false_branch->lower_closure(b);
+        return b.make<T>([c, t, f](const cell* vars) {
+            return c(vars) ? t(vars) : f(vars);
+        });
+    }
+
+    node_kind kind() const override { return node_kind::cond; }
+
+    std::size_t arity() const override { return 3; }
+
+    const expr_node& operand(std::size_t i) const override {
+        if(i == 0) return *cond;
+        if(i == 1) return *true_branch;
+        return *false_branch;
+    }
+
+    if_expr* rebuild(expr_node* const* operands) const override {
+        return new if_expr(
+            static_cast<expr<bool>*>(operands[0]),
+            static_cast<expr<T>*>(operands[1]),
+            static_cast<expr<T>*>(operands[2]));
+    }
+
+    if_expr* share(const expr_node* const* operands) const override {
+        return new if_expr(
+            borrow(static_cast<const expr<bool>*>(operands[0])),
+            borrow(static_cast<const expr<T>*>(operands[1])),
+            borrow(static_cast<const expr<T>*>(operands[2])));
+    }
+
+    std::size_t local_memory(memory_seen&) const override {
+        return sizeof(*this);
+    }
+
+    std::size_t local_hash() const override {
+        return hash_combine(std::size_t(node_kind::cond), 
+                            std::size_t(value_traits<T>::kind));
+    }
+
+    bool local_equals(const expr_node& o) const override {
+        return dynamic_cast<const if_expr*>(&o) != nullptr;
     }
 
     void print(std::ostream& out) const override {
-        if(cond) {
-            out << "true";
-        }
-        else {
-            out << "false";
-        }
+        // parenthesized, so an operator after it isn't read as part of the
+        // false branch
+        out << "(if " << *cond << " " << *true_branch 
+            << " else " << *false_branch << ")";
     }
 
     if_expr* clone() const override {
         return new if_expr(*this);
     }
-};
\ No newline at end of file
+};
+
+/// Short-circuiting boolean connectives; O is op::land or op::lor.
+/// The right operand is only evaluated if the left one does not decide 
+/// the result
+template<op O>
+class logic_expr : public expr<bool> {
+    static_assert(O == op::land || O == op::lor, "not a boolean connective");
+
+    /// The left operand
+    operand_ptr<bool> left_arg;
+    /// The right operand
+    operand_ptr<bool> right_arg;
+
+public:
+    /// Constructs a boolean connective.
+    /// Will delete the passed-in pointers
+    logic_expr(expr<bool>* l, expr<bool>* r)
+    : left_arg(l), right_arg(r) {}
+
+    /// Constructs a boolean connective with operands which may be borrowed
+    logic_expr(operand_ptr<bool> l, operand_ptr<bool> r)
+    : left_arg(std::move(l)), right_arg(std::move(r)) {}
+
+    logic_expr(const logic_expr& o)
+    : left_arg(o.left_arg->clone()), right_arg(o.right_arg->clone()) {}
+
+    logic_expr& operator= (const logic_expr& o) {
+        if ( &o == this ) return *this;
+        left_arg = operand_ptr<bool>(o.left_arg->clone());
+        right_arg = operand_ptr<bool>(o.right_arg->clone());
+        return *this;
+    }
+
+    logic_expr(logic_expr&&) = default;
+    logic_expr& operator= (logic_expr&&) = default;
+
+    using expr<bool>::eval;
+
+    bool eval(const env& vars) const override {
+        EXPR_PROFILE_EVAL();
+        if ( O == op::land ) return left_arg->eval(vars) && right_arg->eval(vars);
+        return left_arg->eval(vars) || right_arg->eval(vars);
+    }
+
+    bool eval_parallel(const env& vars, const parallel_eval& p) const override {
+        if ( p.at(*this) == parallel_eval::sequential ) return eval(vars);
+        bool l = left_arg->eval_parallel(vars, p);
+        if ( O == op::land ? !l : l ) return l;
+        return right_arg->eval_parallel(vars, p);
+    }
+
+    bool eval_cached(const env& vars, const cached_eval& c) const override {
+        cached_eval::mode m = c.at(*this);
+        if ( m == cached_eval::direct ) return eval(vars);
+        if ( m == cached_eval::cached ) return c.value(*this, vars);
+        bool l = left_arg->eval_cached(vars, c);
+        if ( O == op::land ? !l : l ) return l;
+        return right_arg->eval_cached(vars, c);
+    }
+
+    void eval_block(const columns& cols, const row_block& rows, 
+                    bool* out) const override {
+        eval_logic_block(O, *left_arg, *right_arg, cols, rows, out);
+    }
+
+    closure_ref<bool> lower_closure(closure_buffer& b) const override {
+        closure_ref<bool> l = left_arg->lower_closure(b);
+        closure_ref<bool> r = right_arg->lower_closure(b);
+        return b.make<bool>([l, r](const cell* vars) {
+            return O == op::land ? l(vars) && r(vars) : l(vars) || r(vars);
+        });
+    }
+
+    node_kind kind() const override { return node_kind::bin_op; }
+
+    std::size_t arity() const override { return 2; }
+
+    const expr_node& operand(std::size_t i) const override {
+        if ( i == 0 ) return *left_arg;
+        return *right_arg;
+    }
+
+    op opcode() const override { return O; }
+
+    logic_expr* rebuild(expr_node* const* operands) const override {
+        return new logic_expr(
+            static_cast<expr<bool>*>(operands[0]),
+            static_cast<expr<bool>*>(operands[1]));
+    }
+
+    logic_expr* share(const expr_node* const* operands) const override {
+        return new logic_expr(
+            borrow(static_cast<const expr<bool>*>(operands[0])),
+            borrow(static_cast<const expr<bool>*>(operands[1])));
+    }
+
+    std::size_t local_memory(memory_seen&) const override {
+        return sizeof(*this);
+    }
+
+    std::size_t local_hash() const override {
+        return hash_combine(std::size_t(node_kind::bin_op), std::size_t(O));
+    }
+
+    bool local_equals(const expr_node& o) const override {
+        return dynamic_cast<const logic_expr*>(&o) != nullptr;
+    }
+
+    cell_fn cell_op() const override {
+        return [](cell l, cell r, value_pool&) {
+            cell c;
+            c.b = O == op::land ? l.b && r.b : l.b || r.b;
+            return c;
+        };
+    }
+
+    const char* symbol() const override { return op_name(O); }
+
+    void print(std::ostream& out) const override {
+        out << "(" << *left_arg << " " << op_name(O) << " " << *right_arg << ")";
+    }
+
+    logic_expr* clone() const override {
+        return new logic_expr(*this);
+    }
+};
+
+/// Short-circuiting boolean and
+using and_expr = logic_expr<op::land>;
+
+/// Short-circuiting boolean or
+using or_expr = logic_expr<op::lor>;
@@ -0,0 +1,312 @@
+#pragma once
+
+// flat, index-based storage for expression trees
+
+#include "expr.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+
+/// A pool of expression nodes, stored as a struct of arrays in a single
+/// block of memory. Nodes refer to their operands by index rather than by
+/// pointer, so a whole pool can be freed at once or copied with one memcpy.
+///
+/// The pool holds constants & variables of type bool, int & double, the 
+/// built-in operators on them (those listed in EXPR_CELL_OPS) and 
+/// conditionals;
+/// custom operators & boxed values need the pointer-based expr<T> nodes.
+/// Operands must be added before the nodes which use them.
+class expr_arena {
+public:
+    /// The index of a node in the pool
+    using node = std::uint32_t;
+
+private:
+    /// Node codes; codes from `first_cell_op` on are built-in operators,
+    /// offset by their cell_instr
+    enum : std::uint8_t { constant_code, var_code, cond_code, first_cell_op };
+
+    /// The single block of storage, holding the arrays below
+    std::unique_ptr<unsigned char[]> block;
+    /// The number of nodes in the pool
+    std::uint32_t n = 0;
+    /// The number of nodes the block has room for
+    std::uint32_t cap = 0;
+
+    // The arrays, each of length `cap`, in decreasing order of alignment
+
+    /// The value of each constant node, and the env slot of each variable
+    cell* values = nullptr;
+    /// The first operand of each operator & conditional node
+    node* first = nullptr;
+    /// The second operand of each operator & conditional node
+    node* second = nullptr;
+    /// The third operand of each conditional node
+    node* third = nullptr;
+    /// The type each node evaluates to
+    value_kind* kinds = nullptr;
+    /// The code of each node
+    std::uint8_t* codes = nullptr;
+
+    static_assert(alignof(cell) >= alignof(node)
+                  && alignof(node) >= alignof(value_kind),
+                  "each array must be aligned for the one after it");
+
+    /// the bytes used by each node
+    static constexpr std::size_t node_size = sizeof(cell) + 3 * sizeof(node)
+        + sizeof(value_kind) + sizeof(std::uint8_t);
+
+    /// points the arrays into the block
+    void carve() {
+        unsigned char* p = block.get();
+        values = reinterpret_cast<cell*>(p);
+        p += std::size_t(cap) * sizeof(cell);
+        first = reinterpret_cast<node*>(p);
+        p += std::size_t(cap) * sizeof(node);
+        second = reinterpret_cast<node*>(p);
+        p += std::size_t(cap) * sizeof(node);
+        third = reinterpret_cast<node*>(p);
+        p += std::size_t(cap) * sizeof(node);
+        kinds = reinterpret_cast<value_kind*>(p);
+        p += std::size_t(cap) * sizeof(value_kind);
+        codes = p;
+    }
+
+    /// doubles the capacity of the pool
+    void grow() {
+        expr_arena old = std::move(*this);
+        cap = old.cap == 0 ? 16 : old.cap * 2;
+        n = old.n;
+        block.reset(new unsigned char[cap * node_size]);
+        carve();
+        if ( n == 0 ) return;
+        std::memcpy(values, old.values, n * sizeof(cell));
+        std::memcpy(first, old.first, n * sizeof(node));
+        std::memcpy(second, old.second, n * sizeof(node));
+        std::memcpy(third, old.third, n * sizeof(node));
+        std::memcpy(kinds, old.kinds, n * sizeof(value_kind));
+        std::memcpy(codes, old.codes, n);
+    }
+
+    /// appends a node, returning its index
+    node add(std::uint8_t code, value_kind k, node a = 0, node b = 0,
+             node c = 0) {
+        if ( n == cap ) grow();
+        codes[n] = code;
+        kinds[n] = k;
+        first[n] = a;
+        second[n] = b;
+        third[n] = c;
+        return n++;
+    }
+
+    cell eval_cell(node i, const cell* vars) const {
+        switch ( codes[i] ) {
+        case constant_code:
+            return values[i];
+        case var_code:
+            return vars[values[i].i];
+        case cond_code:
+            return eval_cell(eval_cell(first[i], vars).b ? second[i] : third[i],
+                             vars);
+        case first_cell_op + int(cell_instr::and_b): {
+            cell l = eval_cell(first[i], vars);
+            return l.b ? eval_cell(second[i], vars) : l;
+        }
+        case first_cell_op + int(cell_instr::or_b): {
+            cell l = eval_cell(first[i], vars);
+            return l.b ? l : eval_cell(second[i], vars);
+        }
+        }
+        cell l = eval_cell(first[i], vars);
+        cell r = eval_cell(second[i], vars);
+        cell out;
+        switch ( cell_instr(codes[i] - first_cell_op) ) {
+#define EXPR_ARENA_OP(name, code, arg, res, sym) \
+        case cell_instr::name: out.res = l.arg sym r.arg; break;
+        EXPR_CELL_OPS(EXPR_ARENA_OP)
+#undef EXPR_ARENA_OP
+        }
+        return out;
+    }
+
+    void print_node(std::ostream& out, node i) const {
+        switch ( codes[i] ) {
+        case constant_code:
+            switch ( kinds[i] ) {
+            case value_kind::boolean: out << (values[i].b ? "true" : "false"); break;
+            case value_kind::integer: out << values[i].i; break;
+            case value_kind::real: out << values[i].d; break;
+            case value_kind::other: break;
+            }
+            return;
+        case var_code:
+            out << "$" << values[i].i;
+            return;
+        case cond_code:
+            // parenthesized, as if_expr::print() does, so nested
+            // conditionals aren't ambiguous
+            out << "(if ";
+            print_node(out, first[i]);
+            out << " ";
+            print_node(out, second[i]);
+            out << " else ";
+            print_node(out, third[i]);
+            out << ")";
+            return;
+        }
+        static const char* const names[] = {
+#define EXPR_ARENA_OP(name, code, arg, res, sym) #sym,
+            EXPR_CELL_OPS(EXPR_ARENA_OP)
+#undef EXPR_ARENA_OP
+        };
+        out << "(";
+        print_node(out, first[i]);
+        out << " " << names[codes[i] - first_cell_op] << " ";
+        print_node(out, second[i]);
+        out << ")";
+    }
+
+public:
+    expr_arena() = default;
+
+    /// copies the pool with a single allocation & memcpy
+    expr_arena(const expr_arena& o)
+    : block(o.cap ? new unsigned char[o.cap * node_size] : nullptr),
+      n(o.n), cap(o.cap) {
+        if ( cap ) {
+            carve();
+            std::memcpy(block.get(), o.block.get(), cap * node_size);
+        }
+    }
+
+    expr_arena& operator= (const expr_arena& o) {
+        if ( &o == this ) return *this;
+        expr_arena tmp{o};
+        return *this = std::move(tmp);
+    }
+
+    expr_arena(expr_arena&& o)
+    : block(std::move(o.block)), n(o.n), cap(o.cap) {
+        carve();
+        o.n = o.cap = 0;
+        o.carve();
+    }
+
+    expr_arena& operator= (expr_arena&& o) {
+        if ( &o == this ) return *this;
+        block = std::move(o.block);
+        n = o.n;
+        cap = o.cap;
+        carve();
+        o.n = o.cap = 0;
+        o.carve();
+        return *this;
+    }
+
+    /// adds a constant of type bool, int or double
+    template<typename T>
+    node constant(const T& v) {
+        static_assert(value_traits<T>::kind != value_kind::other,
+            "expr_arena only stores bool, int & double values");
+        node i = add(constant_code, value_traits<T>::kind);
+        value_pool unused;
+        values[i] = value_traits<T>::put(v, unused);
+        return i;
+    }
+
+    /// adds a variable of type bool, int or double, read from the given 
+    /// env slot
+    template<typename T>
+    node var(std::size_t slot) {
+        static_assert(value_traits<T>::kind != value_kind::other,
+            "expr_arena only stores bool, int & double values");
+        node i = add(var_code, value_traits<T>::kind);
+        values[i].i = int(slot);
+        return i;
+    }
+
+    /// adds a built-in binary operator, which must be one of EXPR_CELL_OPS
+    node bin_op(op o, node l, node r) {
+        assert(l < n && r < n && kinds[l] == kinds[r]);
+        value_kind res = is_comparison(o) ? value_kind::boolean : kinds[l];
+        int native = find_cell_op(o, kinds[l], res);
+        assert(native >= 0);
+        return add(std::uint8_t(first_cell_op + native), res, l, r);
+    }
+
+    /// adds a conditional
+    node cond(node c, node t, node f) {
+        assert(c < n && t < n && f < n);
+        assert(kinds[c] == value_kind::boolean && kinds[t] == kinds[f]);
+        return add(cond_code, kinds[t], c, t, f);
+    }
+
+    /// copies the tree e into the pool, returning its root;
+    /// e must only use the nodes the pool can hold
+    node copy(const expr_node& e) {
+        switch ( e.kind() ) {
+        case node_kind::constant: {
+            assert(e.result_kind() != value_kind::other);
+            value_pool unused;
+            node i = add(constant_code, e.result_kind());
+            values[i] = e.value(unused);
+            return i;
+        }
+        case node_kind::var: {
+            assert(e.result_kind() != value_kind::other);
+            node i = add(var_code, e.result_kind());
+            values[i].i = int(e.slot());
+            return i;
+        }
+        case node_kind::bin_op: {
+            int native = find_cell_op(e);
+            assert(native >= 0);
+            node l = copy(e.operand(0));
+            node r = copy(e.operand(1));
+            return add(std::uint8_t(first_cell_op + native), e.result_kind(),
+                l, r);
+        }
+        case node_kind::cond: {
+            node c = copy(e.operand(0));
+            node t = copy(e.operand(1));
+            node f = copy(e.operand(2));
+            return add(cond_code, e.result_kind(), c, t, f);
+        }
+        }
+        return unimplemented<node>();
+    }
+
+    /// evaluates the tree rooted at i, which must be of type T
+    template<typename T>
+    T eval(node i) const {
+        return eval<T>(i, env());
+    }
+
+    /// evaluates the tree rooted at i, which must be of type T, reading its 
+    /// variables from vars
+    template<typename T>
+    T eval(node i, const env& vars) const {
+        assert(i < n && kinds[i] == value_traits<T>::kind);
+        return value_traits<T>::get(eval_cell(i, vars.data()));
+    }
+
+    /// the type node i evaluates to
+    value_kind result_kind(node i) const { return kinds[i]; }
+
+    /// the number of nodes in the pool
+    std::size_t size() const { return n; }
+
+    /// the bytes of storage the pool holds
+    std::size_t capacity_bytes() const { return cap * node_size; }
+
+    /// removes every node, keeping the storage for reuse
+    void clear() { n = 0; }
+
+    /// prints the tree rooted at i; variables are printed as $<slot>
+    void print(std::ostream& out, node i) const {
+        print_node(out, i);
+    }
+};
@@ -0,0 +1,63 @@
+#include "expr_arena.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+int main() {
+    expr_arena pool;
+
+    // nodes are built bottom-up, referring to their operands by index
+    auto two = pool.constant(2);
+    auto cond = pool.bin_op(op::eq,
+        pool.bin_op(op::add, two, two),
+        pool.constant(4));
+    auto root = pool.cond(cond, pool.constant(1.5), pool.constant(-1.5));
+    pool.print(std::cout, root);
+    std::cout << "\n = " << pool.eval<double>(root) << std::endl;
+    assert(pool.eval<bool>(cond));
+    assert(pool.eval<double>(root) == 1.5);
+
+    // conditionals print in parentheses, so nesting them is unambiguous
+    auto nested = pool.cond(pool.constant(true),
+        pool.cond(pool.constant(false), pool.constant(1), pool.constant(2)),
+        pool.constant(3));
+    std::ostringstream text;
+    pool.print(text, nested);
+    assert(text.str() == "(if true (if false 1 else 2) else 3)");
+    assert(pool.eval<int>(nested) == 2);
+
+    // trees built from expr nodes can be copied in
+    if_expr<int> tree = {
+        new bin_op_expr<bool, int, int>(
+            op::lt,
+            new bin_op_expr<int, int, int>(
+                op::mul, new const_expr<int>(8), new const_expr<int>(5)),
+            new const_expr<int>(40)
+        ),
+        new const_expr<int>(1),
+        new bin_op_expr<int, int, int>(
+            op::sub, new const_expr<int>(0), new const_expr<int>(1))
+    };
+    auto copied = pool.copy(tree);
+    pool.print(std::cout, copied);
+    std::cout << "\n = " << pool.eval<int>(copied) << std::endl;
+    assert(pool.eval<int>(copied) == tree.eval());
+
+    // copies are independent of the original
+    expr_arena snapshot = pool;
+    pool.clear();
+    assert(pool.size() == 0);
+    assert(snapshot.eval<int>(copied) == -1);
+    assert(snapshot.eval<double>(root) == 1.5);
+
+    // cleared storage is reused, and grows past its initial capacity
+    auto sum = pool.constant(0);
+    for (int i = 1; i <= 100; ++i) {
+        sum = pool.bin_op(op::add, sum, pool.constant(i));
+    }
+    assert(pool.eval<int>(sum) == 5050);
+    std::cout << pool.size() << " nodes in " << pool.capacity_bytes()
+              << " bytes = " << pool.eval<int>(sum) << std::endl;
+}
@@ -0,0 +1,123 @@
+#include "expr.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// the number of calls of `counted`
+int calls = 0;
+
+/// wrapper function for subtraction, counting its calls
+int counted(int a, int b) {
+    ++calls;
+    return a - b;
+}
+
+/// wrapper function for string concatenation
+std::string concat(std::string a, std::string b) { return a + b; }
+
+/// checks that batch evaluation agrees with evaluating each row on its own,
+/// and calls custom operators as many times
+template<typename T>
+void check(const expr<T>& e, const var_scope& scope, const columns& cols,
+           const std::vector<env>& rows) {
+    std::unique_ptr<T[]> out{new T[rows.size()]};
+    calls = 0;
+    e.eval_batch(cols, rows.size(), out.get());
+    int batch_calls = calls;
+    calls = 0;
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+        assert(out[i] == e.eval(rows[i]));
+    }
+    std::cout << e << " over " << rows.size() << " rows, " 
+              << scope.size() << " variables" << std::endl;
+    assert(batch_calls == calls);
+}
+
+int main() {
+    // more rows than fit in one block, so the last block is partial
+    const std::size_t n = 2 * batch_block_rows + 37;
+    std::vector<int> xs(n), ys(n);
+    std::vector<double> ws(n);
+    std::vector<std::string> names(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        xs[i] = int(i * 7919 % 201) - 100;
+        ys[i] = int(i % 5) - 2;
+        ws[i] = double(i) / 8;
+        names[i] = i % 3 ? "row" : "";
+    }
+
+    var_scope scope;
+    auto x = scope.var<int>("x");
+    auto y = scope.var<int>("y");
+    auto w = scope.var<double>("w");
+    auto name = scope.var<std::string>("name");
+
+    columns cols = scope.make_columns();
+    cols.set(x->slot(), xs.data());
+    cols.set(y->slot(), ys.data());
+    cols.set(w->slot(), ws.data());
+    cols.set(name->slot(), names.data());
+    std::vector<env> rows(n, scope.make_env());
+    for (std::size_t i = 0; i < n; ++i) {
+        rows[i].set(x->slot(), xs[i]);
+        rows[i].set(y->slot(), ys[i]);
+        rows[i].set(w->slot(), ws[i]);
+        rows[i].set(name->slot(), names[i]);
+    }
+
+    // built-in arithmetic & a custom operator
+    bin_op_expr<int, int, int> arith = {
+        op::add,
+        new bin_op_expr<int, int, int>(op::mul, x->clone(), y->clone()),
+        new bin_op_expr<int, int, int>(
+            counted, "-", x->clone(), new const_expr<int>(3))
+    };
+    check(arith, scope, cols, rows);
+
+    // each branch only sees its own rows: the division by y is never 
+    // evaluated where y is zero, & the custom operator only runs on the 
+    // rows of its branch
+    if_expr<int> guarded = {
+        new bin_op_expr<bool, int, int>(op::ne, y->clone(), new const_expr<int>(0)),
+        new bin_op_expr<int, int, int>(op::div, x->clone(), y->clone()),
+        new bin_op_expr<int, int, int>(counted, "-", x->clone(), y->clone())
+    };
+    check(guarded, scope, cols, rows);
+
+    // && & || only evaluate their right operands where the left ones don't 
+    // decide the result
+    or_expr either = {
+        new bin_op_expr<bool, int, int>(op::eq, y->clone(), new const_expr<int>(0)),
+        new and_expr(
+            new bin_op_expr<bool, int, int>(
+                op::gt,
+                new bin_op_expr<int, int, int>(op::mod, x->clone(), y->clone()),
+                new const_expr<int>(0)),
+            new bin_op_expr<bool, double, double>(
+                op::lt, w->clone(), new const_expr<double>(100.0)))
+    };
+    check(either, scope, cols, rows);
+
+    // boxed values, with nested conditionals
+    if_expr<std::string> greeting = {
+        new bin_op_expr<bool, std::string, std::string>(
+            op::eq, name->clone(), new const_expr<std::string>("")),
+        new const_expr<std::string>("nobody"),
+        new if_expr<std::string>(
+            new bin_op_expr<bool, int, int>(op::lt, x, new const_expr<int>(0)),
+            new bin_op_expr<std::string, std::string, std::string>(
+                concat, "++", name, new const_expr<std::string>("-")),
+            new const_expr<std::string>("plus"))
+    };
+    check(greeting, scope, cols, rows);
+
+    // a constant tree fills the output
+    const_expr<double> pi{3.25};
+    check(pi, scope, cols, rows);
+
+    delete y;
+    delete w;
+}
@@ -0,0 +1,454 @@
+#include "expr.hpp"
+#include "expr_bytecode.hpp"
+#include "expr_cache.hpp"
+#include "expr_jit.hpp"
+#include "expr_mapped.hpp"
+#include "expr_parallel.hpp"
+#include "expr_parse.hpp"
+#include "expr_regvm.hpp"
+#include "expr_serialize.hpp"
+#include "expr_variant.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Usage: expr_bench [--format table|csv|json] [--min-ms N]
+//
+// Times evaluation on each engine, and cloning, printing, parsing,
+// loading & destroying trees, over trees of a range of depths, widths &
+// operator mixes; then the throughput of evaluating one tree from 1 to N
+// threads at once, and of evaluating many trees with eval_all() on pools
+// of 1 to N threads, N being the number of hardware threads. Each result is
+// reported as the mean time per operation & the number of heap
+// allocations per operation (frees, for destruction); csv & json output
+// is meant for comparing runs, e.g. to catch regressions
+
+/// The number of heap allocations & frees made so far
+static std::atomic<std::size_t> allocations{0};
+static std::atomic<std::size_t> frees{0};
+
+// GCC pairs the malloc below with the sized deletes inlined into callers,
+// and wrongly reports them as mismatched
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t n) {
+    ++allocations;
+    if ( void* p = std::malloc(n ? n : 1) ) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    if ( p ) ++frees;
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+
+/// wrapper function for addition
+int plus(int a, int b) { return a + b; }
+
+/// wrapper function for equality
+bool equals(int a, int b) { return a == b; }
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// Which binary operators a benchmark tree uses
+enum class mix { builtin, custom, mixed };
+
+const char* mix_name(mix m) {
+    switch ( m ) {
+    case mix::builtin: return "builtin";
+    case mix::custom: return "custom";
+    case mix::mixed: return "mixed";
+    }
+    return "?";
+}
+
+/// The shape of a benchmark tree
+struct shape {
+    mix ops;
+    /// The depth of each arithmetic subtree
+    int depth;
+    /// The number of comparisons joined by &&
+    int width;
+};
+
+/// Builds benchmark trees, choosing operators by the mix
+class tree_builder {
+    mix ops;
+    /// The number of binary nodes built, to alternate in the mixed case
+    std::size_t n = 0;
+
+    bool builtin() {
+        ++n;
+        return ops == mix::builtin || (ops == mix::mixed && n % 2 == 0);
+    }
+
+    /// builds a binary operator node, either from a built-in opcode or from
+    /// the equivalent wrapper function, named as in bench_ops()
+    template<typename T, typename F>
+    expr<T>* bin(op o, F f, const char* name, expr<int>* l, expr<int>* r) {
+        if ( builtin() ) return new bin_op_expr<T, int, int>(o, l, r);
+        return new bin_op_expr<T, int, int>(f, name, l, r);
+    }
+
+public:
+    explicit tree_builder(mix ops) : ops(ops) {}
+
+    /// builds a balanced tree of `depth` levels of alternating + and *
+    /// over small constants
+    expr<int>* arith(int depth) {
+        if ( depth == 0 ) return new const_expr<int>(depth + 1);
+        if ( depth % 2 == 0 ) {
+            return bin<int>(op::add, plus, "heavy_add",
+                            arith(depth - 1), arith(depth - 1));
+        }
+        return bin<int>(op::mul, mult, "heavy_mul",
+                        arith(depth - 1), new const_expr<int>(1));
+    }
+
+    /// builds a rule in the shape of those in expr_test.cpp, with `width`
+    /// conditions: if (arith == arith && ...) then 1 else 0
+    expr<int>* rule(int depth, int width) {
+        expr<bool>* cond = nullptr;
+        for (int i = 0; i < width; ++i) {
+            expr<bool>* c = bin<bool>(op::eq, equals, "heavy_eq",
+                                      arith(depth), arith(depth));
+            cond = cond ? new and_expr(cond, c) : c;
+        }
+        return new if_expr<int>(
+            cond, new const_expr<int>(1), new const_expr<int>(0));
+    }
+};
+
+/// the number of nodes in the tree rooted at e
+std::size_t count_nodes(const expr_node& e) {
+    std::size_t n = 1;
+    for (std::size_t i = 0; i < e.arity(); ++i) n += count_nodes(e.operand(i));
+    return n;
+}
+
+/// The custom operators of benchmark trees, for reading them back; they
+/// bind as tightly as the built-in operators they stand in for
+const op_registry& bench_ops() {
+    static op_registry ops;
+    if ( !ops.find_op("heavy_add") ) {
+        ops.define_op<int, int, int>("heavy_add", plus, 5);
+        ops.define_op<int, int, int>("heavy_mul", mult, 6);
+        ops.define_op<bool, int, int>("heavy_eq", equals, 3);
+    }
+    return ops;
+}
+
+/// Keeps the optimizer from discarding benchmark results
+volatile long sink;
+
+/// The minimum time each measurement runs for
+static double min_ns = 20e6;
+
+/// A measurement: the mean time & allocations per operation
+struct measurement {
+    double ns;
+    double allocs;
+};
+
+/// runs f, which performs `per_call` operations per call, until it has run
+/// for at least min_ns, and reports the mean cost of an operation
+template<typename F>
+measurement measure(F&& f, long per_call = 1) {
+    long iters = 1;
+    for (;;) {
+        long acc = 0;
+        std::size_t start_allocs = allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iters; ++i) acc += f();
+        auto end = std::chrono::steady_clock::now();
+        sink = acc;
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if ( ns >= min_ns || iters >= (1L << 30) ) {
+            double ops = double(iters) * double(per_call);
+            return { ns / ops, double(allocations - start_allocs) / ops };
+        }
+        iters *= 2;
+    }
+}
+
+/// runs f, which performs one operation per call, on `threads` threads at
+/// once until they have run for at least min_ns, and reports the wall time
+/// per operation over all of them: the inverse of the throughput
+template<typename F>
+measurement measure_threads(int threads, F&& f) {
+    long iters = 1;
+    for (;;) {
+        std::atomic<bool> go{false};
+        std::atomic<long> acc{0};
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&]{
+                while ( !go ) std::this_thread::yield();
+                long a = 0;
+                for (long i = 0; i < iters; ++i) a += f();
+                acc += a;
+            });
+        }
+        std::size_t start_allocs = allocations;
+        auto start = std::chrono::steady_clock::now();
+        go = true;
+        for (std::thread& w : workers) w.join();
+        auto end = std::chrono::steady_clock::now();
+        std::size_t allocs = allocations - start_allocs;
+        sink = acc;
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if ( ns >= min_ns || iters >= (1L << 30) ) {
+            double ops = double(iters) * threads;
+            return { ns / ops, double(allocs) / ops };
+        }
+        iters *= 2;
+    }
+}
+
+/// Times clone() & destruction together, as every clone must be deleted;
+/// clones are made & deleted in groups so the two can be timed apart
+struct lifecycle {
+    measurement clone;
+    measurement destroy;
+};
+
+template<typename T>
+lifecycle measure_lifecycle(const expr<T>& e) {
+    const std::size_t group = 64;
+    std::vector<expr<T>*> copies(group);
+    double clone_ns = 0, destroy_ns = 0;
+    std::size_t clone_allocs = 0, destroy_frees = 0;
+    long ops = 0;
+    while ( clone_ns + destroy_ns < min_ns ) {
+        std::size_t a = allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (auto& c : copies) c = e.clone();
+        auto mid = std::chrono::steady_clock::now();
+        clone_allocs += allocations - a;
+        std::size_t f = frees;
+        for (auto c : copies) delete c;
+        auto end = std::chrono::steady_clock::now();
+        clone_ns += std::chrono::duration<double, std::nano>(mid - start).count();
+        destroy_ns += std::chrono::duration<double, std::nano>(end - mid).count();
+        destroy_frees += frees - f;
+        ops += long(group);
+    }
+    return {
+        { clone_ns / ops, double(clone_allocs) / ops },
+        { destroy_ns / ops, double(destroy_frees) / ops }
+    };
+}
+
+/// Writes results in the chosen format
+class reporter {
+public:
+    enum format { table, csv, json };
+
+private:
+    format fmt;
+    bool first = true;
+
+public:
+    explicit reporter(format fmt) : fmt(fmt) {
+        switch ( fmt ) {
+        case table:
+            std::printf("%-8s %5s %5s %6s %-10s %12s %10s %12s\n", "ops",
+                "depth", "width", "nodes", "metric", "ns/op", "allocs/op",
+                "MB/s");
+            break;
+        case csv:
+            std::printf("ops,depth,width,nodes,metric,ns_per_op,allocs_per_op,"
+                        "mb_per_s\n");
+            break;
+        case json:
+            std::printf("[\n");
+            break;
+        }
+    }
+
+    ~reporter() {
+        if ( fmt == json ) std::printf("\n]\n");
+    }
+
+    /// reports one measurement; `bytes` is the output size of operations
+    /// producing text, for their throughput
+    void add(const shape& s, std::size_t nodes, const char* metric,
+             measurement m, std::size_t bytes = 0) {
+        double mbps = bytes ? bytes / m.ns * 1e3 : 0;
+        switch ( fmt ) {
+        case table:
+            std::printf("%-8s %5d %5d %6zu %-10s %12.1f %10.2f %12.1f\n",
+                mix_name(s.ops), s.depth, s.width, nodes, metric, m.ns,
+                m.allocs, mbps);
+            break;
+        case csv:
+            std::printf("%s,%d,%d,%zu,%s,%.2f,%.3f,%.2f\n", mix_name(s.ops),
+                s.depth, s.width, nodes, metric, m.ns, m.allocs, mbps);
+            break;
+        case json:
+            std::printf("%s  {\"ops\": \"%s\", \"depth\": %d, \"width\": %d, "
+                "\"nodes\": %zu, \"metric\": \"%s\", \"ns_per_op\": %.2f, "
+                "\"allocs_per_op\": %.3f, \"mb_per_s\": %.2f}",
+                first ? "" : ",\n", mix_name(s.ops), s.depth, s.width, nodes,
+                metric, m.ns, m.allocs, mbps);
+            break;
+        }
+        first = false;
+        std::fflush(stdout);
+    }
+};
+
+void run(reporter& out, const shape& s) {
+    tree_builder build(s.ops);
+    std::unique_ptr<expr<int>> e{build.rule(s.depth, s.width)};
+    std::size_t nodes = count_nodes(*e);
+
+    out.add(s, nodes, "eval", measure([&]{ return e->eval(); }));
+    auto stack = compile(*e);
+    out.add(s, nodes, "stack", measure([&]{ return stack.run(); }));
+    auto regs = compile_registers(*e);
+    out.add(s, nodes, "register", measure([&]{ return regs.run(); }));
+    auto closure = e->compile_closure();
+    out.add(s, nodes, "closure", measure([&]{ return closure.run(); }));
+    auto closed = to_variant(*e);
+    out.add(s, nodes, "variant", measure([&]{ return closed.eval(); }));
+    // the benchmark's custom operators are not declared pure, so only
+    // subtrees of built-in operators are cached
+    result_cache cache;
+    cached_plan<int> cached(*e, cache);
+    out.add(s, nodes, "cached", measure([&]{ return cached.eval(); }));
+
+    // batch evaluation is timed per row, over blocks of this many rows
+    const std::size_t rows = 4096;
+    std::vector<int> results(rows);
+    out.add(s, nodes, "batch", measure([&]{
+        e->eval_batch(columns(), rows, results.data());
+        return results[rows - 1];
+    }, long(rows)));
+#if EXPR_JIT
+    auto jit = compile_jit(*e);
+    out.add(s, nodes, "jit", measure([&]{ return jit.run(); }));
+#endif
+
+    lifecycle life = measure_lifecycle(*e);
+    out.add(s, nodes, "clone", life.clone);
+    out.add(s, nodes, "destroy", life.destroy);
+
+    std::ostringstream text;
+    text << *e;
+    std::size_t bytes = text.str().size();
+    out.add(s, nodes, "print", measure([&]{
+        text.str(std::string());
+        text << *e;
+        return long(text.tellp());
+    }), bytes);
+
+    expr_parser parser(bench_ops());
+    std::string source = text.str();
+    out.add(s, nodes, "parse", measure([&]{
+        std::unique_ptr<expr<int>> parsed{parser.parse<int>(source)};
+        return long(parsed != nullptr);
+    }), bytes);
+
+    std::vector<unsigned char> data = serialize(*e, bench_ops());
+    out.add(s, nodes, "load", measure([&]{
+        std::unique_ptr<expr<int>> loaded{deserialize<int>(data, bench_ops())};
+        return long(loaded != nullptr);
+    }), data.size());
+    out.add(s, nodes, "map", measure([&]{
+        mapped_rules rules(data.data(), data.size(), bench_ops());
+        return long(rules.size());
+    }), data.size());
+    mapped_rules mapped(data.data(), data.size(), bench_ops());
+    out.add(s, nodes, "mapped", measure([&]{ return mapped.eval<int>(0); }));
+}
+
+/// the thread counts to measure scaling over: powers of two up to the
+/// number of hardware threads, and that number
+std::vector<int> thread_counts() {
+    int n = std::max(1, int(std::thread::hardware_concurrency()));
+    std::vector<int> counts;
+    for (int t = 1; t < n; t *= 2) counts.push_back(t);
+    counts.push_back(n);
+    return counts;
+}
+
+/// measures the throughput of evaluating one tree from many threads at once
+void run_shared(reporter& out, const shape& s) {
+    tree_builder build(s.ops);
+    std::unique_ptr<expr<int>> e{build.rule(s.depth, s.width)};
+    std::size_t nodes = count_nodes(*e);
+    for (int t : thread_counts()) {
+        std::string metric = "eval x" + std::to_string(t);
+        out.add(s, nodes, metric.c_str(),
+                measure_threads(t, [&]{ return e->eval(); }));
+    }
+}
+
+/// measures the time per tree of evaluating n trees with eval_all() on
+/// pools of each thread count
+void run_all(reporter& out, const shape& s, std::size_t n) {
+    tree_builder build(s.ops);
+    std::vector<std::unique_ptr<expr<int>>> trees;
+    std::vector<const expr<int>*> ptrs;
+    for (std::size_t i = 0; i < n; ++i) {
+        trees.emplace_back(build.rule(s.depth, s.width));
+        ptrs.push_back(trees.back().get());
+    }
+    std::size_t nodes = count_nodes(*trees[0]);
+    std::vector<int> results(n);
+    env vars;
+    for (int t : thread_counts()) {
+        work_pool pool(t);
+        std::string metric = "all x" + std::to_string(t);
+        out.add(s, nodes, metric.c_str(), measure([&]{
+            eval_all(ptrs.data(), n, vars, results.data(), pool);
+            return long(results[n - 1]);
+        }, long(n)));
+    }
+}
+
+int main(int argc, char** argv) {
+    reporter::format fmt = reporter::table;
+    for (int i = 1; i < argc; ++i) {
+        if ( std::strcmp(argv[i], "--format") == 0 && i + 1 < argc ) {
+            const char* f = argv[++i];
+            if ( std::strcmp(f, "csv") == 0 ) fmt = reporter::csv;
+            else if ( std::strcmp(f, "json") == 0 ) fmt = reporter::json;
+            else if ( std::strcmp(f, "table") != 0 ) {
+                std::fprintf(stderr, "unknown format %s\n", f);
+                return 2;
+            }
+        } else if ( std::strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc ) {
+            min_ns = std::atof(argv[++i]) * 1e6;
+        } else {
+            std::fprintf(stderr,
+                "usage: %s [--format table|csv|json] [--min-ms N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    reporter out(fmt);
+    for (mix m : {mix::builtin, mix::custom, mix::mixed})
+    for (int depth : {1, 4, 8})
+    for (int width : {1, 4}) {
+        run(out, shape{m, depth, width});
+    }
+    run_shared(out, shape{mix::mixed, 8, 4});
+    run_all(out, shape{mix::mixed, 4, 1}, 100000);
+}
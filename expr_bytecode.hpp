@@ -0,0 +1,241 @@
+#pragma once
+
+// stack bytecode backend for the expression language
+
+#include "expr.hpp"
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/// Instructions of the stack machine
+enum class stack_op : std::uint8_t {
+    push,           ///< pushes consts[arg]
+    load,           ///< pushes the variable in slot arg
+    call,           ///< pops right & left operands, pushes fns[arg](left, right)
+    jump_if_false,  ///< pops a bool, jumps to arg if it is false
+    jump,           ///< jumps to arg
+    jump_if_false_or_pop,  ///< jumps to arg if the top is false, else pops it
+    jump_if_true_or_pop,   ///< jumps to arg if the top is true, else pops it
+    ret,            ///< returns the top of the stack
+    // built-in operators on cells, which pop right & left operands & push 
+    // the result
+#define EXPR_STACK_OP(name, code, arg, res, sym) name,
+    EXPR_CELL_OPS(EXPR_STACK_OP)
+#undef EXPR_STACK_OP
+    first_cell_op = add_i
+};
+
+/// A single stack machine instruction
+struct stack_instr {
+    stack_op op;
+    std::uint32_t arg;
+};
+
+/// An expression of type T, lowered to a linear stack machine program.
+/// The program owns copies of all of its constants & operators, so it is
+/// independent of the tree it was compiled from
+template<typename T>
+class bytecode {
+    /// The instructions
+    std::vector<stack_instr> code;
+    /// The constant table
+    std::vector<cell> consts;
+    /// The operator table
+    std::vector<cell_fn> fns;
+    /// Owns the boxed constants
+    value_pool pool;
+    /// The number of variable slots the program reads
+    std::size_t n_vars = 0;
+    /// The maximum stack depth the program reaches
+    std::size_t max_depth = 0;
+    /// The stack depth at the current point of compilation
+    std::size_t depth = 0;
+
+    void grow(std::size_t n) {
+        depth += n;
+        if ( depth > max_depth ) max_depth = depth;
+    }
+
+    std::uint32_t here() const { return std::uint32_t(code.size()); }
+
+    void emit(stack_op op, std::uint32_t arg = 0) {
+        code.push_back(stack_instr{op, arg});
+    }
+
+    /// appends the code for e, which leaves its value on the stack
+    void lower(const expr_node& e) {
+        switch ( e.kind() ) {
+        case node_kind::constant:
+            emit(stack_op::push, std::uint32_t(consts.size()));
+            consts.push_back(e.value(pool));
+            grow(1);
+            break;
+        case node_kind::var:
+            emit(stack_op::load, std::uint32_t(e.slot()));
+            if ( e.slot() >= n_vars ) n_vars = e.slot() + 1;
+            grow(1);
+            break;
+        case node_kind::bin_op: {
+            lower(e.operand(0));
+            if ( is_short_circuit(e) ) {
+                // the left operand is the result if it decides it, 
+                // otherwise the right operand is
+                std::uint32_t to_end = here();
+                emit(e.opcode() == op::land 
+                    ? stack_op::jump_if_false_or_pop 
+                    : stack_op::jump_if_true_or_pop);
+                depth -= 1;
+                lower(e.operand(1));
+                code[to_end].arg = here();
+                break;
+            }
+            lower(e.operand(1));
+            int native = find_cell_op(e);
+            if ( native >= 0 ) {
+                emit(stack_op(int(stack_op::first_cell_op) + native));
+            } else {
+                emit(stack_op::call, std::uint32_t(fns.size()));
+                fns.push_back(e.cell_op());
+            }
+            depth -= 1;
+            break;
+        }
+        case node_kind::cond: {
+            lower(e.operand(0));
+            std::uint32_t to_false = here();
+            emit(stack_op::jump_if_false);
+            depth -= 1;
+            lower(e.operand(1));
+            std::uint32_t to_end = here();
+            emit(stack_op::jump);
+            // only one of the branches runs, so the false branch starts at
+            // the same depth the true branch did
+            depth -= 1;
+            code[to_false].arg = here();
+            lower(e.operand(2));
+            code[to_end].arg = here();
+            break;
+        }
+        }
+    }
+
+    /// runs the program on the variables vars, storing boxed intermediate 
+    /// results in scratch
+    cell exec(const cell* vars, value_pool& scratch) const {
+        // most programs are shallow, so avoid allocating a stack for them
+        cell local[32];
+        std::vector<cell> heap;
+        cell* sp = local;
+        if ( max_depth > 32 ) {
+            heap.resize(max_depth);
+            sp = heap.data();
+        }
+
+        const stack_instr* start = code.data();
+        const stack_instr* pc = start;
+        for (;;) {
+            switch ( pc->op ) {
+            case stack_op::push:
+                *sp++ = consts[pc->arg];
+                ++pc;
+                break;
+            case stack_op::load:
+                *sp++ = vars[pc->arg];
+                ++pc;
+                break;
+            case stack_op::call:
+                --sp;
+                sp[-1] = fns[pc->arg](sp[-1], sp[0], scratch);
+                ++pc;
+                break;
+            case stack_op::jump_if_false:
+                --sp;
+                pc = sp->b ? pc + 1 : start + pc->arg;
+                break;
+            case stack_op::jump:
+                pc = start + pc->arg;
+                break;
+            case stack_op::jump_if_false_or_pop:
+                if ( !sp[-1].b ) {
+                    pc = start + pc->arg;
+                } else {
+                    --sp;
+                    ++pc;
+                }
+                break;
+            case stack_op::jump_if_true_or_pop:
+                if ( sp[-1].b ) {
+                    pc = start + pc->arg;
+                } else {
+                    --sp;
+                    ++pc;
+                }
+                break;
+            case stack_op::ret:
+                return sp[-1];
+#define EXPR_STACK_OP(name, code, arg, res, sym) \
+            case stack_op::name: \
+                --sp; \
+                sp[-1].res = sp[-1].arg sym sp[0].arg; \
+                ++pc; \
+                break;
+            EXPR_CELL_OPS(EXPR_STACK_OP)
+#undef EXPR_STACK_OP
+            }
+        }
+    }
+
+public:
+    /// compiles e; the program does not refer to e afterward
+    explicit bytecode(const expr<T>& e) {
+        lower(e);
+        emit(stack_op::ret);
+    }
+
+    /// runs the program, producing the same value as eval() on the
+    /// expression it was compiled from
+    T run() const {
+        return run(env());
+    }
+
+    /// runs the program on the variables vars, producing the same value as 
+    /// eval(vars) on the expression it was compiled from
+    T run(const env& vars) const {
+        assert(vars.size() >= n_vars);
+        value_pool scratch;
+        return value_traits<T>::get(exec(vars.data(), scratch));
+    }
+
+    /// the number of instructions in the program
+    std::size_t size() const { return code.size(); }
+
+    /// prints a listing of the program
+    void print(std::ostream& out) const {
+        static const char* const names[] = {
+            "push", "load", "call", "jump_if_false", "jump", 
+            "jump_if_false_or_pop", "jump_if_true_or_pop", "ret",
+#define EXPR_STACK_OP(name, code, arg, res, sym) #name,
+            EXPR_CELL_OPS(EXPR_STACK_OP)
+#undef EXPR_STACK_OP
+        };
+        for (std::size_t i = 0; i < code.size(); ++i) {
+            out << i << ": " << names[int(code[i].op)];
+            if ( code[i].op < stack_op::ret ) out << " " << code[i].arg;
+            out << "\n";
+        }
+    }
+};
+
+/// Lowers an expression tree to stack bytecode
+template<typename T>
+bytecode<T> compile(const expr<T>& e) {
+    return bytecode<T>(e);
+}
+
+/// Prints the listing of a bytecode program
+template<typename T>
+std::ostream& operator<< (std::ostream& out, const bytecode<T>& p) {
+    p.print(out);
+    return out;
+}
@@ -0,0 +1,14 @@
+#include "expr_bytecode.hpp"
+#include "expr_test_samples.hpp"
+
+#include <cassert>
+#include <iostream>
+
+int main() {
+    // the compiled program agrees with the tree-walking evaluator
+    samples::for_each([](const auto& e, const env& vars) {
+        auto prog = compile(e);
+        std::cout << e << "\n" << prog << " = " << prog.run(vars) << std::endl;
+        assert(prog.run(vars) == e.eval(vars));
+    });
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+// caching the values of pure subtrees, shared between trees
+
+#include "expr.hpp"
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// A bounded cache of the values of pure subtrees: those without variables
+/// whose custom operators, if any, were declared with pure_op(). Subtrees
+/// are matched by structure, so identical subtrees of different trees
+/// share one value; custom operators match only if they are the same
+/// operator object, as those made from one op_registry entry are. When
+/// more than `capacity` values are cached, the least recently used one is
+/// dropped.
+///
+/// Trees are evaluated with the cache through a cached_plan, which finds
+/// their pure subtrees once. Any number of threads may use one cache
+class result_cache {
+public:
+    /// A distinct pure subtree, and its value if it is cached
+    struct key {
+        /// A copy of the subtree, to match others against
+        const expr_node* tree = nullptr;
+        /// The nodes of the copy, each once however often it is shared
+        std::vector<std::unique_ptr<const expr_node>> nodes;
+        /// The boxed value; null if it is not cached
+        std::shared_ptr<const void> value;
+        /// The key's place in `recent`, if its value is cached
+        std::list<std::shared_ptr<key>>::iterator pos;
+    };
+
+private:
+    std::size_t cap;
+    mutable std::mutex lock;
+    /// The keys, by structural hash. Keys live while their value is cached
+    /// or a plan uses them
+    std::unordered_multimap<std::size_t, std::weak_ptr<key>> keys;
+    /// The size of `keys` at which expired keys are next removed
+    std::size_t next_purge = 64;
+    /// The keys whose values are cached, most recently used first
+    std::list<std::shared_ptr<key>> recent;
+    std::size_t n_hits = 0;
+    std::size_t n_misses = 0;
+    std::size_t n_evictions = 0;
+
+    /// copies the tree rooted at e into the nodes of k, sharing the copies
+    /// of subtrees it shares; copies holds those already made
+    static const expr_node* copy(
+            const expr_node& e, key& k,
+            std::unordered_map<const expr_node*, const expr_node*>& copies) {
+        auto it = copies.find(&e);
+        if ( it != copies.end() ) return it->second;
+        const expr_node* ops[3] = {};
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            ops[i] = copy(e.operand(i), k, copies);
+        }
+        k.nodes.emplace_back(e.share(ops));
+        copies.emplace(&e, k.nodes.back().get());
+        return k.nodes.back().get();
+    }
+
+public:
+    /// a cache holding at most `capacity` values
+    explicit result_cache(std::size_t capacity = 1024) : cap(capacity) {}
+
+    result_cache(const result_cache&) = delete;
+    result_cache& operator= (const result_cache&) = delete;
+
+    /// the key for the pure subtree rooted at e, shared with the subtrees
+    /// identical to it
+    std::shared_ptr<key> intern(const expr_node& e) {
+        std::size_t h = e.hash();
+        std::lock_guard<std::mutex> l(lock);
+        auto range = keys.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+            std::shared_ptr<key> k = it->second.lock();
+            if ( k && k->tree->equals(e) ) return k;
+        }
+        if ( keys.size() >= next_purge ) {
+            for (auto it = keys.begin(); it != keys.end(); ) {
+                it = it->second.expired() ? keys.erase(it) : std::next(it);
+            }
+            next_purge = 2 * keys.size() + 64;
+        }
+        auto k = std::make_shared<key>();
+        std::unordered_map<const expr_node*, const expr_node*> copies;
+        k->tree = copy(e, *k, copies);
+        keys.emplace(h, k);
+        return k;
+    }
+
+    /// the boxed value of k, whose subtree is e; if it is not cached, it is
+    /// computed with compute & cached. Threads missing at once may each
+    /// compute the value, but only the first is kept
+    std::shared_ptr<const void> value(const std::shared_ptr<key>& k,
+                                      const expr_node& e, const env& vars,
+                                      cached_eval::compute_fn compute) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if ( k->value ) {
+                ++n_hits;
+                recent.splice(recent.begin(), recent, k->pos);
+                return k->value;
+            }
+            ++n_misses;
+        }
+        std::shared_ptr<const void> v = compute(e, vars);
+        std::lock_guard<std::mutex> l(lock);
+        if ( k->value ) return k->value;
+        k->value = v;
+        recent.push_front(k);
+        k->pos = recent.begin();
+        while ( recent.size() > cap ) {
+            recent.back()->value.reset();
+            recent.pop_back();
+            ++n_evictions;
+        }
+        return v;
+    }
+
+    /// drops every cached value
+    void clear() {
+        std::lock_guard<std::mutex> l(lock);
+        for (auto& k : recent) k->value.reset();
+        recent.clear();
+    }
+
+    /// the most values the cache holds
+    std::size_t capacity() const { return cap; }
+
+    /// the number of values cached
+    std::size_t size() const {
+        std::lock_guard<std::mutex> l(lock);
+        return recent.size();
+    }
+
+    /// the number of values found in the cache so far
+    std::size_t hits() const {
+        std::lock_guard<std::mutex> l(lock);
+        return n_hits;
+    }
+
+    /// the number of values computed because they were not cached
+    std::size_t misses() const {
+        std::lock_guard<std::mutex> l(lock);
+        return n_misses;
+    }
+
+    /// the number of values dropped to make room for others
+    std::size_t evictions() const {
+        std::lock_guard<std::mutex> l(lock);
+        return n_evictions;
+    }
+};
+
+/// Which pure subtrees cached_plan caches
+struct cache_options {
+    /// Subtrees of built-in operators alone are cached only if they have at
+    /// least this many nodes, as finding a value costs about as much as
+    /// evaluating a dozen such nodes. Subtrees with custom operators are
+    /// cached whatever their size
+    std::size_t min_nodes = 16;
+};
+
+/// A plan for evaluating a tree with eval_cached(): its largest pure
+/// subtrees worth caching take their values from a result_cache,
+/// so evaluating one that is cached costs a lookup of the node & a lock
+/// rather than evaluating or hashing it. The plan is made once for a tree,
+/// which it borrows, & may be evaluated any number of times, from any
+/// number of threads.
+///
+/// Cached subtrees are evaluated only where eval() would evaluate them, so
+/// the operands of && and || & conditionals are still skipped. Large pure
+/// subtrees of built-in operators alone are cached too; optimize() folds
+/// those into constants, which is better still where trees can be rebuilt
+template<typename T>
+class cached_plan : public cached_eval {
+    struct step {
+        mode m;
+        /// The cache key, for cached nodes
+        std::shared_ptr<result_cache::key> k;
+    };
+
+    /// What plan() finds of a subtree
+    struct subtree {
+        /// May its value be cached?
+        bool pure;
+        /// Has it custom operators?
+        bool custom;
+        std::size_t nodes;
+    };
+
+    const expr<T>& root;
+    result_cache& cache;
+    cache_options options;
+    /// What each node evaluated with the cache does; nodes not here are
+    /// evaluated directly
+    std::unordered_map<const expr_node*, step> steps;
+
+    /// plans e & its operands; planned holds the subtrees already planned,
+    /// so each shared subtree is planned once
+    subtree plan(const expr_node& e,
+                 std::unordered_map<const expr_node*, subtree>& planned) {
+        auto found = planned.find(&e);
+        if ( found != planned.end() ) return found->second;
+        subtree t{e.kind() != node_kind::var && e.local_pure(),
+                  e.kind() == node_kind::bin_op && e.opcode() == op::custom, 1};
+        subtree operands[3] = {};
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            operands[i] = plan(e.operand(i), planned);
+            t.pure = t.pure && operands[i].pure;
+            t.custom = t.custom || operands[i].custom;
+            t.nodes += operands[i].nodes;
+        }
+        planned.emplace(&e, t);
+        if ( t.pure ) return t;
+        // the largest pure subtrees are the pure operands of impure nodes
+        bool descends = false;
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            const expr_node& o = e.operand(i);
+            if ( operands[i].pure && worth_caching(o, operands[i]) ) {
+                steps[&o] = step{cached, cache.intern(o)};
+            }
+            descends = descends || steps.count(&o) != 0;
+        }
+        if ( descends ) steps[&e] = step{descend, nullptr};
+        return t;
+    }
+
+    bool worth_caching(const expr_node& e, const subtree& t) const {
+        if ( e.kind() == node_kind::constant ) return false;
+        return t.custom || t.nodes >= options.min_nodes;
+    }
+
+    std::shared_ptr<const void> find(const expr_node& e, const env& vars,
+                                     compute_fn compute) const override {
+        return cache.value(steps.at(&e).k, e, vars, compute);
+    }
+
+public:
+    /// plans e, which must outlive the plan, to take the values of its pure
+    /// subtrees from cache, which must too
+    cached_plan(const expr<T>& e, result_cache& cache,
+                const cache_options& o = cache_options())
+    : root(e), cache(cache), options(o) {
+        std::unordered_map<const expr_node*, subtree> planned;
+        subtree t = plan(e, planned);
+        if ( t.pure && worth_caching(e, t) ) {
+            steps[&e] = step{cached, cache.intern(e)};
+        }
+    }
+
+    mode at(const expr_node& e) const override {
+        auto it = steps.find(&e);
+        return it == steps.end() ? direct : it->second.m;
+    }
+
+    /// the number of subtrees whose values are cached
+    std::size_t cached_subtrees() const {
+        std::size_t n = 0;
+        for (const auto& s : steps) n += s.second.m == cached;
+        return n;
+    }
+
+    /// evaluates the tree, giving the same value as eval(vars)
+    T eval(const env& vars = env()) const {
+        return root.eval_cached(vars, *this);
+    }
+};
+
+/// evaluates e as e.eval(vars) does, taking the values of its pure
+/// subtrees from cache. Plans the tree on each call, hashing its pure
+/// subtrees; make a cached_plan to evaluate it repeatedly
+template<typename T>
+T eval_cached(const expr<T>& e, result_cache& cache, const env& vars = env(),
+              const cache_options& o = cache_options()) {
+    return cached_plan<T>(e, cache, o).eval(vars);
+}
@@ -0,0 +1,164 @@
+#include "expr_cache.hpp"
+#include "expr_parse.hpp"
+#include "expr_registry.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// The number of calls to the custom operators
+std::atomic<int> slow_calls{0};
+std::atomic<int> noisy_calls{0};
+
+/// a costly operator with no side effects other than counting its calls
+int slow(int a, int b) {
+    ++slow_calls;
+    return a * 10 + b;
+}
+
+/// an operator whose calls are observable, so must happen on every
+/// evaluation
+int noisy(int a, int b) {
+    ++noisy_calls;
+    return a - b;
+}
+
+int fail(int, int) { throw std::runtime_error("failed"); }
+
+int main() {
+    var_scope scope;
+    scope.declare<int>("x");
+    scope.declare<bool>("flag");
+    op_registry ops;
+    ops.define_op<int, int, int>("slow", pure_op(slow));
+    ops.define_op<int, int, int>("noisy", noisy);
+    ops.define_op<int, int, int>("fail", pure_op(fail));
+    assert(ops.find_op("slow")->pure);
+    assert(!ops.find_op("noisy")->pure);
+    expr_parser p(ops, &scope);
+
+    env vars = scope.make_env();
+    vars.set(scope.slot("x"), 5);
+    vars.set(scope.slot("flag"), true);
+
+    // only the largest pure subtrees are cached, and each is computed once
+    result_cache cache(16);
+    std::unique_ptr<expr<int>> e{p.parse<int>(
+        "x + (1 slow 2) slow (3 + 4) + (2 noisy 1)")};
+    cached_plan<int> plan(*e, cache);
+    assert(plan.cached_subtrees() == 1);
+    for (int i = 0; i < 3; ++i) assert(plan.eval(vars) == e->eval(vars));
+    assert(slow_calls == 2 + 2 * 3);
+    assert(noisy_calls == 6);
+    assert(cache.misses() == 1 && cache.hits() == 2 && cache.size() == 1);
+
+    // identical subtrees of other trees share the value
+    slow_calls = 0;
+    std::unique_ptr<expr<int>> other{p.parse<int>(
+        "if (x > 3) (1 slow 2) slow (3 + 4) else 0")};
+    assert(eval_cached(*other, cache, vars) == 127);
+    assert(slow_calls == 0 && cache.hits() == 3);
+
+    // subtrees with variables or impure operators are not cached
+    std::unique_ptr<expr<int>> impure{p.parse<int>(
+        "(x slow 1) + (1 noisy 2) slow 3")};
+    assert(cached_plan<int>(*impure, cache).cached_subtrees() == 0);
+    slow_calls = 0;
+    noisy_calls = 0;
+    assert(eval_cached(*impure, cache, vars) == impure->eval(vars));
+    assert(slow_calls == 4 && noisy_calls == 2);
+
+    // whole trees may be cached, and built-in operators alone are pure,
+    // though small subtrees of them are not worth caching
+    std::unique_ptr<expr<int>> constant{p.parse<int>("(2 * 3) slow 4")};
+    cached_plan<int> whole(*constant, cache);
+    assert(whole.cached_subtrees() == 1);
+    assert(whole.eval() == 64 && whole.eval() == 64);
+    std::unique_ptr<expr<bool>> builtin{p.parse<bool>("x > 2 * 3 + 1")};
+    assert(cached_plan<bool>(*builtin, cache).cached_subtrees() == 0);
+    cache_options any;
+    any.min_nodes = 1;
+    cached_plan<bool> builtin_plan(*builtin, cache, any);
+    assert(builtin_plan.cached_subtrees() == 1);
+    assert(!builtin_plan.eval(vars));
+
+    // cached subtrees are only evaluated where eval() would evaluate them
+    std::unique_ptr<expr<bool>> lazy{p.parse<bool>(
+        "flag && (5 slow 6) > 0 || (6 slow 7) > 0")};
+    cached_plan<bool> lazy_plan(*lazy, cache);
+    assert(lazy_plan.cached_subtrees() == 2);
+    slow_calls = 0;
+    vars.set(scope.slot("flag"), false);
+    assert(lazy_plan.eval(vars));
+    assert(slow_calls == 1);
+    vars.set(scope.slot("flag"), true);
+    assert(lazy_plan.eval(vars));
+    assert(slow_calls == 2);
+
+    // the least recently used values are dropped past the capacity
+    result_cache small(2);
+    std::vector<std::unique_ptr<expr<int>>> trees;
+    for (const char* s : { "x + 1 slow 1", "x + 2 slow 2", "x + 3 slow 3" }) {
+        trees.emplace_back(p.parse<int>(s));
+    }
+    std::vector<std::unique_ptr<cached_plan<int>>> plans;
+    for (auto& t : trees) plans.emplace_back(new cached_plan<int>(*t, small));
+    slow_calls = 0;
+    plans[0]->eval(vars);
+    plans[1]->eval(vars);
+    plans[0]->eval(vars);
+    plans[2]->eval(vars);
+    assert(small.size() == 2 && small.evictions() == 1);
+    assert(slow_calls == 3);
+    plans[0]->eval(vars);
+    assert(slow_calls == 3);
+    plans[1]->eval(vars);
+    assert(slow_calls == 4);
+    small.clear();
+    assert(small.size() == 0);
+    assert(plans[0]->eval(vars) == 16 && slow_calls == 5);
+
+    // values survive their plans until evicted
+    result_cache lasting;
+    slow_calls = 0;
+    assert(eval_cached(*constant, lasting) == 64);
+    assert(eval_cached(*constant, lasting) == 64);
+    assert(slow_calls == 1 && lasting.hits() == 1);
+
+    // exceptions reach the caller, and nothing is cached
+    std::unique_ptr<expr<int>> throws{p.parse<int>("x + 1 fail 2")};
+    cached_plan<int> throws_plan(*throws, cache);
+    std::size_t cached = cache.size();
+    for (int i = 0; i < 2; ++i) {
+        try {
+            throws_plan.eval(vars);
+            assert(!"expected an exception");
+        } catch (const std::runtime_error& ex) {
+            assert(std::string(ex.what()) == "failed");
+        }
+    }
+    assert(cache.size() == cached);
+
+    // one cache may be used by many threads at once
+    result_cache shared(4);
+    std::vector<std::thread> threads;
+    std::atomic<int> wrong{0};
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]{
+            env mine = scope.make_env();
+            mine.set(scope.slot("flag"), true);
+            for (int i = 0; i < 200; ++i) {
+                mine.set(scope.slot("x"), i + t);
+                const expr<int>& tree = *trees[(i + t) % trees.size()];
+                cached_plan<int> plan(tree, shared);
+                if ( plan.eval(mine) != tree.eval(mine) ) ++wrong;
+            }
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    assert(wrong == 0);
+}
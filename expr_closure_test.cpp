@@ -0,0 +1,43 @@
+#include "expr.hpp"
+#include "expr_test_samples.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// wrapper function for string concatenation
+std::string concat(std::string a, std::string b) { return a + b; }
+
+/// checks that the closure agrees with the tree-walking evaluator
+template<typename T>
+void check(const expr<T>& e, const env& vars = env()) {
+    auto c = e.compile_closure();
+    std::cout << e << " = " << c.run(vars) << " (" << c.size() 
+              << " bytes of closures)" << std::endl;
+    assert(c.run(vars) == e.eval(vars));
+}
+
+int main() {
+    // the closures agree with the tree-walking evaluator
+    samples::for_each([](const auto& e, const env& vars) { check(e, vars); });
+
+    // the closure outlives the tree it was compiled from
+    std::unique_ptr<expr<std::string>> tree{new if_expr<std::string>(
+        new bin_op_expr<bool, int, int>(
+            op::eq,
+            new bin_op_expr<int, int, int>(
+                mult, "*", new const_expr<int>(8), new const_expr<int>(5)),
+            new const_expr<int>(40)),
+        new bin_op_expr<std::string, std::string, std::string>(
+            concat, "++",
+            new const_expr<std::string>("corr"),
+            new const_expr<std::string>("ect")),
+        new const_expr<std::string>("incorrect"))};
+    auto kept = tree->compile_closure();
+    tree.reset();
+    assert(kept.run() == "correct");
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+// common subexpression elimination with per-evaluation memoization
+
+#include "expr.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/// An expression of type T in which each distinct subexpression is a single
+/// entry, and entries used more than once are computed at most once per
+/// run, their results kept in per-run scratch slots. Entries are still only
+/// computed if the tree-walking evaluator would evaluate them.
+///
+/// Subexpressions are merged if they are the same node (as in the DAGs
+/// built by expr_factory) or if they are structurally identical and
+/// contain no custom operators, which may have side effects.
+/// The program owns copies of all of its constants & operators, so it is
+/// independent of the tree it was compiled from
+template<typename T>
+class cse_program {
+    /// Entry codes; codes from `first_cell_op` on are built-in operators,
+    /// offset by their cell_instr
+    enum : std::uint8_t {
+        constant_code, var_code, call_code, cond_code, and_code, or_code, 
+        first_cell_op
+    };
+
+    /// No scratch slot
+    static constexpr std::uint32_t none = std::uint32_t(-1);
+
+    struct entry {
+        /// What the entry computes
+        std::uint8_t code;
+        /// The scratch slot holding its value, if it is used more than once
+        std::uint32_t slot = none;
+        /// The entries for its operands
+        std::uint32_t ops[3] = {};
+        /// The value of a constant, the env slot of a variable, or the 
+        /// operator index for a call
+        cell arg;
+    };
+
+    /// The entries; operands come before the entries using them
+    std::vector<entry> entries;
+    /// The operator table
+    std::vector<cell_fn> fns;
+    /// Owns the boxed constants
+    value_pool pool;
+    /// The number of env slots the program reads
+    std::size_t n_vars = 0;
+    /// The number of scratch slots
+    std::uint32_t n_slots = 0;
+    /// The entry for the root
+    std::uint32_t root = 0;
+
+    /// Entries by the hash of their local parts & operand entries
+    std::unordered_multimap<std::size_t, std::uint32_t> index;
+    /// The node each entry was made from, for matching
+    std::vector<const expr_node*> sources;
+    /// The number of uses of each entry
+    std::vector<std::uint32_t> uses;
+
+    /// Can subexpressions rooted at this node be merged structurally?
+    static bool mergeable(const expr_node& e) {
+        return !(e.kind() == node_kind::bin_op && e.opcode() == op::custom);
+    }
+
+    std::uint32_t add(const expr_node& e) {
+        std::uint32_t ops[3] = {};
+        bool merge = mergeable(e);
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            ops[i] = add(e.operand(i));
+        }
+
+        // operands are already merged, so entries match if their local
+        // parts match & they have the same operand entries; unmergeable
+        // nodes only match themselves
+        std::size_t h = merge ? e.local_hash()
+                              : std::hash<const void*>{}(&e);
+        for (std::size_t i = 0; i < e.arity(); ++i) h = hash_combine(h, ops[i]);
+        auto range = index.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+            const entry& c = entries[it->second];
+            const expr_node& s = *sources[it->second];
+            bool same = merge ? s.local_equals(e) : &s == &e;
+            for (std::size_t i = 0; i < e.arity() && same; ++i) {
+                same = c.ops[i] == ops[i];
+            }
+            if ( same ) return it->second;
+        }
+
+        entry n;
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            n.ops[i] = ops[i];
+            ++uses[ops[i]];
+        }
+        switch ( e.kind() ) {
+        case node_kind::constant:
+            n.code = constant_code;
+            n.arg = e.value(pool);
+            break;
+        case node_kind::var:
+            n.code = var_code;
+            n.arg.i = int(e.slot());
+            if ( e.slot() >= n_vars ) n_vars = e.slot() + 1;
+            break;
+        case node_kind::cond:
+            n.code = cond_code;
+            break;
+        case node_kind::bin_op: {
+            int native = find_cell_op(e);
+            if ( is_short_circuit(e) ) {
+                n.code = e.opcode() == op::land ? and_code : or_code;
+            } else if ( native >= 0 ) {
+                n.code = std::uint8_t(first_cell_op + native);
+            } else {
+                n.code = call_code;
+                n.arg.i = int(fns.size());
+                fns.push_back(e.cell_op());
+            }
+            break;
+        }
+        }
+        std::uint32_t id = std::uint32_t(entries.size());
+        entries.push_back(n);
+        sources.push_back(&e);
+        uses.push_back(0);
+        index.emplace(h, id);
+        return id;
+    }
+
+    /// Per-run scratch state
+    struct frame {
+        /// The variables
+        const cell* vars;
+        /// The values of the slots computed so far
+        cell* values;
+        /// The number of node evaluations each slot's value took,
+        /// 0 if it has not been computed yet
+        std::size_t* costs;
+        /// Owns boxed intermediate results
+        value_pool scratch;
+        /// The number of node evaluations performed
+        std::size_t work = 0;
+        /// The number of node evaluations avoided by reusing slots
+        std::size_t saved = 0;
+    };
+
+    cell eval(std::uint32_t i, frame& f) const {
+        const entry& e = entries[i];
+        if ( e.slot != none && f.costs[e.slot] != 0 ) {
+            f.saved += f.costs[e.slot];
+            return f.values[e.slot];
+        }
+        // the tree-walking evaluator's cost includes any evaluations saved
+        // below this one
+        std::size_t start = f.work + f.saved;
+        ++f.work;
+
+        cell v;
+        switch ( e.code ) {
+        case constant_code:
+            v = e.arg;
+            break;
+        case var_code:
+            v = f.vars[e.arg.i];
+            break;
+        case call_code:
+            v = fns[e.arg.i](eval(e.ops[0], f), eval(e.ops[1], f), f.scratch);
+            break;
+        case cond_code:
+            v = eval(eval(e.ops[0], f).b ? e.ops[1] : e.ops[2], f);
+            break;
+        case and_code:
+            v = eval(e.ops[0], f);
+            if ( v.b ) v = eval(e.ops[1], f);
+            break;
+        case or_code:
+            v = eval(e.ops[0], f);
+            if ( !v.b ) v = eval(e.ops[1], f);
+            break;
+        default: {
+            cell l = eval(e.ops[0], f);
+            cell r = eval(e.ops[1], f);
+            switch ( cell_instr(e.code - first_cell_op) ) {
+#define EXPR_CSE_OP(name, code, arg, res, sym) \
+            case cell_instr::name: v.res = l.arg sym r.arg; break;
+            EXPR_CELL_OPS(EXPR_CSE_OP)
+#undef EXPR_CSE_OP
+            }
+        }
+        }
+
+        if ( e.slot != none ) {
+            f.values[e.slot] = v;
+            f.costs[e.slot] = f.work + f.saved - start;
+        }
+        return v;
+    }
+
+public:
+    /// compiles e; the program does not refer to e afterward
+    explicit cse_program(const expr<T>& e) {
+        root = add(e);
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            if ( uses[i] > 1 ) entries[i].slot = n_slots++;
+        }
+        index.clear();
+        sources.clear();
+        uses.clear();
+    }
+
+    /// runs the program, producing the same value as eval() on the
+    /// expression it was compiled from. If `saved` is given, it is set to
+    /// the number of node evaluations avoided by reusing shared results
+    T run(std::size_t* saved = nullptr) const {
+        return run(env(), saved);
+    }
+
+    /// runs the program on the variables vars, producing the same value as
+    /// eval(vars) on the expression it was compiled from; `saved` is as 
+    /// for run()
+    T run(const env& vars, std::size_t* saved = nullptr) const {
+        assert(vars.size() >= n_vars);
+        // most programs share few subexpressions, so avoid allocating
+        // scratch slots for them
+        cell local_values[32];
+        std::size_t local_costs[32] = {};
+        std::vector<cell> heap_values;
+        std::vector<std::size_t> heap_costs;
+        frame f;
+        f.vars = vars.data();
+        f.values = local_values;
+        f.costs = local_costs;
+        if ( n_slots > 32 ) {
+            heap_values.resize(n_slots);
+            heap_costs.resize(n_slots);
+            f.values = heap_values.data();
+            f.costs = heap_costs.data();
+        }
+
+        T v = value_traits<T>::get(eval(root, f));
+        if ( saved ) *saved = f.saved;
+        return v;
+    }
+
+    /// the number of distinct subexpressions
+    std::size_t size() const { return entries.size(); }
+
+    /// the number of subexpressions used more than once
+    std::size_t shared() const { return n_slots; }
+};
+
+/// Compiles an expression (tree or DAG) so that each shared subexpression
+/// is evaluated at most once per run
+template<typename T>
+cse_program<T> compile_cse(const expr<T>& e) {
+    return cse_program<T>(e);
+}
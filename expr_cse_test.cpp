@@ -0,0 +1,83 @@
+#include "expr_cse.hpp"
+#include "expr_hashcons.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+
+/// wrapper function for multiplication, counting its calls
+int calls = 0;
+int mult(int a, int b) { ++calls; return a * b; }
+
+/// checks that the memoized program agrees with the tree-walking evaluator,
+/// saving `expected` evaluations
+template<typename T>
+void check(const char* name, const expr<T>& e, std::size_t expected) {
+    auto prog = compile_cse(e);
+    std::size_t saved;
+    T v = prog.run(&saved);
+    std::cout << name << " = " << v << " (" << prog.size() << " entries, " 
+              << prog.shared() << " shared, " << saved << " evaluations saved)" 
+              << std::endl;
+    assert(v == e.eval());
+    assert(saved == expected);
+}
+
+int main() {
+    // (2 + 2) == 4: the constant 2 is shared, but a constant costs one 
+    // evaluation either way
+    auto cond = new bin_op_expr<bool, int, int>(
+        op::eq,
+        new bin_op_expr<int, int, int>(
+            op::add, new const_expr<int>(2), new const_expr<int>(2)),
+        new const_expr<int>(4)
+    );
+    if_expr<std::string> root = {
+        cond,
+        new const_expr<std::string>("correct"),
+        new const_expr<std::string>("incorrect")
+    };
+    check("root", root, 1);
+
+    // repeated subtrees of an ordinary tree are merged
+    auto square = new bin_op_expr<int, int, int>(
+        op::sub, new const_expr<int>(8), new const_expr<int>(5));
+    bin_op_expr<int, int, int> twice = {
+        op::add,
+        new bin_op_expr<int, int, int>(op::mul, square, square->clone()),
+        new bin_op_expr<int, int, int>(op::mul, square->clone(), square->clone())
+    };
+    check("twice", twice, 15 - 5);
+
+    // a DAG of shared nodes is evaluated in time linear in its nodes
+    expr_factory f;
+    const expr<int>* sum = f.constant(1);
+    for (int i = 0; i < 10; ++i) sum = f.bin_op<int>(op::add, sum, sum);
+    check("sum", *sum, 2047 - 11);
+
+    // custom operators are only merged when they are the same node, though
+    // their constant operands are merged
+    auto product = new bin_op_expr<int, int, int>(
+        mult, "*", new const_expr<int>(8), new const_expr<int>(5));
+    if_expr<int> branches = {
+        new bin_op_expr<bool, int, int>(
+            op::lt, product, new const_expr<int>(0)),
+        new bin_op_expr<int, int, int>(
+            mult, "*", new const_expr<int>(8), new const_expr<int>(5)),
+        product->clone()
+    };
+    calls = 0;
+    check("branches", branches, 2);
+    assert(calls == 4);
+
+    // a shared node is computed where it is first needed, then reused
+    const expr<int>* shared_product = f.intern(*product);
+    auto dag = f.cond(
+        f.bin_op<bool>(op::lt, shared_product, f.constant(0)),
+        f.constant(0),
+        f.bin_op<int>(op::add, shared_product, shared_product));
+    calls = 0;
+    check("dag", *dag, 6);
+    assert(calls == 3 + 1);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// hash-consing: expression DAGs with structurally identical subtrees shared
+
+#include "expr.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Builds expressions in which structurally identical subtrees are a single
+/// shared node, turning trees into DAGs.
+/// The factory owns every node it returns; they are immutable, and live as
+/// long as the factory does. clone() on a shared node makes an ordinary,
+/// unshared tree.
+///
+/// Custom operators match only if they are the same operator object, as
+/// copies & clones of a custom operator node are.
+class expr_factory {
+    /// The interned nodes
+    std::vector<std::unique_ptr<const expr_node>> nodes;
+    /// The interned nodes, by the hash of their local parts & the
+    /// addresses of their operands
+    std::unordered_multimap<std::size_t, const expr_node*> table;
+    /// The number of requests answered by an existing node
+    std::size_t n_hits = 0;
+
+    /// Hashes a node with local parts like e's and the given (interned)
+    /// operands. Since operands are interned, their addresses identify them
+    static std::size_t key(const expr_node& e, const expr_node* const* ops) {
+        std::size_t h = e.local_hash();
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            h = hash_combine(h, std::hash<const void*>{}(ops[i]));
+        }
+        return h;
+    }
+
+    /// Finds the interned node with local parts like e's & the given
+    /// operands, or makes one with e.share()
+    const expr_node* intern(const expr_node& e, const expr_node* const* ops) {
+        std::size_t h = key(e, ops);
+        auto range = table.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+            const expr_node& c = *it->second;
+            if ( !c.local_equals(e) ) continue;
+            bool same = true;
+            for (std::size_t i = 0; i < e.arity() && same; ++i) {
+                same = &c.operand(i) == ops[i];
+            }
+            if ( same ) {
+                ++n_hits;
+                return &c;
+            }
+        }
+        const expr_node* n = e.share(ops);
+        nodes.emplace_back(n);
+        table.emplace(h, n);
+        return n;
+    }
+
+    const expr_node* intern_tree(const expr_node& e) {
+        const expr_node* ops[3] = {};
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            ops[i] = intern_tree(e.operand(i));
+        }
+        return intern(e, ops);
+    }
+
+public:
+    expr_factory() = default;
+    expr_factory(const expr_factory&) = delete;
+    expr_factory& operator= (const expr_factory&) = delete;
+    expr_factory(expr_factory&&) = default;
+    expr_factory& operator= (expr_factory&&) = default;
+
+    /// the shared node structurally identical to e; e is not modified
+    template<typename T>
+    const expr<T>* intern(const expr<T>& e) {
+        return static_cast<const expr<T>*>(intern_tree(e));
+    }
+
+    /// the shared constant v
+    template<typename T>
+    const expr<T>* constant(const T& v) {
+        const_expr<T> c{v};
+        return static_cast<const expr<T>*>(intern(c, nullptr));
+    }
+
+    /// the shared variable named n, with its slot assigned by scope
+    template<typename T>
+    const expr<T>* var(var_scope& scope, const std::string& n) {
+        std::unique_ptr<const var_expr<T>> v{scope.var<T>(n)};
+        return static_cast<const expr<T>*>(intern(*v, nullptr));
+    }
+
+    /// the shared built-in binary operator o on shared operands l & r
+    template<typename T, typename A, typename B>
+    const expr<T>* bin_op(op o, const expr<A>* l, const expr<B>* r) {
+        bin_op_expr<T, A, B> b{o, borrow(l), borrow(r)};
+        const expr_node* ops[] = { l, r };
+        return static_cast<const expr<T>*>(intern(b, ops));
+    }
+
+    /// the shared conditional on shared operands
+    template<typename T>
+    const expr<T>* cond(const expr<bool>* c, const expr<T>* t,
+                        const expr<T>* f) {
+        if_expr<T> e{borrow(c), borrow(t), borrow(f)};
+        const expr_node* ops[] = { c, t, f };
+        return static_cast<const expr<T>*>(intern(e, ops));
+    }
+
+    /// the shared short-circuiting && on shared operands
+    const expr<bool>* land(const expr<bool>* l, const expr<bool>* r) {
+        and_expr e{borrow(l), borrow(r)};
+        const expr_node* ops[] = { l, r };
+        return static_cast<const expr<bool>*>(intern(e, ops));
+    }
+
+    /// the shared short-circuiting || on shared operands
+    const expr<bool>* lor(const expr<bool>* l, const expr<bool>* r) {
+        or_expr e{borrow(l), borrow(r)};
+        const expr_node* ops[] = { l, r };
+        return static_cast<const expr<bool>*>(intern(e, ops));
+    }
+
+    /// the number of distinct nodes built
+    std::size_t size() const { return nodes.size(); }
+
+    /// the number of requests answered by an existing node
+    std::size_t hits() const { return n_hits; }
+};
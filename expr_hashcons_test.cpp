@@ -0,0 +1,91 @@
+#include "expr_cache.hpp"
+#include "expr_hashcons.hpp"
+#include "expr_optimize.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+int main() {
+    expr_factory f;
+
+    // the same constant is a single node, so no clone is needed to reuse it
+    auto two = f.constant(2);
+    assert(f.constant(2) == two);
+    assert(f.constant(2.0) != f.constant(-2.0));
+    assert(f.constant(0.0) != f.constant(-0.0));
+
+    auto cond = f.bin_op<bool>(op::eq, f.bin_op<int>(op::add, two, two), 
+                                       f.constant(4));
+    auto root = f.cond(cond, f.constant<std::string>("correct"),
+                             f.constant<std::string>("incorrect"));
+    std::cout << *root << "\n = " << root->eval() << std::endl;
+    assert(&root->operand(0).operand(0).operand(0) 
+           == &root->operand(0).operand(0).operand(1));
+
+    // interning an ordinary tree shares it with the nodes built so far
+    if_expr<std::string> tree = {
+        new bin_op_expr<bool, int, int>(
+            op::eq,
+            new bin_op_expr<int, int, int>(
+                op::add, new const_expr<int>(2), new const_expr<int>(2)),
+            new const_expr<int>(4)
+        ),
+        new const_expr<std::string>("correct"),
+        new const_expr<std::string>("incorrect")
+    };
+    std::size_t before = f.size();
+    assert(f.intern(tree) == root);
+    assert(f.size() == before);
+
+    // structural hash & equality agree with sharing
+    assert(tree.equals(*root) && tree.hash() == root->hash());
+    std::unique_ptr<expr<std::string>> copy{root->clone()};
+    assert(copy->equals(tree) && copy.get() != root);
+
+    // custom operators are shared when they are the same operator object
+    bin_op_expr<int, int, int> product = {
+        mult, "*", new const_expr<int>(8), new const_expr<int>(5)
+    };
+    std::unique_ptr<expr<int>> product2{product.clone()};
+    bin_op_expr<int, int, int> other_product = {
+        mult, "*", new const_expr<int>(8), new const_expr<int>(5)
+    };
+    assert(f.intern(product) == f.intern(*product2));
+    assert(f.intern(product) != f.intern(other_product));
+    assert(!product.equals(other_product));
+
+    // a tree of repeated subexpressions shrinks to one node per level
+    const expr<int>* sum = f.constant(1);
+    std::unique_ptr<expr<int>> plain{new const_expr<int>(1)};
+    for (int i = 0; i < 10; ++i) {
+        sum = f.bin_op<int>(op::add, sum, sum);
+        plain.reset(new bin_op_expr<int, int, int>(
+            op::add, plain->clone(), plain->clone()));
+    }
+    assert(sum->eval() == 1024 && plain->eval() == 1024);
+    assert(f.intern(*plain) == sum);
+    std::cout << count_nodes(*plain) << " tree nodes, " << f.size() 
+              << " shared nodes, " << f.hits() << " hits" << std::endl;
+
+    // shared subtrees are hashed, compared & copied once, so a DAG of 2^60
+    // tree nodes is as quick to match as its 61 distinct nodes
+    expr_factory g;
+    const expr<int>* deep = f.constant(1);
+    const expr<int>* again = g.constant(1);
+    for (int i = 0; i < 60; ++i) {
+        deep = f.bin_op<int>(op::add, deep, deep);
+        again = g.bin_op<int>(op::add, again, again);
+    }
+    assert(deep != again && deep->hash() == again->hash());
+    assert(deep->equals(*again));
+    assert(!deep->equals(*f.bin_op<int>(op::add, deep, f.constant(2))));
+    result_cache cache;
+    auto k = cache.intern(*deep);
+    assert(cache.intern(*again) == k && k->nodes.size() == 61);
+    assert(k->tree->equals(*deep));
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+// native x86-64 code generation for int & bool expressions
+
+#include "expr.hpp"
+
+// The JIT needs x86-64, the System V calling convention & mmap, so is built
+// for Linux on x86-64 with GCC or Clang. Define EXPR_JIT to 0 to leave it out.
+#ifndef EXPR_JIT
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define EXPR_JIT 1
+#else
+#define EXPR_JIT 0
+#endif
+#endif
+
+#if EXPR_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/// One call of a jit_function's generated code, shared by the subtrees
+/// it evaluates through jit_fallback
+struct jit_call {
+    /// The variables the code was called on
+    const env* vars;
+    /// The exception thrown by one of those subtrees, which can't unwind
+    /// through the generated code, so is rethrown once it returns
+    std::exception_ptr error = nullptr;
+    /// Has a subtree thrown? The generated code tests this after each
+    /// fallback, and returns at once if so
+    bool failed = false;
+};
+
+/// Evaluates a subtree the JIT could not compile; called from generated
+/// code. If it throws, the exception is kept in call, and the value
+/// returned is ignored
+template<typename T>
+T jit_fallback(const expr<T>* e, jit_call* call) noexcept {
+    try {
+        return e->eval(*call->vars);
+    } catch (...) {
+        call->error = std::current_exception();
+        call->failed = true;
+        return T();
+    }
+}
+
+/// An expression of type int or bool, compiled to x86-64 machine code in an
+/// executable page of its own.
+///
+/// Constants, variables, conditionals and the built-in operators on ints
+/// and bools are compiled; any other subtree (custom operators, or
+/// comparisons of doubles or boxed values) is evaluated by calling its
+/// eval() from the generated code, and what they throw is rethrown by
+/// run(). The function owns a copy of the tree for those calls, so it is
+/// independent of the tree it was compiled from.
+/// Integer division by zero traps, as it does in eval()
+template<typename T>
+class jit_function {
+    static_assert(std::is_same_v<T, int> || std::is_same_v<T, bool>,
+        "the JIT compiles int & bool expressions");
+    static_assert(sizeof(cell) == 8, "variables are loaded as 8-byte cells");
+
+public:
+    /// The generated function, called with the variable cells & the call
+    /// of it (for the subtrees run by the interpreter). If the call has
+    /// failed, the value is meaningless, and the caller must rethrow the
+    /// call's error in its place
+    using function_type = T (*)(const cell* vars, jit_call* call);
+
+private:
+    /// The copy of the tree the fallback calls evaluate
+    std::unique_ptr<expr<T>> tree;
+    /// The executable page(s) holding the code
+    void* page = nullptr;
+    /// The size of the mapping
+    std::size_t mapped = 0;
+    /// The size of the code
+    std::size_t code_size = 0;
+    /// The number of subtrees left to the interpreter
+    std::size_t n_fallbacks = 0;
+    /// The number of env slots the code reads
+    std::size_t n_vars = 0;
+
+    /// The code being generated
+    std::vector<unsigned char> buf;
+    /// The number of 8-byte temporaries pushed at the current point of the
+    /// code, which decides the stack alignment at calls
+    std::size_t depth = 0;
+    /// The jumps to the epilogue taken when a fallback has thrown
+    std::vector<std::size_t> to_epilogue;
+
+    void emit(std::initializer_list<unsigned char> bytes) {
+        buf.insert(buf.end(), bytes);
+    }
+
+    void emit32(std::uint32_t v) {
+        unsigned char b[4];
+        std::memcpy(b, &v, 4);
+        buf.insert(buf.end(), b, b + 4);
+    }
+
+    void emit64(std::uint64_t v) {
+        unsigned char b[8];
+        std::memcpy(b, &v, 8);
+        buf.insert(buf.end(), b, b + 8);
+    }
+
+    /// emits a jump with opcode bytes op, returning the offset of its
+    /// displacement to patch
+    std::size_t emit_jump(std::initializer_list<unsigned char> op) {
+        emit(op);
+        std::size_t at = buf.size();
+        emit32(0);
+        return at;
+    }
+
+    /// points the jump displacement at `at` to the current position
+    void patch(std::size_t at) {
+        std::uint32_t rel = std::uint32_t(buf.size() - (at + 4));
+        std::memcpy(&buf[at], &rel, 4);
+    }
+
+    /// Can e be compiled, as opposed to called through jit_fallback?
+    static bool native(const expr_node& e) {
+        value_kind k = e.result_kind();
+        if ( k != value_kind::integer && k != value_kind::boolean ) return false;
+        switch ( e.kind() ) {
+        case node_kind::constant:
+        case node_kind::var:
+        case node_kind::cond:
+            return true;
+        case node_kind::bin_op: {
+            if ( is_short_circuit(e) ) return true;
+            value_kind arg = e.operand(0).result_kind();
+            return find_cell_op(e) >= 0 && arg != value_kind::real;
+        }
+        }
+        return false;
+    }
+
+    /// calls jit_fallback on e, leaving its value in eax
+    void lower_fallback(const expr_node& e) {
+        ++n_fallbacks;
+        // calls need a 16-byte aligned stack
+        bool pad = depth % 2 == 1;
+        if ( pad ) emit({0x48, 0x83, 0xEC, 0x08});      // sub rsp, 8
+        emit({0x48, 0xBF});                             // mov rdi, e
+        emit64(std::uint64_t(reinterpret_cast<std::uintptr_t>(&e)));
+        emit({0x4C, 0x89, 0xE6});                       // mov rsi, r12
+        emit({0x48, 0xB8});                             // mov rax, fn
+        if ( e.result_kind() == value_kind::integer ) {
+            emit64(std::uint64_t(reinterpret_cast<std::uintptr_t>(
+                &jit_fallback<int>)));
+            emit({0xFF, 0xD0});                         // call rax
+        } else {
+            emit64(std::uint64_t(reinterpret_cast<std::uintptr_t>(
+                &jit_fallback<bool>)));
+            emit({0xFF, 0xD0});                         // call rax
+            emit({0x0F, 0xB6, 0xC0});                   // movzx eax, al
+        }
+        if ( pad ) emit({0x48, 0x83, 0xC4, 0x08});      // add rsp, 8
+        // nothing more is evaluated once a subtree has thrown, as eval()
+        // would stop there; the epilogue drops the temporaries pushed
+        static_assert(offsetof(jit_call, failed) < 0x80,
+                      "the flag is addressed with an 8-bit displacement");
+        emit({0x41, 0x80, 0x7C, 0x24,                   // cmp byte [r12+failed], 0
+              std::uint8_t(offsetof(jit_call, failed)), 0x00});
+        to_epilogue.push_back(emit_jump({0x0F, 0x85})); // jnz epilogue
+    }
+
+    /// appends the code for e, which leaves its value in eax;
+    /// vars is in rbx & the jit_call in r12
+    void lower(const expr_node& e) {
+        if ( !native(e) ) return lower_fallback(e);
+        switch ( e.kind() ) {
+        case node_kind::constant: {
+            value_pool unused;
+            cell v = e.value(unused);
+            emit({0xB8});                               // mov eax, v
+            emit32(std::uint32_t(
+                e.result_kind() == value_kind::integer ? v.i : int(v.b)));
+            return;
+        }
+        case node_kind::var: {
+            std::uint32_t disp = std::uint32_t(e.slot() * sizeof(cell));
+            if ( e.result_kind() == value_kind::integer ) {
+                emit({0x8B, 0x83});                     // mov eax, [rbx+disp]
+            } else {
+                emit({0x0F, 0xB6, 0x83});               // movzx eax, byte [rbx+disp]
+            }
+            emit32(disp);
+            if ( e.slot() >= n_vars ) n_vars = e.slot() + 1;
+            return;
+        }
+        case node_kind::cond: {
+            lower(e.operand(0));
+            emit({0x85, 0xC0});                         // test eax, eax
+            std::size_t to_false = emit_jump({0x0F, 0x84});  // jz
+            lower(e.operand(1));
+            std::size_t to_end = emit_jump({0xE9});     // jmp
+            patch(to_false);
+            lower(e.operand(2));
+            patch(to_end);
+            return;
+        }
+        case node_kind::bin_op:
+            break;
+        }
+
+        if ( is_short_circuit(e) ) {
+            // the left operand is the result if it decides it
+            lower(e.operand(0));
+            emit({0x85, 0xC0});                         // test eax, eax
+            std::size_t to_end = emit_jump(e.opcode() == op::land
+                ? std::initializer_list<unsigned char>{0x0F, 0x84}   // jz
+                : std::initializer_list<unsigned char>{0x0F, 0x85}); // jnz
+            lower(e.operand(1));
+            patch(to_end);
+            return;
+        }
+
+        // the left operand is kept on the stack while the right one is 
+        // computed, then they go to eax & ecx
+        lower(e.operand(0));
+        emit({0x50});                                   // push rax
+        ++depth;
+        lower(e.operand(1));
+        emit({0x89, 0xC1});                             // mov ecx, eax
+        emit({0x58});                                   // pop rax
+        --depth;
+        switch ( e.opcode() ) {
+        case op::add: emit({0x01, 0xC8}); return;       // add eax, ecx
+        case op::sub: emit({0x29, 0xC8}); return;       // sub eax, ecx
+        case op::mul: emit({0x0F, 0xAF, 0xC1}); return; // imul eax, ecx
+        case op::div: emit({0x99, 0xF7, 0xF9}); return; // cdq; idiv ecx
+        case op::mod:                                   // cdq; idiv ecx;
+            emit({0x99, 0xF7, 0xF9, 0x89, 0xD0});       // mov eax, edx
+            return;
+        default:
+            break;
+        }
+        unsigned char setcc = 0;
+        switch ( e.opcode() ) {
+        case op::eq: setcc = 0x94; break;               // sete
+        case op::ne: setcc = 0x95; break;               // setne
+        case op::lt: setcc = 0x9C; break;               // setl
+        case op::le: setcc = 0x9E; break;               // setle
+        case op::gt: setcc = 0x9F; break;               // setg
+        case op::ge: setcc = 0x9D; break;               // setge
+        default: unimplemented<void>();
+        }
+        emit({0x39, 0xC8});                             // cmp eax, ecx
+        emit({0x0F, setcc, 0xC0});                      // setcc al
+        emit({0x0F, 0xB6, 0xC0});                       // movzx eax, al
+    }
+
+    /// copies the code into an executable mapping
+    void load() {
+        long page_size = sysconf(_SC_PAGESIZE);
+        code_size = buf.size();
+        mapped = (code_size + page_size - 1) / page_size * page_size;
+        void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( p == MAP_FAILED ) throw std::bad_alloc();
+        std::memcpy(p, buf.data(), code_size);
+        // the page is never writable & executable at once
+        if ( mprotect(p, mapped, PROT_READ | PROT_EXEC) != 0 ) {
+            munmap(p, mapped);
+            throw std::bad_alloc();
+        }
+        page = p;
+        buf = std::vector<unsigned char>();
+    }
+
+    void release() {
+        if ( page ) munmap(page, mapped);
+        page = nullptr;
+    }
+
+public:
+    /// compiles e; throws std::bad_alloc if no executable memory can be
+    /// mapped
+    explicit jit_function(const expr<T>& e)
+    : tree(e.clone()) {
+        // rbx & r12 are callee-saved, and the three pushes leave the stack
+        // 16-byte aligned
+        emit({0x53});                                   // push rbx
+        emit({0x41, 0x54});                             // push r12
+        emit({0x55});                                   // push rbp
+        emit({0x48, 0x89, 0xFB});                       // mov rbx, rdi
+        emit({0x49, 0x89, 0xF4});                       // mov r12, rsi
+        emit({0x48, 0x89, 0xE5});                       // mov rbp, rsp
+        lower(*tree);
+        for (std::size_t at : to_epilogue) patch(at);
+        emit({0x48, 0x89, 0xEC});                       // mov rsp, rbp
+        emit({0x5D});                                   // pop rbp
+        emit({0x41, 0x5C});                             // pop r12
+        emit({0x5B});                                   // pop rbx
+        emit({0xC3});                                   // ret
+        load();
+    }
+
+    jit_function(const jit_function&) = delete;
+    jit_function& operator= (const jit_function&) = delete;
+
+    jit_function(jit_function&& o)
+    : tree(std::move(o.tree)), page(o.page), mapped(o.mapped),
+      code_size(o.code_size), n_fallbacks(o.n_fallbacks), n_vars(o.n_vars) {
+        o.page = nullptr;
+    }
+
+    jit_function& operator= (jit_function&& o) {
+        if ( &o == this ) return *this;
+        release();
+        tree = std::move(o.tree);
+        page = o.page;
+        mapped = o.mapped;
+        code_size = o.code_size;
+        n_fallbacks = o.n_fallbacks;
+        n_vars = o.n_vars;
+        o.page = nullptr;
+        return *this;
+    }
+
+    ~jit_function() { release(); }
+
+    /// the generated function; valid as long as this object is
+    function_type function() const {
+        return reinterpret_cast<function_type>(page);
+    }
+
+    /// runs the generated code, producing the same value as eval() on the
+    /// expression it was compiled from
+    T run() const {
+        return run(env());
+    }
+
+    /// runs the generated code on the variables vars, producing the same
+    /// value as eval(vars) on the expression it was compiled from, or
+    /// throwing what it throws
+    T run(const env& vars) const {
+        assert(vars.size() >= n_vars);
+        jit_call call{&vars};
+        T v = function()(vars.data(), &call);
+        if ( call.failed ) std::rethrow_exception(call.error);
+        return v;
+    }
+
+    /// the number of bytes of machine code
+    std::size_t size() const { return code_size; }
+
+    /// the number of subtrees evaluated by the interpreter
+    std::size_t fallbacks() const { return n_fallbacks; }
+};
+
+/// Compiles an int or bool expression to native code
+template<typename T>
+jit_function<T> compile_jit(const expr<T>& e) {
+    return jit_function<T>(e);
+}
+
+#endif
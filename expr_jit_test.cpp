@@ -0,0 +1,211 @@
+#include "expr_jit.hpp"
+#include "expr_test_samples.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#if EXPR_JIT
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// wrapper function for equality, which formats doubles, so it crashes if
+/// the generated code calls it with a misaligned stack
+bool same_digits(double a, double b) {
+    char x[32], y[32];
+    std::snprintf(x, sizeof x, "%.3f", a);
+    std::snprintf(y, sizeof y, "%.3f", b);
+    return std::string(x) == y;
+}
+
+/// a custom operator which fails
+int fail(int, int) { throw std::runtime_error("failed"); }
+
+/// The number of calls to counted()
+int fallback_calls = 0;
+
+/// a custom operator counting its calls
+int counted(int a, int b) {
+    ++fallback_calls;
+    return a + b;
+}
+
+/// checks that the generated code agrees with the tree-walking evaluator
+template<typename T>
+void check(const expr<T>& e, std::size_t fallbacks, const env& vars = env()) {
+    auto fn = compile_jit(e);
+    std::cout << e << " = " << fn.run(vars) << " (" << fn.size() 
+              << " bytes, " << fn.fallbacks() << " fallbacks)" << std::endl;
+    assert(fn.run(vars) == e.eval(vars));
+    assert(fn.fallbacks() == fallbacks);
+}
+
+int main() {
+    // the generated code agrees with the tree-walking evaluator on the
+    // samples of the types it compiles
+    samples::for_each([](const auto& e, const env& vars) {
+        using T = std::decay_t<decltype(e.eval())>;
+        if constexpr ( std::is_same_v<T, int> || std::is_same_v<T, bool> ) {
+            assert(compile_jit(e).run(vars) == e.eval(vars));
+        }
+    });
+
+    // the rule from expr_test.cpp, as an int
+    if_expr<int> root = {
+        new bin_op_expr<bool, int, int>(
+            op::eq,
+            new bin_op_expr<int, int, int>(
+                op::add, new const_expr<int>(2), new const_expr<int>(2)),
+            new const_expr<int>(4)),
+        new const_expr<int>(1),
+        new const_expr<int>(0)
+    };
+    check(root, 0);
+
+    // every built-in int & bool operator
+    const op int_ops[] = { 
+        op::add, op::sub, op::mul, op::div, op::mod, 
+        op::eq, op::ne, op::lt, op::le, op::gt, op::ge 
+    };
+    for (op o : int_ops) {
+        for (int a : { -7, 0, 3 }) {
+            for (int b : { -2, 5 }) {
+                if ( is_comparison(o) ) {
+                    check(bin_op_expr<bool, int, int>(
+                        o, new const_expr<int>(a), new const_expr<int>(b)), 0);
+                } else {
+                    check(bin_op_expr<int, int, int>(
+                        o, new const_expr<int>(a), new const_expr<int>(b)), 0);
+                }
+            }
+        }
+    }
+    for (op o : { op::eq, op::ne, op::land, op::lor }) {
+        for (bool a : { false, true }) {
+            for (bool b : { false, true }) {
+                check(bin_op_expr<bool, bool, bool>(
+                    o, new const_expr<bool>(a), new const_expr<bool>(b)), 0);
+            }
+        }
+    }
+
+    // custom operators & double comparisons are run by the interpreter, 
+    // from inside nested operands so the stack holds temporaries
+    var_scope scope;
+    if_expr<int> mixed = {
+        new or_expr(
+            new bin_op_expr<bool, double, double>(
+                same_digits, "~", scope.var<double>("w"), 
+                new const_expr<double>(0.5)),
+            new bin_op_expr<bool, double, double>(
+                op::gt, scope.var<double>("w"), new const_expr<double>(10.0))),
+        new bin_op_expr<int, int, int>(
+            op::add,
+            new bin_op_expr<int, int, int>(
+                op::sub,
+                new bin_op_expr<int, int, int>(
+                    mult, "*", scope.var<int>("x"), new const_expr<int>(3)),
+                scope.var<int>("y")),
+            new const_expr<int>(100)),
+        new bin_op_expr<int, int, int>(
+            op::mod, scope.var<int>("x"), scope.var<int>("y"))
+    };
+    env vars = scope.make_env();
+    auto fn = compile_jit(mixed);
+    for (double w : { 0.5, 3.0, 12.0 }) {
+        for (int x : { -9, 4, 11 }) {
+            for (int y : { -3, 1, 7 }) {
+                vars.set(scope.slot("w"), w);
+                vars.set(scope.slot("x"), x);
+                vars.set(scope.slot("y"), y);
+                assert(fn.run(vars) == mixed.eval(vars));
+            }
+        }
+    }
+    check(mixed, 3, vars);
+
+    // && short-circuits, so the division by zero never runs
+    auto zero = scope.var<int>("zero");
+    vars = scope.make_env();
+    and_expr guarded = {
+        new bin_op_expr<bool, int, int>(
+            op::ne, zero, new const_expr<int>(0)),
+        new bin_op_expr<bool, int, int>(
+            op::gt,
+            new bin_op_expr<int, int, int>(
+                op::div, new const_expr<int>(10), zero->clone()),
+            new const_expr<int>(1))
+    };
+    check(guarded, 0, vars);
+
+    // exceptions from subtrees run by the interpreter reach the caller, and
+    // the subtrees after them aren't evaluated
+    fallback_calls = 0;
+    bin_op_expr<int, int, int> thrown = {
+        op::div,
+        new bin_op_expr<int, int, int>(
+            fail, "fail", new const_expr<int>(1), new const_expr<int>(2)),
+        new bin_op_expr<int, int, int>(
+            counted, "counted", new const_expr<int>(3), new const_expr<int>(4))
+    };
+    auto throwing = compile_jit(thrown);
+    assert(throwing.fallbacks() == 2);
+    for (int i = 0; i < 2; ++i) {
+        try {
+            throwing.run();
+            assert(!"expected an exception");
+        } catch (const std::runtime_error& ex) {
+            assert(std::string(ex.what()) == "failed");
+        }
+    }
+    assert(fallback_calls == 0);
+
+    // nor are the native operations after them, which could trap: here
+    // the division by zero is never reached, as in eval()
+    var_scope divisors;
+    auto y = divisors.var<int>("y");
+    bin_op_expr<int, int, int> before_trap = {
+        op::add,
+        new bin_op_expr<int, int, int>(
+            fail, "fail", new const_expr<int>(1), new const_expr<int>(2)),
+        new bin_op_expr<int, int, int>(op::div, new const_expr<int>(10), y)
+    };
+    env zero_y = divisors.make_env();
+    zero_y.set(divisors.slot("y"), 0);
+    auto trapping = compile_jit(before_trap);
+    assert(trapping.fallbacks() == 1);
+    try {
+        trapping.run(zero_y);
+        assert(!"expected an exception");
+    } catch (const std::runtime_error& ex) {
+        assert(std::string(ex.what()) == "failed");
+    }
+
+    // the generated code is a plain function, & outlives the source tree
+    jit_function<bool>::function_type f;
+    {
+        std::unique_ptr<expr<bool>> t{new bin_op_expr<bool, bool, bool>(
+            op::ne, scope.var<bool>("flag"), new const_expr<bool>(true))};
+        auto compiled = compile_jit(*t);
+        t.reset();
+        vars = scope.make_env();
+        vars.set(scope.slot("flag"), false);
+        f = compiled.function();
+        jit_call call{&vars};
+        assert(f(vars.data(), &call) && !call.failed);
+        jit_function<bool> moved = std::move(compiled);
+        assert(moved.run(vars));
+    }
+}
+
+#else
+
+int main() {
+    std::cout << "the JIT is not supported on this platform" << std::endl;
+}
+
+#endif
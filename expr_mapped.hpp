@@ -0,0 +1,332 @@
+#pragma once
+
+// evaluating rule sets in place, in their binary form
+
+#include "expr.hpp"
+#include "expr_registry.hpp"
+#include "expr_serialize.hpp"
+
+// Mapping files needs POSIX mmap. Define EXPR_MMAP to 0 to leave out
+// mapped_file; rule sets can still be evaluated from memory
+#ifndef EXPR_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define EXPR_MMAP 1
+#else
+#define EXPR_MMAP 0
+#endif
+#endif
+
+#if EXPR_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <system_error>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#if EXPR_MMAP
+
+/// A file mapped read-only into memory. Its pages are read in as they are
+/// first touched, and shared with every other process mapping the file
+class mapped_file {
+    void* addr = nullptr;
+    std::size_t len = 0;
+
+    [[noreturn]] static void fail(const std::string& what, int fd = -1) {
+        int e = errno;
+        if ( fd >= 0 ) ::close(fd);
+        throw std::system_error(e, std::generic_category(), what);
+    }
+
+public:
+    mapped_file() = default;
+
+    /// maps the file at path; throws std::system_error if it cannot
+    explicit mapped_file(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if ( fd < 0 ) fail("cannot open " + path);
+        struct stat st;
+        if ( ::fstat(fd, &st) != 0 ) fail("cannot stat " + path, fd);
+        len = std::size_t(st.st_size);
+        if ( len > 0 ) {
+            addr = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+            if ( addr == MAP_FAILED ) {
+                addr = nullptr;
+                fail("cannot map " + path, fd);
+            }
+        }
+        ::close(fd);
+    }
+
+    mapped_file(mapped_file&& o) noexcept
+    : addr(std::exchange(o.addr, nullptr)), len(std::exchange(o.len, 0)) {}
+
+    mapped_file& operator= (mapped_file&& o) noexcept {
+        std::swap(addr, o.addr);
+        std::swap(len, o.len);
+        return *this;
+    }
+
+    ~mapped_file() {
+        if ( addr ) ::munmap(addr, len);
+    }
+
+    /// the contents of the file
+    const unsigned char* data() const {
+        return static_cast<const unsigned char*>(addr);
+    }
+
+    /// the size of the file in bytes
+    std::size_t size() const { return len; }
+};
+
+#endif
+
+/// A list of trees in the binary form written by expr_writer, evaluated
+/// where it lies rather than built into nodes. Loading checks the data
+/// once, in full, and keeps only the offset of each tree & a table of the
+/// slots & functions its names stand for, so it allocates a few small
+/// arrays however many nodes there are. Evaluation walks the encoded
+/// nodes directly, using the skip lengths to jump over the operands that
+/// && and || and conditionals do not need.
+///
+/// The data must outlive the rule set, unless it is a mapped_file the rule
+/// set owns; the registry & scope are only used while loading. Variables
+/// are declared in the scope, so envs for it hold their values. String
+/// constants are copied out of the data when evaluated, as the custom
+/// operators on cells take std::strings
+class mapped_rules {
+#if EXPR_MMAP
+    mapped_file file;
+#endif
+    const unsigned char* data;
+    std::size_t n;
+    /// The offset of each tree in the data
+    std::vector<std::size_t> offsets;
+    /// The type of each tree
+    std::vector<const std::type_info*> types;
+    /// The slot of the variable named by each entry of the name table,
+    /// if any
+    std::vector<std::size_t> slots;
+    /// The custom operator named by each entry of the name table, if any
+    std::vector<cell_fn> fns;
+
+    /// How the built-in operators are applied to cells
+    struct builtin_table {
+        /// The built-in operators on strings, by opcode
+        cell_fn string_ops[n_ops];
+        /// The EXPR_CELL_OPS entry for each built-in operator on bools,
+        /// ints & doubles, by opcode & type code
+        signed char native[n_ops][3];
+    };
+
+    /// the table, shared by every rule set
+    static const builtin_table& builtins() {
+        static const builtin_table table = []{
+            const op_registry& r = op_registry::builtins();
+            builtin_table b;
+            const value_kind kinds[] = {
+                value_kind::boolean, value_kind::integer, value_kind::real
+            };
+            for (int o = 0; o < int(op::custom); ++o) {
+                for (int k = 0; k < 3; ++k) {
+                    bool to_bool = is_comparison(op(o)) || is_logical(op(o));
+                    b.native[o][k] = static_cast<signed char>(find_cell_op(
+                        op(o), kinds[k], to_bool ? value_kind::boolean : kinds[k]));
+                }
+                if ( r.builtin_applies(op(o), r.string_type()) ) {
+                    std::unique_ptr<expr_node> e{r.make_builtin(
+                        op(o), r.string_type(),
+                        new const_expr<std::string>(std::string()),
+                        new const_expr<std::string>(std::string()))};
+                    b.string_ops[o] = e->cell_op();
+                }
+            }
+            return b;
+        }();
+        return table;
+    }
+
+    const builtin_table* table = &builtins();
+
+    void load(const op_registry& r, var_scope* s) {
+        serial::checker check(data, n, r, s);
+        // each tree takes at least two bytes
+        if ( check.n_trees > n ) check.fail("bad tree count");
+        offsets.reserve(check.n_trees);
+        types.reserve(check.n_trees);
+        for (std::size_t i = 0; i < check.n_trees; ++i) {
+            offsets.push_back(check.pos);
+            types.push_back(check.tree()->type);
+        }
+        if ( check.pos != n ) check.fail("data after the last tree");
+
+        slots.resize(check.names.size());
+        fns.resize(check.names.size());
+        for (std::size_t i = 0; i < check.names.size(); ++i) {
+            const std::string& name = check.names[i];
+            if ( s && s->contains(name) ) slots[i] = s->slot(name);
+            if ( auto c = r.find_op(name) ) fns[i] = c->proto->cell_op();
+        }
+    }
+
+    /// evaluates the node at p, moving past it
+    cell eval_node(const unsigned char*& p, const env& vars,
+                   value_pool& pool) const {
+        cell c{};
+        switch ( *p++ ) {
+        case serial::constant_tag:
+            switch ( serial::read_varint(p) ) {
+            case serial::bool_code: c.b = *p++ != 0; return c;
+            case serial::int_code: c.i = serial::read_int(p); return c;
+            case serial::double_code: c.d = serial::read_double(p); return c;
+            }
+            {
+                // a string, the only other type constants may have
+                std::size_t len = serial::read_varint(p);
+                c.ptr = pool.keep(std::string(reinterpret_cast<const char*>(p), len));
+                p += len;
+                return c;
+            }
+        case serial::var_tag:
+            serial::read_varint(p);
+            return vars[slots[serial::read_varint(p)]];
+        case serial::builtin_tag: {
+            int o = *p++;
+            std::uint64_t type = serial::read_varint(p);
+            cell l = eval_node(p, vars, pool);
+            cell r = eval_node(p, vars, pool);
+            if ( type == serial::string_code ) return table->string_ops[o](l, r, pool);
+            switch ( cell_instr(table->native[o][type]) ) {
+#define EXPR_MAPPED_OP(name, code, arg, res, sym) \
+            case cell_instr::name: c.res = l.arg sym r.arg; return c;
+            EXPR_CELL_OPS(EXPR_MAPPED_OP)
+#undef EXPR_MAPPED_OP
+            }
+            return c;
+        }
+        case serial::logic_tag: {
+            bool is_and = op(*p++) == op::land;
+            cell l = eval_node(p, vars, pool);
+            std::uint32_t skip = serial::read_u32(p);
+            if ( l.b != is_and ) {
+                p += skip;
+                return l;
+            }
+            return eval_node(p, vars, pool);
+        }
+        case serial::custom_tag: {
+            const cell_fn& f = fns[serial::read_varint(p)];
+            cell l = eval_node(p, vars, pool);
+            cell r = eval_node(p, vars, pool);
+            return f(l, r, pool);
+        }
+        }
+        serial::read_varint(p);
+        cell cond = eval_node(p, vars, pool);
+        std::uint32_t skip = serial::read_u32(p);
+        if ( !cond.b ) {
+            p += skip;
+            return eval_node(p, vars, pool);
+        }
+        c = eval_node(p, vars, pool);
+        skip_node(p);
+        return c;
+    }
+
+    /// moves past the node at p without evaluating it
+    static void skip_node(const unsigned char*& p) {
+        switch ( *p++ ) {
+        case serial::constant_tag:
+            switch ( serial::read_varint(p) ) {
+            case serial::bool_code: ++p; return;
+            case serial::int_code: serial::read_varint(p); return;
+            case serial::double_code: p += 8; return;
+            }
+            p += serial::read_varint(p);
+            return;
+        case serial::var_tag:
+            serial::read_varint(p);
+            serial::read_varint(p);
+            return;
+        case serial::builtin_tag:
+            ++p;
+            serial::read_varint(p);
+            skip_node(p);
+            skip_node(p);
+            return;
+        case serial::logic_tag: {
+            ++p;
+            skip_node(p);
+            std::uint32_t skip = serial::read_u32(p);
+            p += skip;
+            return;
+        }
+        case serial::custom_tag:
+            serial::read_varint(p);
+            skip_node(p);
+            skip_node(p);
+            return;
+        }
+        serial::read_varint(p);
+        skip_node(p);
+        std::uint32_t skip = serial::read_u32(p);
+        p += skip;
+        skip_node(p);
+    }
+
+public:
+    /// loads the n bytes of data, which must outlive the rule set.
+    /// Throws a decode_error if they are malformed
+    mapped_rules(const unsigned char* data, std::size_t n,
+                 const op_registry& r = op_registry::builtins(),
+                 var_scope* s = nullptr)
+    : data(data), n(n) {
+        load(r, s);
+    }
+
+#if EXPR_MMAP
+    /// maps & loads the file at path. Throws std::system_error if it
+    /// cannot be mapped, and a decode_error if it is malformed
+    explicit mapped_rules(const std::string& path,
+                          const op_registry& r = op_registry::builtins(),
+                          var_scope* s = nullptr)
+    : file(path), data(file.data()), n(file.size()) {
+        load(r, s);
+    }
+#endif
+
+    /// the number of trees
+    std::size_t size() const { return offsets.size(); }
+
+    /// the type of tree i
+    const std::type_info& type(std::size_t i) const { return *types[i]; }
+
+    /// evaluates tree i, which must be of type T, with the variables in vars
+    template<typename T>
+    T eval(std::size_t i, const env& vars = env()) const {
+        assert(typeid(T) == *types[i]);
+        value_pool pool;
+        const unsigned char* p = data + offsets[i];
+        return value_traits<T>::get(eval_node(p, vars, pool));
+    }
+
+    /// the memory the rule set allocates, not counting the data itself or
+    /// what its custom operators hold
+    std::size_t memory_usage() const {
+        return sizeof(*this) + offsets.capacity() * sizeof(std::size_t)
+            + types.capacity() * sizeof(const std::type_info*)
+            + slots.capacity() * sizeof(std::size_t)
+            + fns.capacity() * sizeof(cell_fn);
+    }
+};
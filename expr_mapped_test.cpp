@@ -0,0 +1,139 @@
+#include "expr_mapped.hpp"
+#include "expr_parse.hpp"
+#include "expr_serialize.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// The number of calls to the custom operator `count`
+int counted = 0;
+
+int main() {
+    var_scope scope;
+    scope.declare<int>("x");
+    scope.declare<double>("w");
+    scope.declare<bool>("flag");
+    scope.declare<std::string>("who");
+    op_registry ops;
+    ops.define_op<int, int, int>("mult", mult);
+    ops.define_op<bool, int, int>(
+        "count", [](int a, int b) { ++counted; return a < b; }, 4);
+    expr_parser p(ops, &scope);
+
+    // rules exercising every kind of node, with conditionals & && / || in
+    // the middle of trees, so that skipping their operands must land on the
+    // operands after them
+    std::vector<std::unique_ptr<expr<int>>> ints;
+    for (const char* s : {
+            "if (8 mult 5 == 40) 1 else 0",
+            "(if flag x else 0 - x) + x mult 3",
+            "if (flag && x > 2 || x == -7) (if (x > 0) 1 else 2) * 10 else 3",
+            "if (who + \"!\" == \"you!\") 100 else x % 7",
+            "if (w * 2.0 >= 1.0 && flag != false) 4 else 5" }) {
+        ints.emplace_back(p.parse<int>(s));
+    }
+    std::unique_ptr<expr<std::string>> greeting{
+        p.parse<std::string>("if flag \"hello, \" + who else who")};
+    std::unique_ptr<expr<bool>> lazy{
+        p.parse<bool>("x > 0 && (0 count 1) || (1 count 2)")};
+
+    expr_writer w(ops);
+    for (auto& e : ints) w.add(*e);
+    w.add(*greeting);
+    w.add(*lazy);
+    std::vector<unsigned char> data = w.finish();
+
+    // rule sets load from a file, where files can be mapped, or from memory
+    var_scope other;
+    other.declare<std::string>("who");
+#if EXPR_MMAP
+    std::string path = "expr_mapped_test.rules";
+    std::ofstream(path, std::ios::binary).write(
+        reinterpret_cast<const char*>(data.data()), data.size());
+    mapped_rules rules(path, ops, &other);
+    std::remove(path.c_str());
+#else
+    mapped_rules rules(data.data(), data.size(), ops, &other);
+#endif
+    mapped_rules in_memory(data.data(), data.size(), ops, &scope);
+    assert(rules.size() == ints.size() + 2);
+    assert(rules.type(0) == typeid(int));
+    assert(rules.type(ints.size()) == typeid(std::string));
+    std::cout << data.size() << " bytes, " << rules.memory_usage()
+              << " bytes loaded" << std::endl;
+
+    // evaluating in place agrees with the trees, with variables in the
+    // scope given when loading
+    for (int x : {-7, 0, 3, 12}) {
+        for (bool flag : {false, true}) {
+            env vars = scope.make_env();
+            vars.set(scope.slot("x"), x);
+            vars.set(scope.slot("w"), x * 0.25);
+            vars.set(scope.slot("flag"), flag);
+            vars.set<std::string>(scope.slot("who"), x > 0 ? "you" : "me");
+            env mine = other.make_env();
+            mine.set(other.slot("x"), x);
+            mine.set(other.slot("w"), x * 0.25);
+            mine.set(other.slot("flag"), flag);
+            mine.set<std::string>(other.slot("who"), x > 0 ? "you" : "me");
+            for (std::size_t i = 0; i < ints.size(); ++i) {
+                int v = ints[i]->eval(vars);
+                assert(rules.eval<int>(i, mine) == v);
+                assert(in_memory.eval<int>(i, vars) == v);
+            }
+            std::size_t i = ints.size();
+            assert(rules.eval<std::string>(i, mine) == greeting->eval(vars));
+
+            // only the operands needed are evaluated
+            counted = 0;
+            bool b = lazy->eval(vars);
+            int calls = counted;
+            counted = 0;
+            assert(rules.eval<bool>(i + 1, mine) == b);
+            assert(counted == calls);
+        }
+    }
+
+    // rule sets without variables need no scope
+    std::unique_ptr<expr<double>> constant{p.parse<double>("1.5 * -2.0 + 0.25")};
+    std::vector<unsigned char> plain = serialize(*constant);
+    mapped_rules alone(plain.data(), plain.size());
+    assert(alone.eval<double>(0) == -2.75);
+
+    // malformed data is refused when loading, not when evaluating
+    for (std::size_t n = 0; n < data.size(); ++n) {
+        try {
+            mapped_rules cut(data.data(), n, ops, &scope);
+            assert(!"expected a decode error");
+        } catch (const decode_error&) {}
+    }
+    std::vector<unsigned char> bad = data;
+    for (std::size_t i = 0; i < bad.size(); ++i) {
+        for (int bit = 0; bit < 8; ++bit) {
+            bad[i] ^= 1 << bit;
+            var_scope s;
+            try {
+                mapped_rules r(bad.data(), bad.size(), ops, &s);
+            } catch (const decode_error&) {}
+            bad[i] ^= 1 << bit;
+        }
+    }
+
+#if EXPR_MMAP
+    // missing files are reported
+    try {
+        mapped_rules missing("no such file.rules", ops, &scope);
+        assert(!"expected an error");
+    } catch (const std::system_error& e) {
+        std::cout << e.what() << std::endl;
+    }
+#endif
+}
@@ -0,0 +1,107 @@
+#include "expr.hpp"
+#include "expr_hashcons.hpp"
+
+#include <array>
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+int main() {
+    // a node of an inline type owns only itself
+    const_expr<int> one = 1;
+    assert(one.memory_usage() == sizeof(one));
+
+    // long strings are on the heap, short ones in the node
+    const_expr<std::string> shorter = std::string("ok");
+    assert(shorter.memory_usage() == sizeof(shorter));
+    std::string text(100, 'x');
+    const_expr<std::string> longer = text;
+    assert(longer.memory_usage() >= sizeof(longer) + 101);
+
+    // the sample rule, with a custom operator & boxed values
+    if_expr<std::string> root = {
+        new bin_op_expr<bool, int, int>(
+            op::eq,
+            new bin_op_expr<int, int, int>(
+                mult, "multiply", new const_expr<int>(8), new const_expr<int>(5)),
+            new const_expr<int>(40)),
+        new const_expr<std::string>("correct"),
+        new const_expr<std::string>("incorrect")
+    };
+    std::size_t nodes = sizeof(root) + sizeof(bin_op_expr<bool, int, int>)
+        + sizeof(bin_op_expr<int, int, int>) + 3 * sizeof(const_expr<int>)
+        + 2 * sizeof(const_expr<std::string>);
+    std::size_t used = root.memory_usage();
+    std::cout << root << ": " << used << " bytes in 8 nodes" << std::endl;
+    // the custom operator is stored once, with its name
+    assert(used > nodes);
+    assert(used < nodes + 256);
+
+    // copies share their custom operators, which are counted once
+    std::unique_ptr<expr<std::string>> copy{root.clone()};
+    memory_seen seen;
+    std::size_t both = root.memory_usage(seen);
+    both += copy->memory_usage(seen);
+    assert(both == used + nodes);
+
+    // std::function stores large callables on the heap
+    std::array<int, 32> table{};
+    bin_op_expr<int, int, int> lookup = {
+        [table](int a, int b) { return table[a] + b; }, "lookup",
+        new const_expr<int>(0), new const_expr<int>(1)
+    };
+    bin_op_expr<int, int, int> direct = {
+        mult, "*", new const_expr<int>(0), new const_expr<int>(1)
+    };
+    assert(lookup.eval() == 1);
+    assert(lookup.memory_usage() >= direct.memory_usage() + sizeof(table));
+
+    // nodes shared in a DAG are counted once
+    expr_factory f;
+    auto two = f.constant(2);
+    auto sum = f.bin_op<int>(op::add, two, two);
+    assert(sum->memory_usage()
+           == sizeof(bin_op_expr<int, int, int>) + sizeof(const_expr<int>));
+
+    // variables' names are shared by the nodes for them; this one is too
+    // long to be stored in the std::string itself, so is on the heap
+    var_scope scope;
+    const std::string name = "a_variable_with_a_name_longer_than_a_string";
+    assert(name.size() >= sizeof(std::string));
+    var_expr<int>* a = scope.var<int>(name);
+    bin_op_expr<int, int, int> square = { op::mul, a, scope.var<int>(name) };
+    std::size_t var_size = sizeof(var_expr<int>);
+    assert(square.memory_usage() == sizeof(square) + 2 * var_size
+           + shared_block_bytes<std::string>() + a->name().capacity() + 1);
+
+    // cloning allocates through the node allocator, once per node
+    {
+        allocation_counter count;
+        std::unique_ptr<expr<std::string>> again{root.clone()};
+        assert(count.allocations() == 8);
+        assert(count.allocated_bytes() == nodes);
+        again.reset();
+        assert(count.frees() == 8);
+        assert(count.freed_bytes() == nodes);
+
+        // counters nest, each seeing the allocations made in its lifetime
+        allocation_counter inner;
+        delete new const_expr<int>(3);
+        assert(inner.allocations() == 1 && count.allocations() == 9);
+        assert(inner.frees() == 1 && count.frees() == 9);
+    }
+
+    // nodes made while counting can be freed afterward
+    expr<std::string>* later;
+    {
+        allocation_counter count;
+        later = root.clone();
+        assert(count.allocations() == 8);
+    }
+    assert(later->eval() == "correct");
+    delete later;
+}
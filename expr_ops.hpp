@@ -0,0 +1,203 @@
+#pragma once
+
+// built-in operators of the expression language
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+/// Crashes with an "unimplemented" error, syntactically returning
+/// a value of type N.
+template<typename N>
+N unimplemented() {
+    assert(!"unimplemented");
+}
+
+/// Opcodes of the built-in binary operators.
+/// `custom` marks an operator supplied as an arbitrary C++ function
+enum class op : unsigned char {
+    add, sub, mul, div, mod,
+    eq, ne, lt, le, gt, ge,
+    land, lor,
+    custom
+};
+
+/// The number of opcodes, including `custom`
+constexpr int n_ops = int(op::custom) + 1;
+
+/// The printed names of the operators, indexed by opcode
+constexpr const char* op_names[n_ops] = {
+    "+", "-", "*", "/", "%",
+    "==", "!=", "<", "<=", ">", ">=",
+    "&&", "||",
+    "<custom>"
+};
+
+/// The printed name of a built-in operator
+constexpr const char* op_name(op o) {
+    return op_names[int(o)];
+}
+
+/// Is this operator a comparison (returning bool regardless of its operands)?
+constexpr bool is_comparison(op o) {
+    return o >= op::eq && o <= op::ge;
+}
+
+/// Is this operator a boolean connective?
+constexpr bool is_logical(op o) {
+    return o == op::land || o == op::lor;
+}
+
+/// The C++ operator for each opcode, as a function object
+template<op O> struct op_fn;
+
+#define EXPR_OP_FN(code, sym) \
+    template<> struct op_fn<op::code> { \
+        template<typename A, typename B> \
+        constexpr auto operator() (const A& a, const B& b) const \
+            -> decltype(a sym b) { \
+            return a sym b; \
+        } \
+    };
+EXPR_OP_FN(add, +)
+EXPR_OP_FN(sub, -)
+EXPR_OP_FN(mul, *)
+EXPR_OP_FN(div, /)
+EXPR_OP_FN(mod, %)
+EXPR_OP_FN(eq, ==)
+EXPR_OP_FN(ne, !=)
+EXPR_OP_FN(lt, <)
+EXPR_OP_FN(le, <=)
+EXPR_OP_FN(gt, >)
+EXPR_OP_FN(ge, >=)
+EXPR_OP_FN(land, &&)
+EXPR_OP_FN(lor, ||)
+#undef EXPR_OP_FN
+
+namespace detail {
+
+template<op O, typename T, typename A, typename B>
+constexpr bool op_applies() {
+    using std::is_same_v;
+    if constexpr ( !std::is_invocable_v<op_fn<O>, const A&, const B&> ) {
+        return false;
+    } else if constexpr ( is_logical(O) ) {
+        return is_same_v<T, bool> && is_same_v<A, bool> && is_same_v<B, bool>;
+    } else if constexpr ( is_comparison(O) ) {
+        return is_same_v<T, bool> && std::is_convertible_v<
+            std::invoke_result_t<op_fn<O>, const A&, const B&>, bool>;
+    } else {
+        return is_same_v<T, A> && is_same_v<std::decay_t<
+            std::invoke_result_t<op_fn<O>, const A&, const B&>>, T>;
+    }
+}
+
+}
+
+/// Can built-in operator O be applied to an A & a B, producing a T? Only
+/// with the operator's own result type: && and || apply to bools alone,
+/// comparisons give bool, and arithmetic gives its left operand's type,
+/// with no conversion (so bool + bool, which C++ makes an int, does not)
+template<op O, typename T, typename A, typename B>
+constexpr bool op_applies = detail::op_applies<O, T, A, B>();
+
+/// Applies built-in operator O, if it is defined for these types
+template<op O, typename T, typename A, typename B>
+T apply_op(const A& a, const B& b) {
+    if constexpr ( op_applies<O, T, A, B> ) {
+        return op_fn<O>{}(a, b);
+    } else {
+        (void)a; (void)b;
+        return unimplemented<T>();
+    }
+}
+
+/// Applies the built-in operator o; the compiler can inline each case
+template<typename T, typename A, typename B>
+T apply_op(op o, const A& a, const B& b) {
+    switch ( o ) {
+    case op::add:  return apply_op<op::add, T>(a, b);
+    case op::sub:  return apply_op<op::sub, T>(a, b);
+    case op::mul:  return apply_op<op::mul, T>(a, b);
+    case op::div:  return apply_op<op::div, T>(a, b);
+    case op::mod:  return apply_op<op::mod, T>(a, b);
+    case op::eq:   return apply_op<op::eq, T>(a, b);
+    case op::ne:   return apply_op<op::ne, T>(a, b);
+    case op::lt:   return apply_op<op::lt, T>(a, b);
+    case op::le:   return apply_op<op::le, T>(a, b);
+    case op::gt:   return apply_op<op::gt, T>(a, b);
+    case op::ge:   return apply_op<op::ge, T>(a, b);
+    case op::land: return apply_op<op::land, T>(a, b);
+    case op::lor:  return apply_op<op::lor, T>(a, b);
+    case op::custom: break;
+    }
+    return unimplemented<T>();
+}
+
+/// Applies built-in operator O to n pairs of operands
+template<op O, typename T, typename A, typename B>
+void apply_op_n(const A* a, const B* b, std::size_t n, T* out) {
+    for (std::size_t i = 0; i < n; ++i) out[i] = apply_op<O, T>(a[i], b[i]);
+}
+
+/// Applies the built-in operator o to n pairs of operands, choosing the 
+/// operator once rather than once per pair
+template<typename T, typename A, typename B>
+void apply_op_n(op o, const A* a, const B* b, std::size_t n, T* out) {
+    switch ( o ) {
+    case op::add:  return apply_op_n<op::add>(a, b, n, out);
+    case op::sub:  return apply_op_n<op::sub>(a, b, n, out);
+    case op::mul:  return apply_op_n<op::mul>(a, b, n, out);
+    case op::div:  return apply_op_n<op::div>(a, b, n, out);
+    case op::mod:  return apply_op_n<op::mod>(a, b, n, out);
+    case op::eq:   return apply_op_n<op::eq>(a, b, n, out);
+    case op::ne:   return apply_op_n<op::ne>(a, b, n, out);
+    case op::lt:   return apply_op_n<op::lt>(a, b, n, out);
+    case op::le:   return apply_op_n<op::le>(a, b, n, out);
+    case op::gt:   return apply_op_n<op::gt>(a, b, n, out);
+    case op::ge:   return apply_op_n<op::ge>(a, b, n, out);
+    case op::land: return apply_op_n<op::land>(a, b, n, out);
+    case op::lor:  return apply_op_n<op::lor>(a, b, n, out);
+    case op::custom: break;
+    }
+    unimplemented<void>();
+}
+
+/// Is the built-in operator o defined for these types?
+template<typename T, typename A, typename B>
+constexpr bool op_supported(op o) {
+    constexpr bool table[n_ops] = {
+        op_applies<op::add, T, A, B>, op_applies<op::sub, T, A, B>,
+        op_applies<op::mul, T, A, B>, op_applies<op::div, T, A, B>,
+        op_applies<op::mod, T, A, B>,
+        op_applies<op::eq, T, A, B>, op_applies<op::ne, T, A, B>,
+        op_applies<op::lt, T, A, B>, op_applies<op::le, T, A, B>,
+        op_applies<op::gt, T, A, B>, op_applies<op::ge, T, A, B>,
+        op_applies<op::land, T, A, B>, op_applies<op::lor, T, A, B>,
+        false
+    };
+    return table[int(o)];
+}
+
+/// The built-in operators the compiled engines implement directly on cells,
+/// as X(instruction, opcode, operand field, result field, C++ operator).
+/// Fields are those of `cell`: b for bool, i for int, d for double
+#define EXPR_CELL_OPS(X) \
+    X(add_i, add, i, i, +)  X(sub_i, sub, i, i, -)  X(mul_i, mul, i, i, *) \
+    X(div_i, div, i, i, /)  X(mod_i, mod, i, i, %) \
+    X(eq_i, eq, i, b, ==)   X(ne_i, ne, i, b, !=)   X(lt_i, lt, i, b, <) \
+    X(le_i, le, i, b, <=)   X(gt_i, gt, i, b, >)    X(ge_i, ge, i, b, >=) \
+    X(add_d, add, d, d, +)  X(sub_d, sub, d, d, -)  X(mul_d, mul, d, d, *) \
+    X(div_d, div, d, d, /) \
+    X(eq_d, eq, d, b, ==)   X(ne_d, ne, d, b, !=)   X(lt_d, lt, d, b, <) \
+    X(le_d, le, d, b, <=)   X(gt_d, gt, d, b, >)    X(ge_d, ge, d, b, >=) \
+    X(eq_b, eq, b, b, ==)   X(ne_b, ne, b, b, !=) \
+    X(and_b, land, b, b, &&) X(or_b, lor, b, b, ||)
+
+/// The instructions listed in EXPR_CELL_OPS, in order
+enum class cell_instr : unsigned char {
+#define EXPR_CELL_INSTR(name, code, arg, res, sym) name,
+    EXPR_CELL_OPS(EXPR_CELL_INSTR)
+#undef EXPR_CELL_INSTR
+};
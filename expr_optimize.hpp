@@ -0,0 +1,154 @@
+#pragma once
+
+// constant folding & algebraic simplification for the expression language
+
+#include "expr.hpp"
+
+#include <cstddef>
+#include <memory>
+
+/// Counts the nodes of a tree
+inline std::size_t count_nodes(const expr_node& e) {
+    std::size_t n = 1;
+    for (std::size_t i = 0; i < e.arity(); ++i) n += count_nodes(e.operand(i));
+    return n;
+}
+
+/// Can the tree be dropped without changing what evaluating it does? Not
+/// if it has custom operators, which may have side effects (so the
+/// optimizer never runs or discards them), or integer division, which may
+/// trap
+inline bool can_discard(const expr_node& e) {
+    if ( e.kind() == node_kind::bin_op ) {
+        op o = e.opcode();
+        if ( o == op::custom ) return false;
+        bool division = o == op::div || o == op::mod;
+        if ( division && e.operand(0).result_kind() == value_kind::integer ) {
+            return false;
+        }
+    }
+    for (std::size_t i = 0; i < e.arity(); ++i) {
+        if ( !can_discard(e.operand(i)) ) return false;
+    }
+    return true;
+}
+
+/// Is e a constant int or double equal to n?
+inline bool is_constant_number(const expr_node& e, int n) {
+    if ( e.kind() != node_kind::constant ) return false;
+    value_pool unused;
+    switch ( e.result_kind() ) {
+    case value_kind::integer: return e.value(unused).i == n;
+    case value_kind::real: return e.value(unused).d == n;
+    default: return false;
+    }
+}
+
+/// Could applying built-in binary node e to constant operands l & r fail
+/// at runtime (integer division by zero or overflow)?
+inline bool may_trap(const expr_node& e, const expr_node& l,
+                     const expr_node& r) {
+    if ( e.opcode() != op::div && e.opcode() != op::mod ) return false;
+    if ( r.result_kind() != value_kind::integer ) return false;
+    value_pool unused;
+    int d = r.value(unused).i;
+    return d == 0 || (d == -1 && l.value(unused).i == -2147483647 - 1);
+}
+
+/// Applies the identities of the built-in operator of binary node e,
+/// whose optimized operands are l & r. Returns the simplified node,
+/// releasing the operands it uses, or nullptr if no identity applies
+inline expr_node* simplify_identity(const expr_node& e,
+                                    std::unique_ptr<expr_node>& l,
+                                    std::unique_ptr<expr_node>& r) {
+    value_kind k = e.result_kind();
+    // identities only hold exactly on operands of the result type, and for
+    // doubles only x * 1 does (x + 0 changes -0.0, x * 0 changes NaN & inf)
+    if ( k != value_kind::integer && k != value_kind::real ) return nullptr;
+    if ( l->result_kind() != k || r->result_kind() != k ) return nullptr;
+    bool ints = k == value_kind::integer;
+
+    switch ( e.opcode() ) {
+    case op::mul:
+        if ( is_constant_number(*r, 1) ) return l.release();
+        if ( is_constant_number(*l, 1) ) return r.release();
+        if ( ints && is_constant_number(*r, 0) && can_discard(*l) ) {
+            return r.release();
+        }
+        if ( ints && is_constant_number(*l, 0) && can_discard(*r) ) {
+            return l.release();
+        }
+        break;
+    case op::add:
+        if ( ints && is_constant_number(*r, 0) ) return l.release();
+        if ( ints && is_constant_number(*l, 0) ) return r.release();
+        break;
+    case op::sub:
+        if ( ints && is_constant_number(*r, 0) ) return l.release();
+        break;
+    case op::div:
+        if ( is_constant_number(*r, 1) ) return l.release();
+        break;
+    default:
+        break;
+    }
+    return nullptr;
+}
+
+/// Returns an optimized copy of e, which should be deleted by the caller
+inline expr_node* optimize_node(const expr_node& e) {
+    switch ( e.kind() ) {
+    case node_kind::constant:
+    case node_kind::var:
+        return e.rebuild(nullptr);
+
+    case node_kind::cond: {
+        std::unique_ptr<expr_node> c{optimize_node(e.operand(0))};
+        if ( c->kind() == node_kind::constant ) {
+            value_pool unused;
+            return optimize_node(e.operand(c->value(unused).b ? 1 : 2));
+        }
+        std::unique_ptr<expr_node> t{optimize_node(e.operand(1))};
+        std::unique_ptr<expr_node> f{optimize_node(e.operand(2))};
+        expr_node* ops[] = { c.release(), t.release(), f.release() };
+        return e.rebuild(ops);
+    }
+
+    case node_kind::bin_op: {
+        std::unique_ptr<expr_node> l{optimize_node(e.operand(0))};
+        if ( is_short_circuit(e) && l->kind() == node_kind::constant ) {
+            // true && x = x, false && x = false, true || x = true,
+            // false || x = x
+            value_pool unused;
+            bool decides = l->value(unused).b == (e.opcode() == op::lor);
+            return decides ? l.release() : optimize_node(e.operand(1));
+        }
+        std::unique_ptr<expr_node> r{optimize_node(e.operand(1))};
+        if ( e.opcode() == op::custom ) {
+            expr_node* ops[] = { l.release(), r.release() };
+            return e.rebuild(ops);
+        }
+        if ( l->kind() == node_kind::constant
+                && r->kind() == node_kind::constant && !may_trap(e, *l, *r) ) {
+            expr_node* ops[] = { l.release(), r.release() };
+            std::unique_ptr<expr_node> n{e.rebuild(ops)};
+            value_pool pool;
+            return n->make_constant(n->eval_cell(pool));
+        }
+        if ( expr_node* s = simplify_identity(e, l, r) ) return s;
+        expr_node* ops[] = { l.release(), r.release() };
+        return e.rebuild(ops);
+    }
+    }
+    return unimplemented<expr_node*>();
+}
+
+/// Returns an optimized copy of e, with constant subtrees folded and
+/// algebraic identities applied; it should be deleted by the caller.
+/// If `removed` is given, it is set to the number of nodes eliminated
+template<typename T>
+expr<T>* optimize(const expr<T>& e, std::size_t* removed = nullptr) {
+    auto o = static_cast<expr<T>*>(optimize_node(e));
+    if ( removed ) *removed = count_nodes(e) - count_nodes(*o);
+    return o;
+}
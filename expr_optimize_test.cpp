@@ -0,0 +1,117 @@
+#include "expr_optimize.hpp"
+#include "expr_test_samples.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+/// wrapper function for multiplication, counting its calls
+int calls = 0;
+int mult(int a, int b) { ++calls; return a * b; }
+
+/// optimizes e, checking that the result agrees with the original & has
+/// `expected` nodes
+template<typename T>
+void check(const expr<T>& e, std::size_t expected) {
+    std::size_t removed;
+    int before = calls;
+    std::unique_ptr<expr<T>> o{optimize(e, &removed)};
+    assert(calls == before);
+    std::cout << e << "\n => " << *o << " (" << removed << " removed)"
+              << std::endl;
+    assert(o->eval() == e.eval());
+    assert(count_nodes(*o) == expected);
+    assert(count_nodes(e) - removed == expected);
+}
+
+int main() {
+    // optimized trees agree with the originals
+    samples::for_each([](const auto& e, const env& vars) {
+        using T = std::decay_t<decltype(e.eval())>;
+        std::unique_ptr<expr<T>> o{optimize<T>(e)};
+        assert(o->eval(vars) == e.eval(vars));
+    });
+
+    // (2 + 2) == 4 collapses to a single constant, and so does the 
+    // conditional it guards
+    auto two = new const_expr<int>(2);
+    auto cond = new bin_op_expr<bool, int, int>(
+        op::eq,
+        new bin_op_expr<int, int, int>(op::add, two, two->clone()),
+        new const_expr<int>(4)
+    );
+    check(*cond, 1);
+    if_expr<std::string> root = {
+        cond,
+        new const_expr<std::string>("correct"),
+        new const_expr<std::string>("incorrect")
+    };
+    check(root, 1);
+
+    // identities keep the non-constant operand, which here is a custom 
+    // operator the optimizer won't run
+    auto product = new bin_op_expr<int, int, int>(
+        mult, "*", new const_expr<int>(8), new const_expr<int>(5));
+    bin_op_expr<int, int, int> identities = {
+        op::add,
+        new bin_op_expr<int, int, int>(
+            op::mul, new const_expr<int>(1), product),
+        new bin_op_expr<int, int, int>(
+            op::sub, new const_expr<int>(3), new const_expr<int>(3))
+    };
+    check(identities, 3);
+
+    // x * 0 only drops x if it has no custom operators, and the optimizer 
+    // never runs them
+    bin_op_expr<int, int, int> times_zero = {
+        op::mul, product->clone(), new const_expr<int>(0)
+    };
+    check(times_zero, 5);
+    bin_op_expr<int, int, int> pure_zero = {
+        op::mul,
+        new bin_op_expr<int, int, int>(
+            op::add, product->clone(), new const_expr<int>(1)),
+        new bin_op_expr<int, int, int>(
+            op::sub, new const_expr<int>(7), new const_expr<int>(7))
+    };
+    check(pure_zero, 7);
+
+    // nor if it divides integers, as dividing by zero must still trap
+    var_scope scope;
+    bin_op_expr<int, int, int> quotient_zero = {
+        op::mul,
+        new bin_op_expr<int, int, int>(
+            op::div, scope.var<int>("a"), scope.var<int>("b")),
+        new const_expr<int>(0)
+    };
+    std::size_t removed;
+    std::unique_ptr<expr<int>> not_folded{optimize(quotient_zero, &removed)};
+    assert(removed == 0 && not_folded->equals(quotient_zero));
+
+    // constant conditions & connectives select their branch, and division 
+    // by zero is left for runtime
+    auto zero = new const_expr<int>(0);
+    if_expr<int> guarded = {
+        new and_expr(
+            new bin_op_expr<bool, int, int>(op::ne, zero, zero->clone()),
+            new bin_op_expr<bool, int, int>(
+                op::gt,
+                new bin_op_expr<int, int, int>(
+                    op::div, new const_expr<int>(10), zero->clone()),
+                new const_expr<int>(1)
+            )
+        ),
+        new bin_op_expr<int, int, int>(
+            op::div, new const_expr<int>(10), zero->clone()),
+        new const_expr<int>(-1)
+    };
+    check(guarded, 1);
+
+    bin_op_expr<int, int, int> trap = {
+        op::div, new const_expr<int>(10), new const_expr<int>(0)
+    };
+    std::unique_ptr<expr<int>> kept{optimize(trap)};
+    assert(count_nodes(*kept) == 3);
+}
@@ -0,0 +1,335 @@
+#pragma once
+
+// evaluating the independent subtrees of expensive trees concurrently
+
+#include "expr.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+/// A fixed set of worker threads running tasks. Each worker has a queue of
+/// its own, which it takes the newest task from; when that is empty, it
+/// steals the oldest task from another queue. Tasks submitted from outside
+/// the pool go on a queue shared by the submitting threads.
+///
+/// Threads waiting for a task run other tasks meanwhile, so tasks may
+/// submit & wait for tasks of their own without deadlock
+class work_pool {
+public:
+    /// A call of fn(arg) to run on some thread. Tasks are owned by their
+    /// submitter, and must live until wait() returns
+    class task {
+        friend class work_pool;
+
+        void (*fn)(void*);
+        void* arg;
+        std::exception_ptr error;
+        std::atomic<bool> done{false};
+
+        void run() {
+            try {
+                fn(arg);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            done.store(true, std::memory_order_release);
+        }
+
+    public:
+        task(void (*fn)(void*), void* arg) : fn(fn), arg(arg) {}
+
+        task(const task&) = delete;
+        task& operator= (const task&) = delete;
+    };
+
+private:
+    struct queue {
+        std::mutex lock;
+        std::deque<task*> tasks;
+    };
+
+    /// A queue per worker, and last, the shared queue
+    std::vector<std::unique_ptr<queue>> queues;
+    std::vector<std::thread> threads;
+    /// The number of tasks on the queues
+    std::atomic<std::size_t> queued{0};
+    /// Idle workers wait on `wake`
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    /// The pool whose worker this thread is, if any, & its queue
+    inline static thread_local const work_pool* current = nullptr;
+    inline static thread_local std::size_t current_queue = 0;
+
+    /// this thread's queue
+    std::size_t own_queue() const {
+        return current == this ? current_queue : queues.size() - 1;
+    }
+
+    /// takes a task, from queue q if it can & by stealing otherwise; null
+    /// if there are none
+    task* take(std::size_t q) {
+        if ( queued.load(std::memory_order_relaxed) == 0 ) return nullptr;
+        for (std::size_t i = 0; i < queues.size(); ++i) {
+            queue& from = *queues[(q + i) % queues.size()];
+            std::lock_guard<std::mutex> l(from.lock);
+            if ( from.tasks.empty() ) continue;
+            task* t;
+            if ( i == 0 ) {
+                t = from.tasks.back();
+                from.tasks.pop_back();
+            } else {
+                t = from.tasks.front();
+                from.tasks.pop_front();
+            }
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return t;
+        }
+        return nullptr;
+    }
+
+    void work(std::size_t q) {
+        current = this;
+        current_queue = q;
+        for (;;) {
+            if ( task* t = take(q) ) {
+                t->run();
+                continue;
+            }
+            std::unique_lock<std::mutex> l(sleep_lock);
+            wake.wait(l, [&]{ return stopping || queued.load() > 0; });
+            if ( stopping && queued.load() == 0 ) return;
+        }
+    }
+
+public:
+    /// starts n worker threads, by default one per hardware thread
+    explicit work_pool(std::size_t n = default_threads()) {
+        n = std::max<std::size_t>(n, 1);
+        for (std::size_t i = 0; i <= n; ++i) queues.emplace_back(new queue);
+        threads.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            threads.emplace_back([this, i]{ work(i); });
+        }
+    }
+
+    work_pool(const work_pool&) = delete;
+    work_pool& operator= (const work_pool&) = delete;
+
+    /// finishes the tasks submitted & stops the workers
+    ~work_pool() {
+        {
+            std::lock_guard<std::mutex> l(sleep_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : threads) t.join();
+    }
+
+    /// the number of hardware threads, or 1 if that is unknown
+    static std::size_t default_threads() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    /// the number of worker threads
+    std::size_t size() const { return threads.size(); }
+
+    /// queues t to be run by some thread
+    void submit(task& t) {
+        queue& q = *queues[own_queue()];
+        {
+            std::lock_guard<std::mutex> l(q.lock);
+            q.tasks.push_back(&t);
+        }
+        queued.fetch_add(1);
+        // taking the lock orders this with a worker about to wait
+        { std::lock_guard<std::mutex> l(sleep_lock); }
+        wake.notify_one();
+    }
+
+    /// waits for t to have run, running other tasks meanwhile, & rethrows
+    /// any exception it threw
+    void wait(task& t) {
+        join(t);
+        if ( t.error ) std::rethrow_exception(t.error);
+    }
+
+    /// waits for t to have run, running other tasks meanwhile
+    void join(task& t) {
+        std::size_t q = own_queue();
+        while ( !t.done.load(std::memory_order_acquire) ) {
+            if ( task* other = take(q) ) other->run();
+            else std::this_thread::yield();
+        }
+    }
+
+    /// calls a(a_arg) as a task & b(b_arg) on this thread, returning once
+    /// both have returned. An exception thrown by either is rethrown
+    void run_both(void (*a)(void*), void* a_arg, void (*b)(void*), void* b_arg) {
+        task t(a, a_arg);
+        submit(t);
+        try {
+            b(b_arg);
+        } catch (...) {
+            join(t);
+            throw;
+        }
+        wait(t);
+    }
+
+    /// calls a() as a task & b() on this thread, as run_both() does
+    template<typename A, typename B>
+    void both(A&& a, B&& b) {
+        run_both(&call<A>, &a, &call<B>, &b);
+    }
+
+private:
+    template<typename F>
+    static void call(void* f) {
+        (*static_cast<std::remove_reference_t<F>*>(f))();
+    }
+};
+
+/// The cost of evaluating node e itself, not counting its operands, as
+/// parallel_plan estimates it by default: 1 for built-in operators and
+/// the leaves, and more for custom operators, which call arbitrary code
+inline double default_node_cost(const expr_node& e) {
+    bool custom = e.kind() == node_kind::bin_op && e.opcode() == op::custom;
+    return custom ? 50 : 1;
+}
+
+/// How parallel_plan divides a tree
+struct parallel_options {
+    /// Subtrees cheaper than this are evaluated sequentially, so each task
+    /// is at least this costly; in the units of node_cost. The default is
+    /// a few microseconds' work, well above the cost of a task
+    double threshold = 1000;
+    /// The cost of evaluating a node, not counting its operands
+    std::function<double(const expr_node&)> node_cost = default_node_cost;
+};
+
+/// A plan for evaluating a tree with eval_parallel(): binary operators both
+/// of whose operands cost at least the threshold evaluate them
+/// concurrently, on the threads of a work_pool. The plan is made once for
+/// a tree, which it borrows, & may be evaluated any number of times, from
+/// any number of threads.
+///
+/// && and || never evaluate their operands concurrently, as the right
+/// operand is only evaluated if the left one does not decide the result;
+/// nor do conditionals. Their operands may, though
+template<typename T>
+class parallel_plan : public parallel_eval {
+    const expr<T>& root;
+    work_pool& pool;
+    /// The mode of each node evaluated in parallel; nodes not here are
+    /// evaluated sequentially
+    std::unordered_map<const expr_node*, mode> modes;
+
+    /// plans e & its operands, returning e's cost
+    double plan(const expr_node& e, const parallel_options& o) {
+        double cost = o.node_cost(e);
+        double operand_costs[3] = {};
+        for (std::size_t i = 0; i < e.arity(); ++i) {
+            operand_costs[i] = plan(e.operand(i), o);
+            cost += operand_costs[i];
+        }
+        if ( cost < o.threshold ) return cost;
+        bool forks = e.kind() == node_kind::bin_op && !is_logical(e.opcode())
+            && std::min(operand_costs[0], operand_costs[1]) >= o.threshold;
+        modes[&e] = forks ? fork : descend;
+        return cost;
+    }
+
+    void run_both(task_fn a, void* a_arg, task_fn b, void* b_arg) const override {
+        pool.run_both(a, a_arg, b, b_arg);
+    }
+
+public:
+    /// plans e, which must outlive the plan, to run on the threads of pool
+    parallel_plan(const expr<T>& e, work_pool& pool,
+                  const parallel_options& o = parallel_options())
+    : root(e), pool(pool) {
+        plan(e, o);
+    }
+
+    mode at(const expr_node& e) const override {
+        auto it = modes.find(&e);
+        return it == modes.end() ? sequential : it->second;
+    }
+
+    /// the number of nodes that evaluate their operands concurrently
+    std::size_t forks() const {
+        return std::count_if(modes.begin(), modes.end(),
+                             [](const auto& m) { return m.second == fork; });
+    }
+
+    /// evaluates the tree, giving the same value as eval(vars)
+    T eval(const env& vars = env()) const {
+        return root.eval_parallel(vars, *this);
+    }
+};
+
+/// evaluates e as e.eval(vars) does, evaluating independent subtrees that
+/// cost more than o.threshold concurrently, on the threads of pool. Plans
+/// the tree on each call; make a parallel_plan to evaluate it repeatedly
+template<typename T>
+T eval_parallel(const expr<T>& e, work_pool& pool, const env& vars = env(),
+                const parallel_options& o = parallel_options()) {
+    return parallel_plan<T>(e, pool, o).eval(vars);
+}
+
+/// The size of the cache lines eval_all() keeps tasks' results apart by
+constexpr std::size_t cache_line_bytes = 64;
+
+namespace detail {
+
+/// evaluates trees[0, n) into out[0, n), splitting the range in two to run
+/// concurrently until the pieces are at most `grain` long. Splits fall on
+/// cache line boundaries of out, so no two tasks write to one line
+template<typename T>
+void eval_range(const expr<T>* const* trees, std::size_t n, const env& vars,
+                T* out, work_pool& pool, std::size_t grain) {
+    if ( n <= grain ) {
+        for (std::size_t i = 0; i < n; ++i) out[i] = trees[i]->eval(vars);
+        return;
+    }
+    // split at the first result starting at or after the first line
+    // boundary at or after the middle; as n > grain, which is several lines
+    // long, both halves are nonempty
+    auto start = reinterpret_cast<std::uintptr_t>(out);
+    auto mid = start + n / 2 * sizeof(T);
+    mid = (mid + cache_line_bytes - 1) / cache_line_bytes * cache_line_bytes;
+    std::size_t half = (mid - start + sizeof(T) - 1) / sizeof(T);
+    pool.both(
+        [&]{ eval_range(trees, half, vars, out, pool, grain); },
+        [&]{ eval_range(trees + half, n - half, vars, out + half, pool, grain); });
+}
+
+}
+
+/// evaluates the n trees, storing trees[i]->eval(vars) in out[i], on the
+/// threads of pool. The trees are split into contiguous runs of at least
+/// `grain` trees, by default enough for 8 runs per thread, whose results
+/// are whole cache lines of out. If a tree throws, the exception is
+/// rethrown once the other runs have finished, & out is partly filled
+template<typename T>
+void eval_all(const expr<T>* const* trees, std::size_t n, const env& vars,
+              T* out, work_pool& pool, std::size_t grain = 0) {
+    std::size_t line = std::max<std::size_t>(cache_line_bytes / sizeof(T), 1);
+    if ( grain == 0 ) grain = n / (8 * pool.size());
+    grain = std::max(grain, 4 * line);
+    detail::eval_range(trees, n, vars, out, pool, grain);
+}
@@ -0,0 +1,182 @@
+#include "expr_parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// The threads custom operators have run on
+std::mutex seen_lock;
+std::set<std::thread::id> seen;
+
+/// The number of calls of `meet` running
+std::atomic<int> meeting{0};
+
+/// a costly operator
+int slow_add(int a, int b) {
+    {
+        std::lock_guard<std::mutex> l(seen_lock);
+        seen.insert(std::this_thread::get_id());
+    }
+    volatile int spin = 0;
+    for (int i = 0; i < 1000; ++i) spin = spin + i;
+    return a + b;
+}
+
+/// returns a + b once another call of it is running at the same time, or
+/// -1 if none starts within a few seconds
+int meet(int a, int b) {
+    ++meeting;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while ( meeting.load() < 2 ) {
+        if ( std::chrono::steady_clock::now() > deadline ) return -1;
+        std::this_thread::yield();
+    }
+    return a + b;
+}
+
+int fail(int, int) { throw std::runtime_error("failed"); }
+
+/// The variables of the tests' trees
+var_scope scope;
+
+/// a balanced tree of slow_adds over the variable x, 2^depth wide
+expr<int>* wide(int depth) {
+    if ( depth == 0 ) return scope.var<int>("x");
+    return new bin_op_expr<int, int, int>(slow_add, "slow_add", wide(depth - 1),
+                                          wide(depth - 1));
+}
+
+int main() {
+    work_pool pool(4);
+    assert(pool.size() == 4);
+    scope.declare<int>("x");
+    env vars = scope.make_env();
+    vars.set(scope.slot("x"), 3);
+
+    // expensive trees fork where both operands cost over the threshold:
+    // a subtree of depth d costs 51 * 2^d - 50, so the top 4 levels do
+    std::unique_ptr<expr<int>> e{wide(8)};
+    parallel_options o;
+    o.threshold = 500;
+    parallel_plan<int> plan(*e, pool, o);
+    assert(plan.forks() == 15);
+    assert(plan.eval(vars) == e->eval(vars));
+    assert(eval_parallel(*e, pool, vars, o) == 3 * 256);
+
+    // operands really are evaluated concurrently
+    bin_op_expr<int, int, int> pair = {
+        [](int a, int b) { return a * b; }, "times",
+        new bin_op_expr<int, int, int>(meet, "meet", new const_expr<int>(1),
+                                       new const_expr<int>(2)),
+        new bin_op_expr<int, int, int>(meet, "meet", new const_expr<int>(3),
+                                       new const_expr<int>(4))
+    };
+    parallel_options cheap;
+    cheap.threshold = 10;
+    parallel_plan<int> pair_plan(pair, pool, cheap);
+    assert(pair_plan.forks() == 1);
+    assert(pair_plan.eval() == 21);
+
+    // cheap trees stay on the calling thread
+    seen.clear();
+    std::unique_ptr<expr<int>> small{wide(3)};
+    assert(eval_parallel(*small, pool, vars) == 24);
+    assert(seen.size() == 1 && *seen.begin() == std::this_thread::get_id());
+
+    // && and conditionals evaluate only the operands eval() would
+    if_expr<int> choice = {
+        new and_expr(new const_expr<bool>(false),
+                     new bin_op_expr<bool, int, int>(
+                         fail, "fail", wide(4), wide(4))),
+        new bin_op_expr<int, int, int>(fail, "fail", wide(4), wide(4)),
+        wide(6)
+    };
+    parallel_plan<int> choice_plan(choice, pool, o);
+    assert(choice_plan.eval(vars) == 3 * 64);
+
+    // exceptions reach the caller, from either side of a fork
+    for (int side = 0; side < 2; ++side) {
+        bin_op_expr<int, int, int> throws = {
+            slow_add, "slow_add",
+            side ? wide(5) : new bin_op_expr<int, int, int>(
+                fail, "fail", wide(4), wide(4)),
+            side ? new bin_op_expr<int, int, int>(
+                fail, "fail", wide(4), wide(4)) : wide(5)
+        };
+        try {
+            eval_parallel(throws, pool, vars, o);
+            assert(!"expected an exception");
+        } catch (const std::runtime_error& ex) {
+            assert(std::string(ex.what()) == "failed");
+        }
+    }
+
+    // one plan may be evaluated from many threads at once
+    std::vector<std::thread> callers;
+    std::atomic<int> wrong{0};
+    for (int i = 0; i < 4; ++i) {
+        callers.emplace_back([&]{
+            for (int j = 0; j < 20; ++j) {
+                if ( plan.eval(vars) != 3 * 256 ) ++wrong;
+            }
+        });
+    }
+    for (std::thread& t : callers) t.join();
+    assert(wrong == 0);
+
+    // eval_all() evaluates every tree into its own result, whatever the
+    // grain & however the results are aligned
+    std::vector<std::unique_ptr<expr<int>>> many;
+    std::vector<const expr<int>*> ptrs;
+    for (int i = 0; i < 1000; ++i) {
+        many.emplace_back(new bin_op_expr<int, int, int>(
+            op::mul, scope.var<int>("x"), new const_expr<int>(i)));
+        ptrs.push_back(many.back().get());
+    }
+    std::vector<int> results(1001);
+    for (std::size_t grain : {0, 1, 7, 100, 5000}) {
+        for (int* out : {results.data(), results.data() + 1}) {
+            std::fill(results.begin(), results.end(), -1);
+            eval_all(ptrs.data(), ptrs.size(), vars, out, pool, grain);
+            for (int i = 0; i < 1000; ++i) assert(out[i] == 3 * i);
+        }
+    }
+    std::vector<std::string> names(3);
+    std::unique_ptr<expr<std::string>> name{new const_expr<std::string>("x")};
+    std::vector<const expr<std::string>*> name_ptrs(3, name.get());
+    eval_all(name_ptrs.data(), 3, vars, names.data(), pool);
+    assert(names == std::vector<std::string>(3, "x"));
+    eval_all(ptrs.data(), 0, vars, results.data(), pool);
+
+    // the runs are spread over the pool's threads
+    seen.clear();
+    std::vector<std::unique_ptr<expr<int>>> slow;
+    std::vector<const expr<int>*> slow_ptrs;
+    for (int i = 0; i < 256; ++i) {
+        slow.emplace_back(new bin_op_expr<int, int, int>(
+            slow_add, "slow_add", scope.var<int>("x"), new const_expr<int>(i)));
+        slow_ptrs.push_back(slow.back().get());
+    }
+    eval_all(slow_ptrs.data(), 256, vars, results.data(), pool, 16);
+    for (int i = 0; i < 256; ++i) assert(results[i] == 3 + i);
+    assert(seen.size() > 1);
+
+    // an exception from any tree reaches the caller
+    slow[200].reset(new bin_op_expr<int, int, int>(
+        fail, "fail", new const_expr<int>(0), new const_expr<int>(0)));
+    slow_ptrs[200] = slow[200].get();
+    try {
+        eval_all(slow_ptrs.data(), 256, vars, results.data(), pool, 16);
+        assert(!"expected an exception");
+    } catch (const std::runtime_error& ex) {
+        assert(std::string(ex.what()) == "failed");
+    }
+}
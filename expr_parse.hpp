@@ -0,0 +1,448 @@
+#pragma once
+
+// parsing expressions from infix text
+
+#include "expr.hpp"
+#include "expr_registry.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+/// An error in the text given to expr_parser, at a position in it
+class parse_error : public std::runtime_error {
+public:
+    /// The offset of the error in the text
+    std::size_t offset;
+    /// The line & column of the error, counting from 1
+    std::size_t line;
+    std::size_t column;
+
+    parse_error(const std::string& what, std::size_t offset, std::size_t line,
+                std::size_t column)
+    : std::runtime_error(std::to_string(line) + ":" + std::to_string(column)
+                         + ": " + what),
+      offset(offset), line(line), column(column) {}
+};
+
+/// Parses expressions written in the notation print() uses, e.g.
+///
+///     if (2 + 2 == 4) "correct" else "incorrect"
+///
+/// in a single pass, with no separate tokenizing, building each node as
+/// soon as its operands are parsed. Printed trees parse back to trees
+/// which evaluate alike, as print() parenthesizes every operator &
+/// conditional and prints constants as they are written here. The
+/// language has
+/// - constants: `true`, `false`, ints (`42`, `-7`), doubles (`1.5`, `2e3`)
+///   and strings (`"text"`, with the escapes \" \\ \n & \t)
+/// - variables, which must be declared in the parser's var_scope
+/// - the built-in operators, as in C: `* / %` bind tightest, then `+ -`,
+///   `< <= > >=`, `== !=`, `&&` and `||`
+/// - custom operators, written infix by name (`8 mult 5`), which must be
+///   defined in the parser's op_registry
+/// - conditionals, `if <cond> <then> else <else>`, where the condition is a
+///   constant, variable or parenthesized expression
+///
+/// Operands are type checked: both operands of a built-in operator have
+/// the same type, arithmetic is on ints, doubles or (for +) strings, and
+/// the parsed expression must have the type asked for. Errors are thrown
+/// as parse_errors giving their position
+class expr_parser {
+    using type_desc = op_registry::type_desc;
+    using op_desc = op_registry::op_desc;
+
+    /// A parsed subexpression
+    struct parsed {
+        std::unique_ptr<expr_node> node;
+        const type_desc* type;
+        /// Its offset in the text
+        std::size_t at;
+    };
+
+    /// The types & custom operators
+    const op_registry& ops;
+    /// The variables
+    var_scope* scope;
+
+    /// The state of one parse
+    class cursor;
+
+public:
+    /// Nesting deeper than this is an error, rather than overflowing the
+    /// stack
+    static constexpr std::size_t max_depth = 1000;
+
+    /// makes a parser for the types & custom operators of r, resolving
+    /// variables in s, if given; r must outlive the parser
+    explicit expr_parser(const op_registry& r, var_scope* s = nullptr)
+    : ops(r), scope(s) {}
+
+    /// makes a parser for the built-in types & operators, resolving
+    /// variables in s, if given
+    explicit expr_parser(var_scope* s = nullptr)
+    : expr_parser(op_registry::builtins(), s) {}
+
+    /// parses text as a single expression of type T; the tree should be
+    /// deleted by the caller. Throws a parse_error if text is not one
+    template<typename T>
+    expr<T>* parse(std::string_view text) const;
+
+    /// parses text as a list of expressions of type T, each followed by a
+    /// `;`. Throws a parse_error if text is not one
+    template<typename T>
+    std::vector<std::unique_ptr<expr<T>>> parse_list(std::string_view text) const;
+};
+
+class expr_parser::cursor {
+    const expr_parser& p;
+    std::string_view text;
+    std::size_t pos = 0;
+    std::size_t depth = 0;
+
+    [[noreturn]] void fail(const std::string& what, std::size_t at) const {
+        std::size_t line = 1, column = 1;
+        for (std::size_t i = 0; i < at && i < text.size(); ++i) {
+            if ( text[i] == '\n' ) {
+                ++line;
+                column = 1;
+            } else {
+                ++column;
+            }
+        }
+        throw parse_error(what, at, line, column);
+    }
+
+    static bool ident_start(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    static bool ident_char(char c) {
+        return ident_start(c) || (c >= '0' && c <= '9');
+    }
+
+    static bool digit(char c) { return c >= '0' && c <= '9'; }
+
+    void skip_space() {
+        while ( pos < text.size() ) {
+            char c = text[pos];
+            if ( c == ' ' || c == '\t' || c == '\n' || c == '\r' ) {
+                ++pos;
+            } else if ( c == '/' && pos + 1 < text.size() && text[pos + 1] == '/' ) {
+                // comments run to the end of the line
+                while ( pos < text.size() && text[pos] != '\n' ) ++pos;
+            } else {
+                break;
+            }
+        }
+    }
+
+    /// the identifier at pos, if any, without consuming it
+    std::string_view peek_ident() const {
+        if ( pos >= text.size() || !ident_start(text[pos]) ) return {};
+        std::size_t end = pos + 1;
+        while ( end < text.size() && ident_char(text[end]) ) ++end;
+        return text.substr(pos, end - pos);
+    }
+
+    /// consumes the keyword or symbol s if it is next
+    bool accept(std::string_view s) {
+        skip_space();
+        if ( text.substr(pos, s.size()) != s ) return false;
+        if ( ident_start(s[0]) && pos + s.size() < text.size()
+             && ident_char(text[pos + s.size()]) ) {
+            return false;
+        }
+        pos += s.size();
+        return true;
+    }
+
+    void expect(std::string_view s) {
+        if ( !accept(s) ) fail("expected '" + std::string(s) + "'", pos);
+    }
+
+    /// A binary operator
+    struct binary {
+        op code;
+        /// The custom operator, if code is `custom`
+        const op_desc* custom;
+        int precedence;
+        std::size_t length;
+    };
+
+    /// the binary operator at pos, if any, without consuming it
+    bool peek_binary(binary& b) {
+        skip_space();
+        if ( pos >= text.size() ) return false;
+        std::string_view ident = peek_ident();
+        if ( !ident.empty() ) {
+            const op_desc* d = p.ops.find_op(ident);
+            if ( !d ) return false;
+            b = binary{op::custom, d, d->precedence, ident.size()};
+            return true;
+        }
+        static const struct { const char* sym; op code; int precedence; }
+        table[] = {
+            // two-character operators first, so they win over their prefixes
+            {"==", op::eq, 3}, {"!=", op::ne, 3}, {"<=", op::le, 4},
+            {">=", op::ge, 4}, {"&&", op::land, 2}, {"||", op::lor, 1},
+            {"<", op::lt, 4}, {">", op::gt, 4}, {"+", op::add, 5},
+            {"-", op::sub, 5}, {"*", op::mul, 6}, {"/", op::div, 6},
+            {"%", op::mod, 6}
+        };
+        for (const auto& t : table) {
+            std::string_view sym = t.sym;
+            if ( text.substr(pos, sym.size()) == sym ) {
+                b = binary{t.code, nullptr, t.precedence, sym.size()};
+                return true;
+            }
+        }
+        return false;
+    }
+
+    parsed combine(const binary& b, parsed l, parsed r, std::size_t at) {
+        if ( b.custom ) {
+            const op_desc& c = *b.custom;
+            if ( l.type != c.left || r.type != c.right ) {
+                fail("operator " + c.name + " takes " + c.left->name + " and "
+                     + c.right->name + ", not " + l.type->name + " and "
+                     + r.type->name, at);
+            }
+            expr_node* n = c.make(l.node.release(), r.node.release());
+            return parsed{std::unique_ptr<expr_node>(n), c.result, l.at};
+        }
+        if ( l.type != r.type || !p.ops.builtin_applies(b.code, l.type) ) {
+            fail(std::string("operator ") + op_name(b.code)
+                 + " does not apply to " + l.type->name + " and "
+                 + r.type->name, at);
+        }
+        const type_desc* t = l.type;
+        expr_node* n = p.ops.make_builtin(b.code, t, l.node.release(),
+                                          r.node.release());
+        return parsed{std::unique_ptr<expr_node>(n),
+                      p.ops.builtin_result(b.code, t), l.at};
+    }
+
+    parsed number() {
+        std::size_t start = pos;
+        std::size_t end = pos;
+        if ( end < text.size() && text[end] == '-' ) ++end;
+        bool real = false;
+        while ( end < text.size() && digit(text[end]) ) ++end;
+        if ( end < text.size() && text[end] == '.' ) {
+            real = true;
+            ++end;
+            while ( end < text.size() && digit(text[end]) ) ++end;
+        }
+        if ( end < text.size() && (text[end] == 'e' || text[end] == 'E') ) {
+            real = true;
+            ++end;
+            if ( end < text.size() && (text[end] == '+' || text[end] == '-') ) ++end;
+            while ( end < text.size() && digit(text[end]) ) ++end;
+        }
+        const char* first = text.data() + start;
+        const char* last = text.data() + end;
+        pos = end;
+        if ( real ) {
+            // from_chars for doubles is not yet in every standard library,
+            // and strtod needs a terminated copy; only overlong numbers
+            // are copied to the heap
+            char buf[64];
+            std::string overlong;
+            std::size_t n = std::size_t(last - first);
+            const char* s = buf;
+            if ( n < sizeof buf ) {
+                std::memcpy(buf, first, n);
+                buf[n] = '\0';
+            } else {
+                overlong.assign(first, last);
+                s = overlong.c_str();
+            }
+            char* used = nullptr;
+            errno = 0;
+            double v = std::strtod(s, &used);
+            if ( used != s + n || errno == ERANGE ) fail("bad number", start);
+            return parsed{std::make_unique<const_expr<double>>(v),
+                          p.ops.double_type(), start};
+        }
+        int v = 0;
+        auto r = std::from_chars(first, last, v);
+        if ( r.ec == std::errc::result_out_of_range ) {
+            fail("integer out of range", start);
+        }
+        if ( r.ec != std::errc() || r.ptr != last ) fail("bad number", start);
+        return parsed{std::make_unique<const_expr<int>>(v), p.ops.int_type(), start};
+    }
+
+    parsed string() {
+        std::size_t start = pos++;
+        std::string s;
+        for (;;) {
+            if ( pos >= text.size() ) fail("unterminated string", start);
+            char c = text[pos++];
+            if ( c == '"' ) break;
+            if ( c == '\\' ) {
+                if ( pos >= text.size() ) fail("unterminated string", start);
+                char e = text[pos++];
+                switch ( e ) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case '"': case '\\': c = e; break;
+                default: fail("unknown escape", pos - 2);
+                }
+            }
+            s += c;
+        }
+        return parsed{std::make_unique<const_expr<std::string>>(std::move(s)),
+                      p.ops.string_type(), start};
+    }
+
+    /// does a number start at pos?
+    bool starts_number() const {
+        if ( pos >= text.size() ) return false;
+        std::size_t i = text[pos] == '-' ? pos + 1 : pos;
+        return i < text.size() && (digit(text[i]) || text[i] == '.');
+    }
+
+    /// parses a constant, variable, parenthesized expression or conditional
+    parsed primary() {
+        skip_space();
+        std::size_t start = pos;
+        if ( pos >= text.size() ) fail("expected an expression", pos);
+        if ( starts_number() ) return number();
+        char c = text[pos];
+        if ( c == '"' ) return string();
+        if ( c == '(' ) {
+            ++pos;
+            parsed e = expression(0);
+            expect(")");
+            e.at = start;
+            return e;
+        }
+        std::string_view ident = peek_ident();
+        if ( ident.empty() ) fail("expected an expression", pos);
+        if ( ident == "true" || ident == "false" ) {
+            pos += ident.size();
+            return parsed{std::make_unique<const_expr<bool>>(ident == "true"),
+                          p.ops.bool_type(), start};
+        }
+        if ( ident == "if" ) return conditional();
+        if ( ident == "else" ) fail("expected an expression", pos);
+        if ( !p.scope || !p.scope->contains(ident) ) {
+            fail("unknown variable " + std::string(ident), start);
+        }
+        std::size_t s = p.scope->slot(ident);
+        const type_desc* t = p.ops.find_type(p.scope->type(s));
+        if ( !t ) {
+            fail("variable " + std::string(ident)
+                 + " has a type the parser does not know", start);
+        }
+        pos += ident.size();
+        return parsed{std::unique_ptr<expr_node>(t->make_var(*p.scope, ident)),
+                      t, start};
+    }
+
+    parsed conditional() {
+        // a conditional's condition may be a conditional, without an
+        // expression() between them to count its depth
+        if ( ++depth > max_depth ) fail("expression nested too deeply", pos);
+        std::size_t start = pos;
+        expect("if");
+        parsed c = primary();
+        if ( c.type != p.ops.bool_type() ) {
+            fail("the condition must be a bool, not " + c.type->name, c.at);
+        }
+        // a `-` may begin a negative number for the first branch
+        binary b;
+        if ( peek_binary(b) && !starts_number() ) {
+            fail("the condition of an if must be parenthesized", c.at);
+        }
+        parsed t = expression(0);
+        expect("else");
+        parsed f = expression(0);
+        if ( f.type != t.type ) {
+            fail("the branches have different types, " + t.type->name
+                 + " and " + f.type->name, f.at);
+        }
+        const type_desc* type = t.type;
+        expr_node* n = type->make_if(c.node.release(), t.node.release(),
+                                     f.node.release());
+        --depth;
+        return parsed{std::unique_ptr<expr_node>(n), type, start};
+    }
+
+public:
+    cursor(const expr_parser& p, std::string_view text)
+    : p(p), text(text) {}
+
+    /// parses an expression whose operators bind at least as tightly as
+    /// min_precedence, by precedence climbing
+    parsed expression(int min_precedence) {
+        if ( ++depth > max_depth ) fail("expression nested too deeply", pos);
+        parsed l = primary();
+        binary b;
+        while ( peek_binary(b) && b.precedence >= min_precedence ) {
+            std::size_t at = pos;
+            pos += b.length;
+            // operators are left-associative
+            parsed r = expression(b.precedence + 1);
+            l = combine(b, std::move(l), std::move(r), at);
+        }
+        --depth;
+        return l;
+    }
+
+    /// parses an expression of type T
+    template<typename T>
+    expr<T>* typed() {
+        parsed e = expression(0);
+        const type_desc* want = p.ops.find_type(typeid(T));
+        if ( e.type != want ) {
+            fail("expected an expression of type "
+                 + (want ? want->name : std::string(typeid(T).name()))
+                 + ", not " + e.type->name, e.at);
+        }
+        return static_cast<expr<T>*>(e.node.release());
+    }
+
+    /// is the whole text consumed?
+    bool at_end() {
+        skip_space();
+        return pos == text.size();
+    }
+
+    void expect_end() {
+        if ( !at_end() ) fail("expected the end of the text", pos);
+    }
+
+    void expect_symbol(std::string_view s) { expect(s); }
+};
+
+template<typename T>
+expr<T>* expr_parser::parse(std::string_view text) const {
+    cursor c(*this, text);
+    std::unique_ptr<expr<T>> e{c.template typed<T>()};
+    c.expect_end();
+    return e.release();
+}
+
+template<typename T>
+std::vector<std::unique_ptr<expr<T>>>
+expr_parser::parse_list(std::string_view text) const {
+    std::vector<std::unique_ptr<expr<T>>> out;
+    cursor c(*this, text);
+    while ( !c.at_end() ) {
+        out.emplace_back(c.template typed<T>());
+        c.expect_symbol(";");
+    }
+    return out;
+}
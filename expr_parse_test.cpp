@@ -0,0 +1,175 @@
+#include "expr_parse.hpp"
+#include "expr_test_samples.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// the printed form of e
+template<typename T>
+std::string text(const expr<T>& e) {
+    std::ostringstream out;
+    out << e;
+    return out.str();
+}
+
+/// parses source as a T, checking that it evaluates to v
+template<typename T>
+void check(const expr_parser& p, const std::string& source, const T& v,
+           const env& vars = env()) {
+    std::unique_ptr<expr<T>> e{p.parse<T>(source)};
+    std::cout << source << "  =>  " << *e << " = " << e->eval(vars) << std::endl;
+    assert(e->eval(vars) == v);
+}
+
+/// checks that parsing source as a T fails at line:column
+template<typename T>
+void check_error(const expr_parser& p, const std::string& source,
+                 std::size_t line, std::size_t column) {
+    try {
+        delete p.parse<T>(source);
+        assert(!"expected a parse error");
+    } catch (const parse_error& e) {
+        std::cout << source << "  =>  " << e.what() << std::endl;
+        assert(e.line == line);
+        assert(e.column == column);
+    }
+}
+
+int main() {
+    var_scope scope;
+    scope.declare<int>("x");
+    scope.declare<double>("w");
+    scope.declare<bool>("flag");
+    scope.declare<std::string>("who");
+    op_registry ops;
+    ops.define_op<int, int, int>("mult", mult);
+    expr_parser p(ops, &scope);
+
+    // the sample rule
+    check<std::string>(p, "if (2 + 2 == 4) \"correct\" else \"incorrect\"",
+                       "correct");
+    check<std::string>(p, "if (8 mult 5 == 40) \"corr\" + \"ect\" else \"no\"",
+                       "correct");
+
+    // precedence & associativity follow C
+    check(p, "1 + 2 * 3", 7);
+    check(p, "(1 + 2) * 3", 9);
+    check(p, "10 - 4 - 3", 3);
+    check(p, "20 / 2 / 5", 2);
+    check(p, "7 % 4 * 2", 6);
+    check(p, "1 < 2 == 3 < 4", true);
+    check(p, "false && true || true", true);
+    check(p, "true || false && false", true);
+    check(p, "2 mult 3 + 1", 7);
+    check(p, "-3 - -4", 1);
+    check(p, "1.5 * 2e1", 30.0);
+    check(p, "0." + std::string(80, '0') + "25e81", 2.5);
+    check<std::string>(p, "\"a\\\"b\\\\\" + \"\\n\"", "a\"b\\\n");
+    check(p, "\"abc\" < \"abd\"", true);
+
+    // conditionals nest, and may start their branches with negative numbers
+    check(p, "if true if false 1 else 2 else 3", 2);
+    check(p, "if false -1 else -2", -2);
+    check(p, "1 + if (1 > 2) 10 else 20", 21);
+
+    // variables are resolved in the scope, & comments skipped
+    env vars = scope.make_env();
+    vars.set(scope.slot("x"), 6);
+    vars.set(scope.slot("w"), 0.5);
+    vars.set(scope.slot("flag"), true);
+    vars.set<std::string>(scope.slot("who"), "you");
+    check(p, "if flag x mult 7 // the answer\n else 0", 42, vars);
+    check(p, "w * 4.0 > 1.5 && who == \"you\"", true, vars);
+
+    // printed trees parse back to equal trees, sharing custom operators
+    std::unique_ptr<expr<bool>> rule{p.parse<bool>("(x mult 2) + 1 >= x * x")};
+    std::unique_ptr<expr<bool>> again{p.parse<bool>(text(*rule))};
+    assert(again->equals(*rule));
+    assert(text(*again) == text(*rule));
+
+    // as do the samples: their custom operators are named as the built-in
+    // ones they act as, or defined here
+    op_registry sample_ops;
+    sample_ops.define_op<std::string, std::string, std::string>(
+        "concat", samples::concat);
+    var_scope sample_scope;
+    sample_scope.declare<int>("x");
+    sample_scope.declare<int>("y");
+    sample_scope.declare<bool>("flag");
+    sample_scope.declare<double>("w");
+    expr_parser sample_parser(sample_ops, &sample_scope);
+
+    // so custom operators must be named by identifiers, which the parser
+    // can't mistake for built-in operators or keywords
+    for (const char* name : { "==", "+", "++", "", "2x", "if", "true" }) {
+        try {
+            sample_ops.define_op<int, int, int>(name, mult);
+            assert(!"expected an error");
+        } catch (const std::invalid_argument&) {}
+        assert(!sample_ops.find_op(name));
+    }
+    samples::for_each([&](const auto& e, const env& vars) {
+        using T = std::decay_t<decltype(e.eval())>;
+        std::unique_ptr<expr<T>> back{sample_parser.parse<T>(text(e))};
+        assert(back->eval(vars) == e.eval(vars));
+        assert(text(*back) == text(e));
+    });
+
+    // constants print as they are parsed, and conditionals in parentheses,
+    // so an operator after them isn't read into the false branch
+    std::unique_ptr<expr<int>> cond{p.parse<int>("(if true 1 else 2) + 3")};
+    assert(text(*cond) == "((if true 1 else 2) + 3)");
+    std::unique_ptr<expr<int>> reread{p.parse<int>(text(*cond))};
+    assert(reread->eval() == 4);
+    for (double d : { 4.0, 0.1, -0.0, 1e300, 1.0 / 3, 2.5e-8 }) {
+        const_expr<double> c = d;
+        std::unique_ptr<expr<double>> back{p.parse<double>(text(c))};
+        assert(back->equals(c));
+    }
+    const_expr<std::string> quoted = std::string("say \"hi\"\\\n\tnow");
+    std::unique_ptr<expr<std::string>> unquoted{
+        p.parse<std::string>(text(quoted))};
+    assert(unquoted->equals(quoted));
+
+    // lists of rules
+    auto rules = p.parse_list<int>("1 + 1; if flag 2 else 3;\n x mult x;");
+    assert(rules.size() == 3);
+    assert(rules[2]->eval(vars) == 36);
+    assert(p.parse_list<int>("  ").empty());
+
+    // errors give their position
+    check_error<int>(p, "1 + true", 1, 3);
+    check_error<int>(p, "1 +", 1, 4);
+    check_error<int>(p, "(1 + 2", 1, 7);
+    check_error<int>(p, "1 2", 1, 3);
+    check_error<int>(p, "1.5 % 2.0", 1, 5);
+    check_error<int>(p, "1 == 1", 1, 1);
+    check_error<int>(p, "y + 1", 1, 1);
+    check_error<int>(p, "if 1 2 else 3", 1, 4);
+    check_error<int>(p, "if x < 2 1 else 0", 1, 4);
+    check_error<int>(p, "if true 1 else \"no\"", 1, 16);
+    check_error<int>(p, "if true 1", 1, 10);
+    check_error<int>(p, "\n  w mult 2", 2, 5);
+    check_error<int>(p, "99999999999", 1, 1);
+    check_error<double>(p, "1 + 1e999", 1, 5);
+    check_error<std::string>(p, "\"open", 1, 1);
+    check_error<bool>(p, "true && (false ||", 1, 18);
+
+    // deep nesting is an error, not a crash
+    std::string deep(expr_parser::max_depth + 10, '(');
+    check_error<int>(p, deep + "1", 1, expr_parser::max_depth + 1);
+    std::string conditions;
+    for (std::size_t i = 0; i < expr_parser::max_depth + 10; ++i) {
+        conditions += "if ";
+    }
+    check_error<int>(p, conditions + "true 1 else 2",
+                     1, 3 * expr_parser::max_depth - 2);
+}
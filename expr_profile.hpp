@@ -0,0 +1,114 @@
+#pragma once
+
+// reports of per-node evaluation counts & times
+
+#include "expr.hpp"
+
+#if EXPR_PROFILE
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// The evaluations of one node of a profiled tree
+struct profile_entry {
+    const expr_node* node;
+    /// The depth of the node below the root
+    std::size_t depth;
+    /// The number of evaluations
+    std::uint64_t count;
+    /// The time they took, including the node's operands, in ns
+    std::uint64_t total_ns;
+    /// The time they took, excluding the node's operands, in ns
+    std::uint64_t self_ns;
+};
+
+namespace detail {
+
+inline void collect_profile(const expr_node& e, std::size_t depth,
+                            std::vector<profile_entry>& out) {
+    std::uint64_t total = e.profile().ns.load(std::memory_order_relaxed);
+    std::uint64_t children = 0;
+    for (std::size_t i = 0; i < e.arity(); ++i) {
+        children += e.operand(i).profile().ns.load(std::memory_order_relaxed);
+    }
+    out.push_back(profile_entry{&e, depth,
+        e.profile().count.load(std::memory_order_relaxed), total,
+        // a shared operand's time may include evaluations for other parents
+        total > children ? total - children : 0});
+    for (std::size_t i = 0; i < e.arity(); ++i) {
+        collect_profile(e.operand(i), depth + 1, out);
+    }
+}
+
+}
+
+/// The stats of each node of the tree rooted at e, in preorder
+inline std::vector<profile_entry> collect_profile(const expr_node& e) {
+    std::vector<profile_entry> out;
+    detail::collect_profile(e, 0, out);
+    return out;
+}
+
+namespace detail {
+
+inline void print_profile_header(std::ostream& out) {
+    char line[64];
+    std::snprintf(line, sizeof line, "%10s %12s %12s %7s  ",
+                  "count", "total ns", "self ns", "%total");
+    out << line << "expression\n";
+}
+
+inline void print_profile_line(std::ostream& out, const profile_entry& p,
+                               double root_ns, std::size_t indent,
+                               std::size_t width) {
+    std::ostringstream text;
+    p.node->print(text);
+    std::string s = text.str();
+    if ( s.size() > width ) s = s.substr(0, width - 3) + "...";
+    char line[64];
+    std::snprintf(line, sizeof line, "%10llu %12llu %12llu %6.1f%%  ",
+                  (unsigned long long)p.count, (unsigned long long)p.total_ns,
+                  (unsigned long long)p.self_ns,
+                  100.0 * double(p.total_ns) / root_ns);
+    out << line << std::string(indent, ' ') << s << '\n';
+}
+
+}
+
+/// Prints the tree rooted at e, a node per line & indented by depth, with
+/// the number of evaluations of each node, their total & self time and
+/// the total as a share of the root's. Nodes are printed as print() prints
+/// them, cut to `width` characters
+inline void print_profile(std::ostream& out, const expr_node& e,
+                          std::size_t width = 60) {
+    std::vector<profile_entry> entries = collect_profile(e);
+    double root_ns = double(std::max<std::uint64_t>(entries[0].total_ns, 1));
+    detail::print_profile_header(out);
+    for (const profile_entry& p : entries) {
+        detail::print_profile_line(out, p, root_ns, 2 * p.depth, width);
+    }
+}
+
+/// Prints the `n` nodes of the tree rooted at e with the most self time,
+/// in the format of print_profile()
+inline void print_hot_nodes(std::ostream& out, const expr_node& e,
+                            std::size_t n = 10, std::size_t width = 60) {
+    std::vector<profile_entry> entries = collect_profile(e);
+    double root_ns = double(std::max<std::uint64_t>(entries[0].total_ns, 1));
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const profile_entry& a, const profile_entry& b) {
+            return a.self_ns > b.self_ns;
+        });
+    if ( entries.size() > n ) entries.resize(n);
+    detail::print_profile_header(out);
+    for (const profile_entry& p : entries) {
+        detail::print_profile_line(out, p, root_ns, 0, width);
+    }
+}
+
+#endif
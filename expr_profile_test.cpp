@@ -0,0 +1,73 @@
+#define EXPR_PROFILE 1
+
+#include "expr_profile.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// the number of evaluations of e so far
+std::uint64_t count(const expr_node& e) {
+    return e.profile().count.load();
+}
+
+int main() {
+    // the sample rule, with a custom operator & boxed values
+    if_expr<std::string> root = {
+        new bin_op_expr<bool, int, int>(
+            op::eq,
+            new bin_op_expr<int, int, int>(
+                mult, "*", new const_expr<int>(8), new const_expr<int>(5)),
+            new const_expr<int>(40)),
+        new const_expr<std::string>("correct"),
+        new const_expr<std::string>("incorrect")
+    };
+    for (int i = 0; i < 3; ++i) assert(root.eval() == "correct");
+
+    // each node counts the evaluations eval() made of it, and only the
+    // selected branch is evaluated
+    assert(count(root) == 3);
+    assert(count(root.operand(0)) == 3);
+    assert(count(root.operand(0).operand(0).operand(1)) == 3);
+    assert(count(root.operand(1)) == 3);
+    assert(count(root.operand(2)) == 0);
+
+    // times include the operands' times
+    auto entries = collect_profile(root);
+    assert(entries.size() == 8);
+    assert(entries[0].node == &root && entries[0].depth == 0);
+    assert(entries[0].total_ns >= entries[1].total_ns + entries[6].total_ns);
+    assert(entries[0].self_ns <= entries[0].total_ns);
+
+    print_profile(std::cout, root);
+    print_hot_nodes(std::cout, root, 3);
+
+    // the report prints nodes as print() does, indented by depth
+    std::ostringstream report;
+    print_profile(report, root);
+    assert(report.str().find("    (8 * 5)\n") != std::string::npos);
+    assert(report.str().find("  \"incorrect\"\n") != std::string::npos);
+
+    // short-circuiting skips the right operand
+    and_expr both = {
+        new const_expr<bool>(false),
+        new bin_op_expr<bool, int, int>(
+            op::eq, new const_expr<int>(1), new const_expr<int>(1))
+    };
+    assert(!both.eval());
+    assert(count(both) == 1);
+    assert(count(both.operand(0)) == 1);
+    assert(count(both.operand(1)) == 0);
+
+    // clones start afresh, and counts can be reset
+    std::unique_ptr<expr<std::string>> copy{root.clone()};
+    assert(count(*copy) == 0);
+    root.reset_profile();
+    assert(count(root) == 0);
+    assert(count(root.operand(0).operand(0)) == 0);
+}
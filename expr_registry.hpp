@@ -0,0 +1,234 @@
+#pragma once
+
+// tables of the types & custom operators that text & binary forms name
+
+#include "expr.hpp"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+
+/// The types & custom operators expressions read from text (expr_parser) or
+/// binary form (deserialize) may use, by name. bool, int, double &
+/// std::string are always known, as "bool", "int", "double" & "string";
+/// other types are added with define_type(), and custom operators with
+/// define_op().
+///
+/// Registries are not copied, as their operators refer to their types
+class op_registry {
+public:
+    /// A type, with what is needed to build its nodes
+    struct type_desc {
+        std::string name;
+        const std::type_info* type;
+        expr_node* (*make_var)(var_scope& scope, std::string_view name);
+        std::size_t (*declare)(var_scope& scope, std::string_view name);
+        expr_node* (*make_if)(expr_node* c, expr_node* t, expr_node* f);
+    };
+
+    /// A custom operator
+    struct op_desc {
+        std::string name;
+        /// A node for the operator, with placeholder operands; nodes are
+        /// rebuilt from it, so they share its function
+        std::shared_ptr<const expr_node> proto;
+        const type_desc* left;
+        const type_desc* right;
+        const type_desc* result;
+        /// How tightly it binds in text, as for the built-in operators of
+        /// the same precedence (1 for ||, up to 6 for *)
+        int precedence;
+        /// Was it declared pure, with pure_op()? The values of pure
+        /// operators may be cached
+        bool pure;
+
+        /// makes a node applying the operator to l & r, which it takes
+        /// ownership of; it should be deleted by the caller
+        expr_node* make(expr_node* l, expr_node* r) const {
+            expr_node* ops[] = { l, r };
+            return proto->rebuild(ops);
+        }
+    };
+
+    /// The precedence of custom operators unless another is given; the
+    /// same as that of `* / %`
+    static constexpr int default_precedence = 6;
+
+private:
+    std::unordered_map<std::type_index, type_desc> types;
+    // ordered by name, so names can be looked up as string_views without
+    // copying them
+    std::map<std::string, const type_desc*, std::less<>> types_by_name;
+    std::map<std::string, op_desc, std::less<>> ops;
+
+    const type_desc* bool_desc;
+    const type_desc* int_desc;
+    const type_desc* double_desc;
+    const type_desc* string_desc;
+
+    template<typename T>
+    static expr_node* make_var(var_scope& s, std::string_view n) {
+        return s.var<T>(n);
+    }
+
+    template<typename T>
+    static std::size_t declare(var_scope& s, std::string_view n) {
+        return s.declare<T>(n);
+    }
+
+    template<typename T>
+    static expr_node* make_if(expr_node* c, expr_node* t, expr_node* f) {
+        return new if_expr<T>(static_cast<expr<bool>*>(c),
+                              static_cast<expr<T>*>(t),
+                              static_cast<expr<T>*>(f));
+    }
+
+    /// builds the built-in operator o on operands of type A
+    template<typename A>
+    static expr_node* make_builtin(op o, expr_node* l, expr_node* r) {
+        auto a = static_cast<expr<A>*>(l);
+        auto b = static_cast<expr<A>*>(r);
+        if constexpr ( std::is_same_v<A, bool> ) {
+            if ( o == op::land ) return new and_expr(a, b);
+            if ( o == op::lor ) return new or_expr(a, b);
+        }
+        if ( is_comparison(o) ) return new bin_op_expr<bool, A, A>(o, a, b);
+        if constexpr ( !std::is_same_v<A, bool> ) {
+            return new bin_op_expr<A, A, A>(o, a, b);
+        }
+        return unimplemented<expr_node*>();
+    }
+
+public:
+    op_registry() {
+        bool_desc = define_type<bool>("bool");
+        int_desc = define_type<int>("int");
+        double_desc = define_type<double>("double");
+        string_desc = define_type<std::string>("string");
+    }
+
+    op_registry(const op_registry&) = delete;
+    op_registry& operator= (const op_registry&) = delete;
+
+    /// a registry of only the built-in types
+    static const op_registry& builtins() {
+        static const op_registry r;
+        return r;
+    }
+
+    /// adds the type T, named `name`, returning its description. Each type
+    /// has a single name, and each name a single type
+    template<typename T>
+    const type_desc* define_type(const std::string& name) {
+        auto it = types.find(std::type_index(typeid(T)));
+        if ( it == types.end() ) {
+            assert(types_by_name.find(name) == types_by_name.end());
+            it = types.emplace(std::type_index(typeid(T)), type_desc{
+                name, &typeid(T), make_var<T>, declare<T>, make_if<T>}).first;
+            types_by_name.emplace(name, &it->second);
+        }
+        assert(it->second.name == name);
+        return &it->second;
+    }
+
+    /// Can n name a custom operator? Only identifiers other than the
+    /// keywords can, as expr_parser reads symbols as built-in operators
+    static bool valid_op_name(std::string_view n) {
+        auto start = [](char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        };
+        if ( n.empty() || !start(n[0]) ) return false;
+        for (char c : n) {
+            if ( !start(c) && !(c >= '0' && c <= '9') ) return false;
+        }
+        return n != "if" && n != "else" && n != "true" && n != "false";
+    }
+
+    /// defines the custom operator `name`, applying f to operands of types
+    /// A & B to give a T, which must be built-in or defined types. Its
+    /// nodes print as `(l name r)`, so printed trees can be parsed again;
+    /// throws std::invalid_argument unless valid_op_name(name).
+    /// Operators are impure unless f is wrapped in pure_op()
+    template<typename T, typename A, typename B, typename F>
+    const op_desc& define_op(const std::string& name, F&& f,
+                             int precedence = default_precedence) {
+        static_assert(std::is_default_constructible_v<A>
+                      && std::is_default_constructible_v<B>,
+            "the operand types must be default-constructible");
+        if ( !valid_op_name(name) ) {
+            throw std::invalid_argument("not an operator name: " + name);
+        }
+        const type_desc* t = find_type(typeid(T));
+        const type_desc* a = find_type(typeid(A));
+        const type_desc* b = find_type(typeid(B));
+        assert(t && a && b && "define the operator's types first");
+        auto proto = std::make_shared<bin_op_expr<T, A, B>>(
+            std::forward<F>(f), name, new const_expr<A>(A()),
+            new const_expr<B>(B()));
+        bool pure = proto->local_pure();
+        op_desc& d = ops[name];
+        d = op_desc{name, std::move(proto), a, b, t, precedence, pure};
+        return d;
+    }
+
+    /// the type t, or null if it is not known
+    const type_desc* find_type(const std::type_info& t) const {
+        auto it = types.find(std::type_index(t));
+        return it == types.end() ? nullptr : &it->second;
+    }
+
+    /// the type named n, or null if there is none
+    const type_desc* find_type(std::string_view n) const {
+        auto it = types_by_name.find(n);
+        return it == types_by_name.end() ? nullptr : it->second;
+    }
+
+    /// the custom operator named n, or null if there is none
+    const op_desc* find_op(std::string_view n) const {
+        auto it = ops.find(n);
+        return it == ops.end() ? nullptr : &it->second;
+    }
+
+    const type_desc* bool_type() const { return bool_desc; }
+    const type_desc* int_type() const { return int_desc; }
+    const type_desc* double_type() const { return double_desc; }
+    const type_desc* string_type() const { return string_desc; }
+
+    /// Is the built-in operator o defined on operands of type t?
+    /// Arithmetic is on ints & doubles (but not % on doubles), and + on
+    /// strings; comparisons are on all the built-in types, though bools
+    /// only have == & !=; && & || are on bools
+    bool builtin_applies(op o, const type_desc* t) const {
+        if ( t == int_desc ) return !is_logical(o);
+        if ( t == double_desc ) return !is_logical(o) && o != op::mod;
+        if ( t == string_desc ) return is_comparison(o) || o == op::add;
+        if ( t == bool_desc ) {
+            return is_logical(o) || o == op::eq || o == op::ne;
+        }
+        return false;
+    }
+
+    /// the type the built-in operator o gives on operands of type t
+    const type_desc* builtin_result(op o, const type_desc* t) const {
+        return is_comparison(o) || is_logical(o) ? bool_desc : t;
+    }
+
+    /// makes a node applying the built-in operator o to l & r, of type t,
+    /// which it takes ownership of; builtin_applies(o, t) must hold. &&
+    /// and || are and_expr & or_expr nodes
+    expr_node* make_builtin(op o, const type_desc* t, expr_node* l,
+                            expr_node* r) const {
+        assert(builtin_applies(o, t));
+        if ( t == int_desc ) return make_builtin<int>(o, l, r);
+        if ( t == double_desc ) return make_builtin<double>(o, l, r);
+        if ( t == string_desc ) return make_builtin<std::string>(o, l, r);
+        return make_builtin<bool>(o, l, r);
+    }
+};
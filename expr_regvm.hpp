@@ -0,0 +1,344 @@
+#pragma once
+
+// register machine backend for the expression language
+
+#include "expr.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+// Dispatch through a table of label addresses where the compiler supports it
+// (GCC & Clang), and through a switch everywhere else. Define
+// EXPR_COMPUTED_GOTO to 0 to force the switch.
+#ifndef EXPR_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define EXPR_COMPUTED_GOTO 1
+#else
+#define EXPR_COMPUTED_GOTO 0
+#endif
+#endif
+
+/// Instructions of the register machine
+enum class reg_op : std::uint8_t {
+    call,           ///< r[dst] = fns[fn](r[a], r[b])
+    move,           ///< r[dst] = r[a]
+    jump_if_false,  ///< jumps to target if r[a] is false
+    jump_if_true,   ///< jumps to target if r[a] is true
+    jump,           ///< jumps to target
+    ret,            ///< returns r[a]
+    // built-in operators on cells, r[dst] = r[a] op r[b]
+#define EXPR_REG_OP(name, code, arg, res, sym) name,
+    EXPR_CELL_OPS(EXPR_REG_OP)
+#undef EXPR_REG_OP
+    first_cell_op = add_i
+};
+
+/// A single three-address instruction
+struct reg_instr {
+    reg_op op;
+    std::uint32_t dst;
+    std::uint32_t a;
+    std::uint32_t b;
+    /// operator index for call, instruction index for jumps
+    std::uint32_t arg;
+};
+
+/// An expression of type T, lowered to a register machine program.
+/// Registers [0, consts.size()) hold the constants of the tree, the next
+/// var_slots.size() hold the variables it reads, and the rest hold 
+/// intermediate results. The program owns copies of all of its
+/// constants & operators, so it is independent of the tree it was compiled
+/// from
+template<typename T>
+class reg_program {
+    /// The instructions
+    std::vector<reg_instr> code;
+    /// The initial values of the constant registers
+    std::vector<cell> consts;
+    /// The env slot loaded into each variable register
+    std::vector<std::uint32_t> var_slots;
+    /// The operator table
+    std::vector<cell_fn> fns;
+    /// Owns the boxed constants
+    value_pool pool;
+    /// The number of env slots the program reads
+    std::size_t n_vars = 0;
+    /// The number of registers used, including the constants & variables
+    std::uint32_t n_regs = 0;
+
+    std::uint32_t here() const { return std::uint32_t(code.size()); }
+
+    void emit(reg_op op, std::uint32_t dst, std::uint32_t a = 0,
+              std::uint32_t b = 0, std::uint32_t arg = 0) {
+        code.push_back(reg_instr{op, dst, a, b, arg});
+    }
+
+    /// Marks the absence of a requested destination register
+    static constexpr std::uint32_t none = std::uint32_t(-1);
+
+    /// Temporaries are allocated in stack order above the constants;
+    /// `next` is the first free temporary
+    std::uint32_t next = 0;
+
+    std::uint32_t alloc() {
+        std::uint32_t r = next++;
+        if ( next > n_regs ) n_regs = next;
+        return r;
+    }
+
+    /// The index into var_slots of each env slot, or `none`; 
+    /// only used during compilation
+    std::vector<std::uint32_t> slot_vars;
+
+    /// numbers the constants & variables of e, so the temporaries can go 
+    /// after them
+    void number_leaves(const expr_node& e) {
+        if ( e.kind() == node_kind::constant ) {
+            consts.push_back(e.value(pool));
+            return;
+        }
+        if ( e.kind() == node_kind::var ) {
+            // each variable is loaded once, however often the tree reads it
+            if ( e.slot() >= slot_vars.size() ) {
+                slot_vars.resize(e.slot() + 1, none);
+            }
+            if ( slot_vars[e.slot()] == none ) {
+                slot_vars[e.slot()] = std::uint32_t(var_slots.size());
+                var_slots.push_back(std::uint32_t(e.slot()));
+            }
+            return;
+        }
+        for (std::size_t i = 0; i < e.arity(); ++i) number_leaves(e.operand(i));
+    }
+
+    /// appends the code for e, returning the register holding its value.
+    /// The value is computed into `want` if it is not `none` and e is not
+    /// a constant or variable; `k` is the index of the next constant to 
+    /// visit
+    std::uint32_t lower(const expr_node& e, std::uint32_t& k,
+                        std::uint32_t want = none) {
+        switch ( e.kind() ) {
+        case node_kind::constant:
+            return k++;
+        case node_kind::var:
+            return std::uint32_t(consts.size()) + slot_vars[e.slot()];
+        case node_kind::bin_op: {
+            if ( is_short_circuit(e) ) return lower_logical(e, k, want);
+            std::uint32_t mark = next;
+            std::uint32_t l = lower(e.operand(0), k);
+            std::uint32_t r = lower(e.operand(1), k);
+            // the operands are dead after this instruction, so their
+            // temporaries can be reused for the result
+            next = mark;
+            std::uint32_t dst = want == none ? alloc() : want;
+            int native = find_cell_op(e);
+            if ( native >= 0 ) {
+                emit(reg_op(int(reg_op::first_cell_op) + native), dst, l, r);
+            } else {
+                emit(reg_op::call, dst, l, r, std::uint32_t(fns.size()));
+                fns.push_back(e.cell_op());
+            }
+            return dst;
+        }
+        case node_kind::cond: {
+            std::uint32_t mark = next;
+            std::uint32_t c = lower(e.operand(0), k);
+            next = mark;
+            std::uint32_t dst = want == none ? alloc() : want;
+            std::uint32_t to_false = here();
+            emit(reg_op::jump_if_false, 0, c);
+            std::uint32_t t = lower(e.operand(1), k, dst);
+            if ( t != dst ) emit(reg_op::move, dst, t);
+            std::uint32_t to_end = here();
+            emit(reg_op::jump, 0);
+            code[to_false].arg = here();
+            std::uint32_t f = lower(e.operand(2), k, dst);
+            if ( f != dst ) emit(reg_op::move, dst, f);
+            code[to_end].arg = here();
+            next = mark + (want == none ? 1 : 0);
+            return dst;
+        }
+        }
+        return unimplemented<std::uint32_t>();
+    }
+
+    /// appends the code for a short-circuiting && or ||, as lower()
+    std::uint32_t lower_logical(const expr_node& e, std::uint32_t& k,
+                                std::uint32_t want) {
+        std::uint32_t mark = next;
+        std::uint32_t dst = want == none ? alloc() : want;
+        // the left operand is the result if it decides it, otherwise the 
+        // right operand is
+        std::uint32_t l = lower(e.operand(0), k, dst);
+        if ( l != dst ) emit(reg_op::move, dst, l);
+        std::uint32_t to_end = here();
+        emit(e.opcode() == op::land ? reg_op::jump_if_false 
+                                    : reg_op::jump_if_true, 0, dst);
+        std::uint32_t r = lower(e.operand(1), k, dst);
+        if ( r != dst ) emit(reg_op::move, dst, r);
+        code[to_end].arg = here();
+        next = mark + (want == none ? 1 : 0);
+        return dst;
+    }
+
+    /// runs the program on the variables vars, storing boxed intermediate 
+    /// results in scratch
+    cell exec(const cell* vars, value_pool& scratch) const {
+        // most programs need few registers, so avoid allocating them
+        cell local[64];
+        std::vector<cell> heap;
+        cell* r = local;
+        if ( n_regs > 64 ) {
+            heap.resize(n_regs);
+            r = heap.data();
+        }
+        if ( !consts.empty() ) {
+            std::memcpy(r, consts.data(), consts.size() * sizeof(cell));
+        }
+        cell* var_regs = r + consts.size();
+        for (std::size_t i = 0; i < var_slots.size(); ++i) {
+            var_regs[i] = vars[var_slots[i]];
+        }
+
+        const reg_instr* start = code.data();
+        const reg_instr* pc = start;
+
+#if EXPR_COMPUTED_GOTO
+        static void* const labels[] = {
+            &&do_call, &&do_move, &&do_jump_if_false, &&do_jump_if_true, 
+            &&do_jump, &&do_ret,
+#define EXPR_REG_OP(name, code, arg, res, sym) &&do_##name,
+            EXPR_CELL_OPS(EXPR_REG_OP)
+#undef EXPR_REG_OP
+        };
+#define EXPR_DISPATCH() goto *labels[int(pc->op)]
+#define EXPR_CASE(name) do_##name:
+        EXPR_DISPATCH();
+#else
+#define EXPR_DISPATCH() continue
+#define EXPR_CASE(name) case reg_op::name:
+        for (;;) switch ( pc->op ) {
+#endif
+        EXPR_CASE(call) {
+            r[pc->dst] = fns[pc->arg](r[pc->a], r[pc->b], scratch);
+            ++pc;
+            EXPR_DISPATCH();
+        }
+        EXPR_CASE(move) {
+            r[pc->dst] = r[pc->a];
+            ++pc;
+            EXPR_DISPATCH();
+        }
+        EXPR_CASE(jump_if_false) {
+            pc = r[pc->a].b ? pc + 1 : start + pc->arg;
+            EXPR_DISPATCH();
+        }
+        EXPR_CASE(jump_if_true) {
+            pc = r[pc->a].b ? start + pc->arg : pc + 1;
+            EXPR_DISPATCH();
+        }
+        EXPR_CASE(jump) {
+            pc = start + pc->arg;
+            EXPR_DISPATCH();
+        }
+        EXPR_CASE(ret) {
+            return r[pc->a];
+        }
+#define EXPR_REG_OP(name, code, arg, res, sym) \
+        EXPR_CASE(name) { \
+            r[pc->dst].res = r[pc->a].arg sym r[pc->b].arg; \
+            ++pc; \
+            EXPR_DISPATCH(); \
+        }
+        EXPR_CELL_OPS(EXPR_REG_OP)
+#undef EXPR_REG_OP
+#if !EXPR_COMPUTED_GOTO
+        }
+#endif
+#undef EXPR_DISPATCH
+#undef EXPR_CASE
+    }
+
+public:
+    /// compiles e; the program does not refer to e afterward
+    explicit reg_program(const expr<T>& e) {
+        number_leaves(e);
+        n_regs = next = std::uint32_t(consts.size() + var_slots.size());
+        std::uint32_t k = 0;
+        std::uint32_t result = lower(e, k);
+        emit(reg_op::ret, 0, result);
+        n_vars = slot_vars.size();
+        slot_vars.clear();
+    }
+
+    /// runs the program, producing the same value as eval() on the
+    /// expression it was compiled from
+    T run() const {
+        return run(env());
+    }
+
+    /// runs the program on the variables vars, producing the same value as 
+    /// eval(vars) on the expression it was compiled from
+    T run(const env& vars) const {
+        assert(vars.size() >= n_vars);
+        value_pool scratch;
+        return value_traits<T>::get(exec(vars.data(), scratch));
+    }
+
+    /// the number of instructions in the program
+    std::size_t size() const { return code.size(); }
+
+    /// the number of registers the program uses
+    std::size_t registers() const { return n_regs; }
+
+    /// prints a listing of the program
+    void print(std::ostream& out) const {
+        for (std::size_t i = 0; i < code.size(); ++i) {
+            const reg_instr& in = code[i];
+            out << i << ": ";
+            switch ( in.op ) {
+            case reg_op::call:
+                out << "r" << in.dst << " = call " << in.arg
+                    << " r" << in.a << " r" << in.b;
+                break;
+            case reg_op::move:
+                out << "r" << in.dst << " = r" << in.a;
+                break;
+            case reg_op::jump_if_false:
+                out << "jump_if_false r" << in.a << " " << in.arg;
+                break;
+            case reg_op::jump_if_true:
+                out << "jump_if_true r" << in.a << " " << in.arg;
+                break;
+            case reg_op::jump:
+                out << "jump " << in.arg;
+                break;
+            case reg_op::ret:
+                out << "ret r" << in.a;
+                break;
+#define EXPR_REG_OP(name, code, arg, res, sym) \
+            case reg_op::name: \
+                out << "r" << in.dst << " = r" << in.a << " " #sym " r" << in.b; \
+                break;
+            EXPR_CELL_OPS(EXPR_REG_OP)
+#undef EXPR_REG_OP
+            }
+            out << "\n";
+        }
+    }
+};
+
+/// Lowers an expression tree to register machine code
+template<typename T>
+reg_program<T> compile_registers(const expr<T>& e) {
+    return reg_program<T>(e);
+}
+
+/// Prints the listing of a register machine program
+template<typename T>
+std::ostream& operator<< (std::ostream& out, const reg_program<T>& p) {
+    p.print(out);
+    return out;
+}
@@ -0,0 +1,5 @@
+// the register machine tests, dispatching through a switch rather than
+// computed gotos
+#define EXPR_COMPUTED_GOTO 0
+
+#include "expr_regvm_test.cpp"
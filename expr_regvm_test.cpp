@@ -0,0 +1,103 @@
+#include "expr_regvm.hpp"
+#include "expr_test_samples.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+/// the listing of p
+template<typename T>
+std::string listing(const reg_program<T>& p) {
+    std::ostringstream out;
+    out << p;
+    return out.str();
+}
+
+/// a balanced tree of + over the constants 1 to 2^depth, from first
+expr<int>* sums(int depth, int& first) {
+    if ( depth == 0 ) return new const_expr<int>(first++);
+    expr<int>* l = sums(depth - 1, first);
+    return new bin_op_expr<int, int, int>(op::add, l, sums(depth - 1, first));
+}
+
+int main() {
+    // the program agrees with the tree-walking evaluator
+    samples::for_each([](const auto& e, const env& vars) {
+        auto prog = compile_registers(e);
+        assert(prog.run(vars) == e.eval(vars));
+    });
+
+    // the operands' temporaries are reused for the result, so a tree
+    // needs as many as it is deep, not as many as it has operators
+    int first = 1;
+    std::unique_ptr<expr<int>> wide{sums(3, first)};
+    auto summed = compile_registers(*wide);
+    std::cout << *wide << "\n" << summed;
+    assert(summed.run() == 36);
+    assert(summed.size() == 8);
+    assert(summed.registers() == 8 + 3);
+
+    // conditionals compute both branches into one register, which the
+    // condition's temporary is reused for; variables are loaded once, and
+    // only branches that are leaves are moved
+    var_scope scope;
+    if_expr<int> branches = {
+        new bin_op_expr<bool, int, int>(
+            op::lt, scope.var<int>("x"), new const_expr<int>(1)),
+        new bin_op_expr<int, int, int>(
+            op::add, scope.var<int>("x"), new const_expr<int>(1)),
+        new bin_op_expr<int, int, int>(
+            op::mul, scope.var<int>("x"), new const_expr<int>(2))
+    };
+    auto chosen = compile_registers(branches);
+    std::cout << branches << "\n" << chosen;
+    assert(listing(chosen) ==
+        "0: r4 = r3 < r0\n"
+        "1: jump_if_false r4 4\n"
+        "2: r4 = r3 + r1\n"
+        "3: jump 5\n"
+        "4: r4 = r3 * r2\n"
+        "5: ret r4\n");
+    assert(chosen.registers() == 5);
+
+    if_expr<int> leaves = {
+        new bin_op_expr<bool, int, int>(
+            op::lt, scope.var<int>("x"), new const_expr<int>(1)),
+        scope.var<int>("x"),
+        new const_expr<int>(0)
+    };
+    auto moved = compile_registers(leaves);
+    std::cout << leaves << "\n" << moved;
+    assert(listing(moved) ==
+        "0: r3 = r2 < r0\n"
+        "1: jump_if_false r3 4\n"
+        "2: r3 = r2\n"
+        "3: jump 5\n"
+        "4: r3 = r1\n"
+        "5: ret r3\n");
+
+    env vars = scope.make_env();
+    for (int x : { -3, 0, 1, 5 }) {
+        vars.set(scope.slot("x"), x);
+        assert(chosen.run(vars) == branches.eval(vars));
+        assert(moved.run(vars) == leaves.eval(vars));
+    }
+
+    // && and || leave the deciding operand in the result register, and
+    // custom operators are listed as calls
+    and_expr logic = {
+        new bin_op_expr<bool, int, int>(
+            samples::equals, "==", scope.var<int>("x"), new const_expr<int>(5)),
+        new const_expr<bool>(true)
+    };
+    auto called = compile_registers(logic);
+    std::cout << logic << "\n" << called;
+    assert(listing(called) ==
+        "0: r3 = call 0 r2 r0\n"
+        "1: jump_if_false r3 3\n"
+        "2: r3 = r1\n"
+        "3: ret r3\n");
+    assert(called.run(vars) && !compile_registers(logic).run(env(1)));
+}
@@ -0,0 +1,634 @@
+#pragma once
+
+// a compact binary form of expression trees
+
+#include "expr.hpp"
+#include "expr_registry.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// The binary form of a list of expression trees, version 1. Integers are
+/// little-endian, and varints are LEB128 (7 bits a byte, low bits first).
+///
+///     "EXPR" version:varint
+///     n_names:varint (length:varint bytes)*    the name table
+///     n_trees:varint node*                     each tree, in preorder
+///
+/// A node is a tag byte followed by its fields & operands:
+///
+///     constant   type value
+///     var        type name
+///     builtin    op:byte type left right       type is the operands' type
+///     logic      op:byte left skip:u32 right   for && & ||
+///     custom     name left right
+///     cond       type cond skip:u32 true false
+///
+/// Types are varints: 0 to 3 are bool, int, double & string, and 4 + i
+/// names the type called names[i] in the op_registry. Names (of variables,
+/// custom operators & types) are varint indexes into the name table, so
+/// each is stored once per file. Values are a byte for bools, zigzag
+/// varints for ints, 8 bytes for doubles & a varint length & bytes for
+/// strings. `skip` is the length in bytes of the operand after it, so
+/// readers evaluating the form in place can skip the operands they do
+/// not need
+namespace serial {
+
+constexpr char magic[4] = {'E', 'X', 'P', 'R'};
+constexpr std::uint32_t version = 1;
+
+enum tag : unsigned char {
+    constant_tag, var_tag, builtin_tag, logic_tag, custom_tag, cond_tag
+};
+
+enum type_code : std::uint32_t {
+    bool_code, int_code, double_code, string_code, first_named_code
+};
+
+}
+
+/// An error in binary data given to expr_reader, at an offset in it
+class decode_error : public std::runtime_error {
+public:
+    /// The offset of the error in the data
+    std::size_t offset;
+
+    decode_error(const std::string& what, std::size_t offset)
+    : std::runtime_error("at byte " + std::to_string(offset) + ": " + what),
+      offset(offset) {}
+};
+
+/// Writes expression trees in the binary form, sharing a name table
+/// between them. Custom operators & types other than the built-in ones
+/// must be defined in the writer's op_registry, so that they can be found
+/// again when reading
+class expr_writer {
+    const op_registry& ops;
+    /// The encoded trees
+    std::vector<unsigned char> body;
+    /// The name table
+    std::vector<std::string> names;
+    std::unordered_map<std::string, std::uint32_t> name_index;
+    std::size_t n_trees = 0;
+
+    static void put_varint(std::vector<unsigned char>& out, std::uint64_t v) {
+        while ( v >= 0x80 ) {
+            out.push_back(static_cast<unsigned char>(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<unsigned char>(v));
+    }
+
+    void put_varint(std::uint64_t v) { put_varint(body, v); }
+
+    void put_fixed(std::uint64_t v, int bytes) {
+        for (int i = 0; i < bytes; ++i) body.push_back((v >> (8 * i)) & 0xFF);
+    }
+
+    /// reserves a u32 to be patched with the length of what follows it
+    std::size_t reserve_skip() {
+        std::size_t at = body.size();
+        put_fixed(0, 4);
+        return at;
+    }
+
+    void patch_skip(std::size_t at) {
+        std::uint64_t n = body.size() - (at + 4);
+        if ( n > 0xFFFFFFFFu ) throw std::length_error("subtree too large");
+        for (int i = 0; i < 4; ++i) body[at + i] = (n >> (8 * i)) & 0xFF;
+    }
+
+    std::uint32_t intern(const std::string& n) {
+        auto it = name_index.find(n);
+        if ( it != name_index.end() ) return it->second;
+        std::uint32_t i = std::uint32_t(names.size());
+        names.push_back(n);
+        name_index.emplace(n, i);
+        return i;
+    }
+
+    /// the registry's type of e's value
+    const op_registry::type_desc* type_of(const expr_node& e) const {
+        const op_registry::type_desc* t = ops.find_type(e.result_type());
+        if ( !t ) {
+            throw std::invalid_argument(
+                std::string("type not in the registry: ") + e.result_type().name());
+        }
+        return t;
+    }
+
+    void put_type(const expr_node& e) {
+        const op_registry::type_desc* t = type_of(e);
+        if ( t == ops.bool_type() ) put_varint(serial::bool_code);
+        else if ( t == ops.int_type() ) put_varint(serial::int_code);
+        else if ( t == ops.double_type() ) put_varint(serial::double_code);
+        else if ( t == ops.string_type() ) put_varint(serial::string_code);
+        else put_varint(serial::first_named_code + intern(t->name));
+    }
+
+    void put_constant(const expr_node& e) {
+        value_pool pool;
+        cell v = e.value(pool);
+        switch ( e.result_kind() ) {
+        case value_kind::boolean:
+            body.push_back(v.b);
+            return;
+        case value_kind::integer: {
+            // zigzag, so small negative numbers are short too
+            std::uint32_t u = std::uint32_t(v.i);
+            put_varint((u << 1) ^ (v.i < 0 ? 0xFFFFFFFFu : 0u));
+            return;
+        }
+        case value_kind::real: {
+            std::uint64_t bits;
+            std::memcpy(&bits, &v.d, 8);
+            put_fixed(bits, 8);
+            return;
+        }
+        case value_kind::other:
+            break;
+        }
+        if ( e.result_type() != typeid(std::string) ) {
+            throw std::invalid_argument(
+                std::string("constants of this type cannot be written: ")
+                + e.result_type().name());
+        }
+        auto s = static_cast<const std::string*>(v.ptr);
+        put_varint(s->size());
+        body.insert(body.end(), s->begin(), s->end());
+    }
+
+    void put(const expr_node& e) {
+        switch ( e.kind() ) {
+        case node_kind::constant:
+            body.push_back(serial::constant_tag);
+            put_type(e);
+            put_constant(e);
+            return;
+        case node_kind::var:
+            body.push_back(serial::var_tag);
+            put_type(e);
+            put_varint(intern(e.symbol()));
+            return;
+        case node_kind::cond: {
+            body.push_back(serial::cond_tag);
+            put_type(e);
+            put(e.operand(0));
+            std::size_t skip = reserve_skip();
+            put(e.operand(1));
+            patch_skip(skip);
+            put(e.operand(2));
+            return;
+        }
+        case node_kind::bin_op:
+            break;
+        }
+        if ( is_short_circuit(e) ) {
+            body.push_back(serial::logic_tag);
+            body.push_back(static_cast<unsigned char>(e.opcode()));
+            put(e.operand(0));
+            std::size_t skip = reserve_skip();
+            put(e.operand(1));
+            patch_skip(skip);
+            return;
+        }
+        if ( e.opcode() == op::custom ) {
+            if ( !ops.find_op(e.symbol()) ) {
+                throw std::invalid_argument(
+                    std::string("operator not in the registry: ") + e.symbol());
+            }
+            body.push_back(serial::custom_tag);
+            put_varint(intern(e.symbol()));
+        } else {
+            // only the operand type is written, so the reader can check
+            // the operator as the parser does
+            op o = e.opcode();
+            const op_registry::type_desc* a = type_of(e.operand(0));
+            const op_registry::type_desc* b = type_of(e.operand(1));
+            if ( !ops.builtin_applies(o, a) || b != a
+                 || type_of(e) != ops.builtin_result(o, a) ) {
+                throw std::invalid_argument(std::string("operator ")
+                    + op_name(o) + " cannot be written on " + a->name
+                    + " and " + b->name);
+            }
+            body.push_back(serial::builtin_tag);
+            body.push_back(static_cast<unsigned char>(o));
+            put_type(e.operand(0));
+        }
+        put(e.operand(0));
+        put(e.operand(1));
+    }
+
+public:
+    /// makes a writer for trees whose custom operators & types are in r,
+    /// which must outlive it
+    explicit expr_writer(const op_registry& r = op_registry::builtins())
+    : ops(r) {}
+
+    /// adds a tree. Throws std::invalid_argument if it has a custom
+    /// operator or type not in the registry, a constant of a type other
+    /// than bool, int, double & std::string, or a built-in operator on
+    /// operands the parser would not apply it to (see builtin_applies)
+    void add(const expr_node& e) {
+        std::size_t size = body.size();
+        std::size_t n_names = names.size();
+        try {
+            put(e);
+        } catch (...) {
+            body.resize(size);
+            while ( names.size() > n_names ) {
+                name_index.erase(names.back());
+                names.pop_back();
+            }
+            throw;
+        }
+        ++n_trees;
+    }
+
+    /// the number of trees added
+    std::size_t size() const { return n_trees; }
+
+    /// the binary form of the trees added
+    std::vector<unsigned char> finish() const {
+        std::vector<unsigned char> out(serial::magic, serial::magic + 4);
+        put_varint(out, serial::version);
+        put_varint(out, names.size());
+        for (const std::string& n : names) {
+            put_varint(out, n.size());
+            out.insert(out.end(), n.begin(), n.end());
+        }
+        put_varint(out, n_trees);
+        out.insert(out.end(), body.begin(), body.end());
+        return out;
+    }
+};
+
+namespace serial {
+
+/// Checks the binary form: its header, and that each tree is well formed &
+/// well typed, with every offset in bounds. Custom operators & types are
+/// found by name in an op_registry, and variables are declared in a
+/// var_scope. Data that has been checked can then be read with the
+/// unchecked functions below. Errors are reported by throwing a
+/// decode_error
+class checker {
+public:
+    using type_desc = op_registry::type_desc;
+
+    /// Trees nested deeper than this are an error, rather than overflowing
+    /// the stack
+    static constexpr std::size_t max_depth = 1000;
+
+    const op_registry& ops;
+    var_scope* scope;
+    const unsigned char* data;
+    std::size_t n;
+    /// The offset of the next byte to check
+    std::size_t pos = 0;
+    /// The name table
+    std::vector<std::string> names;
+    /// The number of trees
+    std::size_t n_trees = 0;
+
+private:
+    std::size_t depth = 0;
+
+    unsigned char byte() {
+        if ( pos >= n ) fail("unexpected end of data");
+        return data[pos++];
+    }
+
+    std::uint64_t varint() {
+        std::uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char b = byte();
+            v |= std::uint64_t(b & 0x7F) << shift;
+            if ( !(b & 0x80) ) return v;
+        }
+        fail("varint too long");
+    }
+
+    std::uint64_t fixed(int bytes) {
+        if ( n - pos < std::size_t(bytes) ) fail("unexpected end of data");
+        std::uint64_t v = 0;
+        for (int i = 0; i < bytes; ++i) v |= std::uint64_t(data[pos++]) << (8 * i);
+        return v;
+    }
+
+    std::string string() {
+        std::uint64_t len = varint();
+        if ( len > n - pos ) fail("string runs past the end of the data");
+        std::string s(reinterpret_cast<const char*>(data + pos), len);
+        pos += len;
+        return s;
+    }
+
+    const std::string& name() {
+        std::uint64_t i = varint();
+        if ( i >= names.size() ) fail("bad name index");
+        return names[i];
+    }
+
+    const type_desc* type() {
+        std::uint64_t code = varint();
+        if ( code < first_named_code ) return builtin_type(ops, code);
+        std::uint64_t i = code - first_named_code;
+        if ( i >= names.size() ) fail("bad type");
+        const type_desc* t = ops.find_type(names[i]);
+        if ( !t ) fail("type not in the registry: " + names[i]);
+        return t;
+    }
+
+    void constant(const type_desc* t) {
+        if ( t == ops.bool_type() ) {
+            if ( byte() > 1 ) fail("bad bool");
+        } else if ( t == ops.int_type() ) {
+            if ( varint() > 0xFFFFFFFFu ) fail("int out of range");
+        } else if ( t == ops.double_type() ) {
+            fixed(8);
+        } else if ( t == ops.string_type() ) {
+            std::uint64_t len = varint();
+            if ( len > n - pos ) fail("string runs past the end of the data");
+            pos += len;
+        } else {
+            fail("constants of type " + t->name + " cannot be read");
+        }
+    }
+
+    /// checks the node after a skip length, & that the length is right
+    const type_desc* skipped_node() {
+        std::size_t at = pos;
+        std::uint64_t skip = fixed(4);
+        const type_desc* t = node();
+        if ( pos - (at + 4) != skip ) {
+            pos = at;
+            fail("bad skip length");
+        }
+        return t;
+    }
+
+    const type_desc* node() {
+        if ( ++depth > max_depth ) fail("tree nested too deeply");
+        std::size_t at = pos;
+        const type_desc* t;
+        switch ( byte() ) {
+        case constant_tag:
+            t = type();
+            constant(t);
+            break;
+        case var_tag: {
+            t = type();
+            const std::string& n = name();
+            if ( !scope ) fail("reading variables needs a var_scope");
+            if ( scope->contains(n) && scope->type(scope->slot(n)) != *t->type ) {
+                fail("variable " + n + " has another type in the scope");
+            }
+            t->declare(*scope, n);
+            break;
+        }
+        case builtin_tag:
+        case logic_tag: {
+            bool logic = data[at] == logic_tag;
+            unsigned char code = byte();
+            if ( code >= unsigned(op::custom) ) fail("bad operator");
+            op o = op(code);
+            const type_desc* a = logic ? ops.bool_type() : type();
+            if ( logic != is_logical(o) || !ops.builtin_applies(o, a) ) {
+                fail(std::string("operator ") + op_name(o) + " does not apply to "
+                     + a->name);
+            }
+            const type_desc* l = node();
+            const type_desc* r = logic ? skipped_node() : node();
+            if ( l != a || r != a ) fail("operand of the wrong type");
+            t = ops.builtin_result(o, a);
+            break;
+        }
+        case custom_tag: {
+            const std::string& n = name();
+            const op_registry::op_desc* c = ops.find_op(n);
+            if ( !c ) fail("operator not in the registry: " + n);
+            const type_desc* l = node();
+            const type_desc* r = node();
+            if ( l != c->left || r != c->right ) {
+                fail("operand of the wrong type for " + n);
+            }
+            t = c->result;
+            break;
+        }
+        case cond_tag: {
+            t = type();
+            const type_desc* c = node();
+            const type_desc* tb = skipped_node();
+            const type_desc* fb = node();
+            if ( c != ops.bool_type() || tb != t || fb != t ) {
+                fail("operand of the wrong type for a conditional");
+            }
+            break;
+        }
+        default:
+            pos = at;
+            fail("bad node tag");
+        }
+        --depth;
+        return t;
+    }
+
+public:
+    /// checks the header of the n bytes of data, which, with the registry
+    /// r & the scope s, must outlive the checker
+    checker(const unsigned char* data, std::size_t n, const op_registry& r,
+            var_scope* s)
+    : ops(r), scope(s), data(data), n(n) {
+        if ( n < 4 || std::memcmp(data, magic, 4) != 0 ) {
+            fail("not an expression file");
+        }
+        pos = 4;
+        std::uint64_t v = varint();
+        if ( v != version ) fail("unsupported version " + std::to_string(v));
+        std::uint64_t n_names = varint();
+        // each name takes at least a byte
+        if ( n_names > n - pos ) fail("bad name table");
+        names.reserve(n_names);
+        for (std::uint64_t i = 0; i < n_names; ++i) names.push_back(string());
+        n_trees = varint();
+    }
+
+    [[noreturn]] void fail(const std::string& what) const {
+        throw decode_error(what, pos);
+    }
+
+    /// checks the tree at pos, moving past it; returns its type
+    const type_desc* tree() { return node(); }
+
+    /// the type with a code below first_named_code
+    static const type_desc* builtin_type(const op_registry& ops,
+                                         std::uint64_t code) {
+        switch ( code ) {
+        case bool_code: return ops.bool_type();
+        case int_code: return ops.int_type();
+        case double_code: return ops.double_type();
+        }
+        return ops.string_type();
+    }
+};
+
+// Reading checked data, without bounds checks
+
+inline std::uint64_t read_varint(const unsigned char*& p) {
+    std::uint64_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char b = *p++;
+        v |= std::uint64_t(b & 0x7F) << shift;
+        if ( !(b & 0x80) ) return v;
+    }
+}
+
+inline std::uint32_t read_u32(const unsigned char*& p) {
+    std::uint32_t v = std::uint32_t(p[0]) | std::uint32_t(p[1]) << 8
+        | std::uint32_t(p[2]) << 16 | std::uint32_t(p[3]) << 24;
+    p += 4;
+    return v;
+}
+
+inline int read_int(const unsigned char*& p) {
+    std::uint32_t z = std::uint32_t(read_varint(p));
+    return int((z >> 1) ^ (0u - (z & 1)));
+}
+
+inline double read_double(const unsigned char*& p) {
+    std::uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i) bits |= std::uint64_t(p[i]) << (8 * i);
+    p += 8;
+    double d;
+    std::memcpy(&d, &bits, 8);
+    return d;
+}
+
+}
+
+/// Reads expression trees from their binary form, in order. Custom
+/// operators & types other than the built-in ones are found by name in
+/// the reader's op_registry, and variables are declared in its var_scope,
+/// so their slots are those of the scope rather than those they were
+/// written with. Each tree is checked in full before any of its nodes are
+/// built; malformed data is reported by throwing a decode_error
+class expr_reader {
+    using type_desc = op_registry::type_desc;
+
+    serial::checker check;
+    std::size_t n_read = 0;
+
+    const type_desc* type(const unsigned char*& p) const {
+        std::uint64_t code = serial::read_varint(p);
+        if ( code < serial::first_named_code ) {
+            return serial::checker::builtin_type(check.ops, code);
+        }
+        return check.ops.find_type(check.names[code - serial::first_named_code]);
+    }
+
+    /// builds the checked node at p, moving past it
+    expr_node* build(const unsigned char*& p) const {
+        const op_registry& ops = check.ops;
+        switch ( *p++ ) {
+        case serial::constant_tag: {
+            const type_desc* t = type(p);
+            if ( t == ops.bool_type() ) return new const_expr<bool>(*p++ != 0);
+            if ( t == ops.int_type() ) return new const_expr<int>(serial::read_int(p));
+            if ( t == ops.double_type() ) {
+                return new const_expr<double>(serial::read_double(p));
+            }
+            std::size_t len = serial::read_varint(p);
+            p += len;
+            return new const_expr<std::string>(
+                std::string(reinterpret_cast<const char*>(p - len), len));
+        }
+        case serial::var_tag: {
+            const type_desc* t = type(p);
+            return t->make_var(*check.scope, check.names[serial::read_varint(p)]);
+        }
+        case serial::builtin_tag:
+        case serial::logic_tag: {
+            bool logic = p[-1] == serial::logic_tag;
+            op o = op(*p++);
+            const type_desc* t = logic ? ops.bool_type() : type(p);
+            std::unique_ptr<expr_node> l{build(p)};
+            if ( logic ) p += 4;
+            std::unique_ptr<expr_node> r{build(p)};
+            return ops.make_builtin(o, t, l.release(), r.release());
+        }
+        case serial::custom_tag: {
+            const op_registry::op_desc* c =
+                ops.find_op(check.names[serial::read_varint(p)]);
+            std::unique_ptr<expr_node> l{build(p)};
+            std::unique_ptr<expr_node> r{build(p)};
+            return c->make(l.release(), r.release());
+        }
+        }
+        const type_desc* t = type(p);
+        std::unique_ptr<expr_node> c{build(p)};
+        p += 4;
+        std::unique_ptr<expr_node> tb{build(p)};
+        std::unique_ptr<expr_node> fb{build(p)};
+        return t->make_if(c.release(), tb.release(), fb.release());
+    }
+
+public:
+    static constexpr std::size_t max_depth = serial::checker::max_depth;
+
+    /// reads the header of the n bytes of data; the data & the registry r
+    /// must outlive the reader. Variables are declared in s, if given
+    expr_reader(const unsigned char* data, std::size_t n,
+                const op_registry& r = op_registry::builtins(),
+                var_scope* s = nullptr)
+    : check(data, n, r, s) {}
+
+    /// the number of trees
+    std::size_t size() const { return check.n_trees; }
+
+    /// have all of the trees been read?
+    bool done() const { return n_read == check.n_trees; }
+
+    /// reads the next tree, which must be of type T; it should be deleted
+    /// by the caller
+    template<typename T>
+    expr<T>* next() {
+        if ( done() ) check.fail("no more trees");
+        std::size_t at = check.pos;
+        const type_desc* t = check.tree();
+        if ( *t->type != typeid(T) ) {
+            check.pos = at;
+            check.fail("expected a tree of type " + std::string(typeid(T).name())
+                       + ", not " + t->name);
+        }
+        if ( ++n_read == check.n_trees && check.pos != check.n ) {
+            check.fail("data after the last tree");
+        }
+        const unsigned char* p = check.data + at;
+        return static_cast<expr<T>*>(build(p));
+    }
+};
+
+/// The binary form of a single tree
+inline std::vector<unsigned char> serialize(
+    const expr_node& e, const op_registry& r = op_registry::builtins()) {
+    expr_writer w(r);
+    w.add(e);
+    return w.finish();
+}
+
+/// Reads a single tree of type T from its binary form; it should be
+/// deleted by the caller
+template<typename T>
+expr<T>* deserialize(const std::vector<unsigned char>& data,
+                     const op_registry& r = op_registry::builtins(),
+                     var_scope* s = nullptr) {
+    expr_reader in(data.data(), data.size(), r, s);
+    if ( in.size() != 1 ) throw decode_error("expected a single tree", 0);
+    return in.next<T>();
+}
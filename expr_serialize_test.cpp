@@ -0,0 +1,189 @@
+#include "expr_parse.hpp"
+#include "expr_serialize.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// A type other than the built-in ones
+struct money {
+    long cents = 0;
+};
+
+bool operator== (const money& a, const money& b) { return a.cents == b.cents; }
+
+std::ostream& operator<< (std::ostream& out, const money& m) {
+    return out << m.cents << "c";
+}
+
+/// the printed form of e
+std::string text(const expr_node& e) {
+    std::ostringstream out;
+    e.print(out);
+    return out.str();
+}
+
+/// checks that source, parsed as a T, reads back as an equal tree
+template<typename T>
+void round_trip(const expr_parser& p, const op_registry& ops, var_scope& scope,
+                const std::string& source) {
+    std::unique_ptr<expr<T>> e{p.parse<T>(source)};
+    std::vector<unsigned char> data = serialize(*e, ops);
+    std::cout << text(*e) << ": " << data.size() << " bytes" << std::endl;
+    std::unique_ptr<expr<T>> back{deserialize<T>(data, ops, &scope)};
+    assert(back->equals(*e));
+    assert(text(*back) == text(*e));
+}
+
+/// checks that reading data fails with a decode_error
+template<typename T>
+void check_error(const std::vector<unsigned char>& data, const op_registry& ops,
+                 var_scope* scope = nullptr) {
+    try {
+        delete deserialize<T>(data, ops, scope);
+        assert(!"expected a decode error");
+    } catch (const decode_error& e) {
+        std::cout << e.what() << std::endl;
+        assert(e.offset <= data.size());
+    }
+}
+
+int main() {
+    var_scope scope;
+    scope.declare<int>("x");
+    scope.declare<double>("w");
+    scope.declare<bool>("flag");
+    scope.declare<std::string>("who");
+    op_registry ops;
+    ops.define_op<int, int, int>("mult", mult);
+    ops.define_type<money>("money");
+    ops.define_op<money, money, int>(
+        "times", [](money m, int n) { return money{m.cents * n}; });
+    ops.define_op<bool, money, money>(
+        "above", [](money a, money b) { return a.cents > b.cents; }, 4);
+    expr_parser p(ops, &scope);
+
+    // trees read back equal to those written, of every kind of node
+    round_trip<std::string>(
+        p, ops, scope,
+        "if (8 mult 5 == 40) \"corr\" + \"ect\" else \"incorrect\"");
+    round_trip<int>(p, ops, scope, "if flag x mult -7 else -123456789");
+    round_trip<bool>(p, ops, scope,
+                     "w * 0.1 > -1.5e300 && who != \"\" || flag == false");
+    round_trip<std::string>(p, ops, scope, "\"\\\"quoted\\\"\\n\" + who");
+
+    // variables are rebound by name, into the reader's scope
+    std::unique_ptr<expr<int>> sum{p.parse<int>("x + x * 2")};
+    std::vector<unsigned char> data = serialize(*sum, ops);
+    var_scope other;
+    other.declare<double>("unrelated");
+    std::unique_ptr<expr<int>> rebound{deserialize<int>(data, ops, &other)};
+    assert(other.slot("x") == 1);
+    env vars = other.make_env();
+    vars.set(other.slot("x"), 5);
+    assert(rebound->eval(vars) == 15);
+
+    // custom operators are found by name, as are custom types
+    ops.define_op<money, int, int>(
+        "cents", [](int a, int b) { return money{a * 100L + b}; });
+    std::unique_ptr<expr<bool>> rich{
+        p.parse<bool>("(x cents 50) times 3 above (10 cents 0)")};
+    data = serialize(*rich, ops);
+    std::unique_ptr<expr<bool>> again{deserialize<bool>(data, ops, &other)};
+    vars.set(other.slot("x"), 3);
+    assert(again->eval(vars));
+    vars.set(other.slot("x"), 2);
+    assert(!again->eval(vars));
+
+    // lists of trees share their names
+    expr_writer w(ops);
+    auto rules = p.parse_list<int>("x mult 2; x mult x; if flag x else 0;");
+    for (auto& r : rules) w.add(*r);
+    std::vector<unsigned char> list = w.finish();
+    std::size_t one = serialize(*rules[0], ops).size();
+    assert(list.size() < 3 * one);
+    expr_reader in(list.data(), list.size(), ops, &scope);
+    assert(in.size() == 3);
+    for (auto& r : rules) {
+        std::unique_ptr<expr<int>> back{in.next<int>()};
+        assert(back->equals(*r));
+    }
+    assert(in.done());
+
+    // trees that cannot be written are refused, leaving the writer as it was
+    try {
+        w.add(const_expr<money>(money{5}));
+        assert(!"expected an error");
+    } catch (const std::invalid_argument& e) {
+        std::cout << e.what() << std::endl;
+    }
+    assert(w.size() == 3 && w.finish() == list);
+    op_registry bare;
+    try {
+        serialize(*rules[0], bare);
+        assert(!"expected an error");
+    } catch (const std::invalid_argument&) {}
+
+    // as are built-in operators on operands the reader would refuse them
+    // for: < on bools, and comparisons of different types
+    bin_op_expr<bool, bool, bool> bool_less = {
+        op::lt, new const_expr<bool>(true), new const_expr<bool>(false)
+    };
+    bin_op_expr<bool, int, double> mixed_less = {
+        op::lt, new const_expr<int>(1), new const_expr<double>(2.5)
+    };
+    for (const expr_node* e : { static_cast<const expr_node*>(&bool_less),
+                                static_cast<const expr_node*>(&mixed_less) }) {
+        try {
+            w.add(*e);
+            assert(!"expected an error");
+        } catch (const std::invalid_argument& ex) {
+            std::cout << ex.what() << std::endl;
+        }
+        assert(w.size() == 3 && w.finish() == list);
+    }
+
+    // malformed data is reported, not trusted
+    data = serialize(*rich, ops);
+    check_error<bool>(data, bare, &scope);
+    check_error<bool>(data, ops);
+    check_error<int>(data, ops, &scope);
+    check_error<bool>({}, ops, &scope);
+    std::vector<unsigned char> future = data;
+    future[4] = 2;
+    check_error<bool>(future, ops, &scope);
+    for (std::size_t n = 0; n < data.size(); ++n) {
+        std::vector<unsigned char> cut(data.begin(), data.begin() + n);
+        check_error<bool>(cut, ops, &scope);
+    }
+    std::vector<unsigned char> longer = data;
+    longer.push_back(0);
+    check_error<bool>(longer, ops, &scope);
+    // a variable whose type differs in the reader's scope
+    var_scope clash;
+    clash.declare<double>("x");
+    check_error<bool>(data, ops, &clash);
+
+    // flipping any byte either reads a valid tree or fails cleanly
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        for (int bit = 0; bit < 8; ++bit) {
+            std::vector<unsigned char> bad = data;
+            bad[i] ^= 1 << bit;
+            var_scope s;
+            try {
+                delete deserialize<bool>(bad, ops, &s);
+            } catch (const decode_error&) {}
+        }
+    }
+
+    // deep trees are an error, not a crash
+    std::vector<unsigned char> deep = {'E', 'X', 'P', 'R', 1, 0, 1};
+    deep.insert(deep.end(), 3 * expr_reader::max_depth, serial::builtin_tag);
+    check_error<int>(deep, ops);
+}
@@ -0,0 +1,427 @@
+#pragma once
+
+// vector kernels for the built-in operators in batch evaluation
+
+#include "expr_ops.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Vector kernels are built for x86 with GCC & Clang, each compiled for its
+// instruction set with a target attribute, so the rest of the program needs
+// no special flags; the widest set the CPU supports is chosen at runtime.
+// Define EXPR_SIMD to 0 to only use the scalar loops.
+#ifndef EXPR_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXPR_SIMD 1
+#else
+#define EXPR_SIMD 0
+#endif
+#endif
+
+#if EXPR_SIMD
+#include <immintrin.h>
+#define EXPR_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define EXPR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/// The instruction sets the batch kernels can use, narrowest first
+enum class simd_level { scalar, sse41, avx2 };
+
+/// the widest instruction set the CPU supports
+inline simd_level detect_simd() {
+#if EXPR_SIMD
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) return simd_level::avx2;
+    if ( __builtin_cpu_supports("sse4.1") ) return simd_level::sse41;
+#endif
+    return simd_level::scalar;
+}
+
+/// The instruction set the batch kernels use; starts as the widest the
+/// CPU supports
+inline simd_level& simd_setting() {
+    static simd_level level = detect_simd();
+    return level;
+}
+
+/// the instruction set the batch kernels use
+inline simd_level simd() { return simd_setting(); }
+
+/// limits the batch kernels to level, or the widest instruction set the
+/// CPU supports if that is narrower; for testing & benchmarking, and must
+/// not be called during evaluation
+inline void set_simd_level(simd_level level) {
+    simd_level cpu = detect_simd();
+    simd_setting() = level < cpu ? level : cpu;
+}
+
+/// The name of an instruction set
+inline const char* simd_name(simd_level level) {
+    switch ( level ) {
+    case simd_level::scalar: return "scalar";
+    case simd_level::sse41: return "sse4.1";
+    case simd_level::avx2: return "avx2";
+    }
+    return "?";
+}
+
+#if EXPR_SIMD
+/// The bools for each bit of a byte-sized comparison mask,
+/// lowest bit first, packed into 8 bytes
+struct simd_mask_table {
+    std::uint64_t bytes[256];
+
+    constexpr simd_mask_table() : bytes() {
+        for (int m = 0; m < 256; ++m) {
+            for (int i = 0; i < 8; ++i) {
+                if ( m & (1 << i) ) bytes[m] |= std::uint64_t(1) << (8 * i);
+            }
+        }
+    }
+};
+
+/// stores the low k bits of a comparison mask as k bools
+inline void store_mask(int mask, std::size_t k, bool* out) {
+    static constexpr simd_mask_table table;
+    std::memcpy(out, &table.bytes[mask], k);
+}
+
+// Each kernel runs its vector loop over as much of the input as it can, and
+// returns the index of the first element it left for the scalar loop
+
+#define EXPR_SIMD_MAP(W, T, load, store, f) \
+    for (; i + W <= n; i += W) { \
+        auto x = load(reinterpret_cast<const T*>(a + i)); \
+        auto y = load(reinterpret_cast<const T*>(b + i)); \
+        store(reinterpret_cast<T*>(out + i), f(x, y)); \
+    } \
+    break;
+
+#define EXPR_SIMD_CMP(W, load, cmp, movemask, invert) \
+    for (; i + W <= n; i += W) { \
+        auto x = load(a + i); \
+        auto y = load(b + i); \
+        int m = movemask(cmp); \
+        store_mask(invert ? ~m & ((1 << W) - 1) : m, W, out + i); \
+    } \
+    break;
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_arith(op o, const int* a, const int* b, std::size_t n,
+                              int* out) {
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::add: EXPR_SIMD_MAP(8, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_add_epi32)
+    case op::sub: EXPR_SIMD_MAP(8, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_sub_epi32)
+    case op::mul: EXPR_SIMD_MAP(8, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_mullo_epi32)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_arith(op o, const double* a, const double* b,
+                              std::size_t n, double* out) {
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::add: EXPR_SIMD_MAP(4, double, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd)
+    case op::sub: EXPR_SIMD_MAP(4, double, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd)
+    case op::mul: EXPR_SIMD_MAP(4, double, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd)
+    case op::div: EXPR_SIMD_MAP(4, double, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_AVX2
+inline __m256i avx2_load_i(const int* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+EXPR_TARGET_AVX2
+inline int avx2_mask_i(__m256i v) {
+    return _mm256_movemask_ps(_mm256_castsi256_ps(v));
+}
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_compare(op o, const int* a, const int* b,
+                                std::size_t n, bool* out) {
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::eq: EXPR_SIMD_CMP(8, avx2_load_i, _mm256_cmpeq_epi32(x, y), avx2_mask_i, false)
+    case op::ne: EXPR_SIMD_CMP(8, avx2_load_i, _mm256_cmpeq_epi32(x, y), avx2_mask_i, true)
+    case op::lt: EXPR_SIMD_CMP(8, avx2_load_i, _mm256_cmpgt_epi32(y, x), avx2_mask_i, false)
+    case op::le: EXPR_SIMD_CMP(8, avx2_load_i, _mm256_cmpgt_epi32(x, y), avx2_mask_i, true)
+    case op::gt: EXPR_SIMD_CMP(8, avx2_load_i, _mm256_cmpgt_epi32(x, y), avx2_mask_i, false)
+    case op::ge: EXPR_SIMD_CMP(8, avx2_load_i, _mm256_cmpgt_epi32(y, x), avx2_mask_i, true)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_compare(op o, const double* a, const double* b,
+                                std::size_t n, bool* out) {
+    // ordered comparisons are false & != is true if either side is NaN,
+    // as in C++
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::eq: EXPR_SIMD_CMP(4, _mm256_loadu_pd, _mm256_cmp_pd(x, y, _CMP_EQ_OQ), _mm256_movemask_pd, false)
+    case op::ne: EXPR_SIMD_CMP(4, _mm256_loadu_pd, _mm256_cmp_pd(x, y, _CMP_NEQ_UQ), _mm256_movemask_pd, false)
+    case op::lt: EXPR_SIMD_CMP(4, _mm256_loadu_pd, _mm256_cmp_pd(x, y, _CMP_LT_OQ), _mm256_movemask_pd, false)
+    case op::le: EXPR_SIMD_CMP(4, _mm256_loadu_pd, _mm256_cmp_pd(x, y, _CMP_LE_OQ), _mm256_movemask_pd, false)
+    case op::gt: EXPR_SIMD_CMP(4, _mm256_loadu_pd, _mm256_cmp_pd(x, y, _CMP_GT_OQ), _mm256_movemask_pd, false)
+    case op::ge: EXPR_SIMD_CMP(4, _mm256_loadu_pd, _mm256_cmp_pd(x, y, _CMP_GE_OQ), _mm256_movemask_pd, false)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_compare(op o, const bool* a, const bool* b,
+                                std::size_t n, bool* out) {
+    // bools are the bytes 0 & 1, so a != b is a ^ b
+    if ( o != op::eq && o != op::ne ) return 0;
+    __m256i flip = _mm256_set1_epi8(o == op::eq ? 1 : 0);
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+            _mm256_xor_si256(_mm256_xor_si256(x, y), flip));
+    }
+    return i;
+}
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_select(const bool* c, const int* t, const int* f,
+                               std::size_t n, int* out) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // loadl rather than cvtsi64, which 32-bit x86 lacks
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(c + i));
+        __m256i mask = _mm256_sub_epi32(_mm256_setzero_si256(),
+            _mm256_cvtepu8_epi32(bytes));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+            _mm256_blendv_epi8(avx2_load_i(f + i), avx2_load_i(t + i), mask));
+    }
+    return i;
+}
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_select(const bool* c, const double* t,
+                               const double* f, std::size_t n, double* out) {
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int bytes;
+        std::memcpy(&bytes, c + i, 4);
+        __m256i mask = _mm256_sub_epi64(_mm256_setzero_si256(),
+            _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes)));
+        _mm256_storeu_pd(out + i, _mm256_blendv_pd(_mm256_loadu_pd(f + i),
+            _mm256_loadu_pd(t + i), _mm256_castsi256_pd(mask)));
+    }
+    return i;
+}
+
+EXPR_TARGET_AVX2
+inline std::size_t avx2_select(const bool* c, const bool* t, const bool* f,
+                               std::size_t n, bool* out) {
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i cv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + i));
+        __m256i tv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(t + i));
+        __m256i fv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f + i));
+        __m256i unset = _mm256_cmpeq_epi8(cv, _mm256_setzero_si256());
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+            _mm256_blendv_epi8(tv, fv, unset));
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_arith(op o, const int* a, const int* b, std::size_t n,
+                               int* out) {
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::add: EXPR_SIMD_MAP(4, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_add_epi32)
+    case op::sub: EXPR_SIMD_MAP(4, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_sub_epi32)
+    case op::mul: EXPR_SIMD_MAP(4, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_mullo_epi32)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_arith(op o, const double* a, const double* b,
+                               std::size_t n, double* out) {
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::add: EXPR_SIMD_MAP(2, double, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd)
+    case op::sub: EXPR_SIMD_MAP(2, double, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd)
+    case op::mul: EXPR_SIMD_MAP(2, double, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd)
+    case op::div: EXPR_SIMD_MAP(2, double, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline __m128i sse41_load_i(const int* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+EXPR_TARGET_SSE41
+inline int sse41_mask_i(__m128i v) {
+    return _mm_movemask_ps(_mm_castsi128_ps(v));
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_compare(op o, const int* a, const int* b,
+                                 std::size_t n, bool* out) {
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::eq: EXPR_SIMD_CMP(4, sse41_load_i, _mm_cmpeq_epi32(x, y), sse41_mask_i, false)
+    case op::ne: EXPR_SIMD_CMP(4, sse41_load_i, _mm_cmpeq_epi32(x, y), sse41_mask_i, true)
+    case op::lt: EXPR_SIMD_CMP(4, sse41_load_i, _mm_cmplt_epi32(x, y), sse41_mask_i, false)
+    case op::le: EXPR_SIMD_CMP(4, sse41_load_i, _mm_cmpgt_epi32(x, y), sse41_mask_i, true)
+    case op::gt: EXPR_SIMD_CMP(4, sse41_load_i, _mm_cmpgt_epi32(x, y), sse41_mask_i, false)
+    case op::ge: EXPR_SIMD_CMP(4, sse41_load_i, _mm_cmplt_epi32(x, y), sse41_mask_i, true)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_compare(op o, const double* a, const double* b,
+                                 std::size_t n, bool* out) {
+    std::size_t i = 0;
+    switch ( o ) {
+    case op::eq: EXPR_SIMD_CMP(2, _mm_loadu_pd, _mm_cmpeq_pd(x, y), _mm_movemask_pd, false)
+    case op::ne: EXPR_SIMD_CMP(2, _mm_loadu_pd, _mm_cmpneq_pd(x, y), _mm_movemask_pd, false)
+    case op::lt: EXPR_SIMD_CMP(2, _mm_loadu_pd, _mm_cmplt_pd(x, y), _mm_movemask_pd, false)
+    case op::le: EXPR_SIMD_CMP(2, _mm_loadu_pd, _mm_cmple_pd(x, y), _mm_movemask_pd, false)
+    case op::gt: EXPR_SIMD_CMP(2, _mm_loadu_pd, _mm_cmpgt_pd(x, y), _mm_movemask_pd, false)
+    case op::ge: EXPR_SIMD_CMP(2, _mm_loadu_pd, _mm_cmpge_pd(x, y), _mm_movemask_pd, false)
+    default: break;
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_compare(op o, const bool* a, const bool* b,
+                                 std::size_t n, bool* out) {
+    if ( o != op::eq && o != op::ne ) return 0;
+    __m128i flip = _mm_set1_epi8(o == op::eq ? 1 : 0);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+            _mm_xor_si128(_mm_xor_si128(x, y), flip));
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_select(const bool* c, const int* t, const int* f,
+                                std::size_t n, int* out) {
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int bytes;
+        std::memcpy(&bytes, c + i, 4);
+        __m128i mask = _mm_sub_epi32(_mm_setzero_si128(),
+            _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+            _mm_blendv_epi8(sse41_load_i(f + i), sse41_load_i(t + i), mask));
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_select(const bool* c, const double* t,
+                                const double* f, std::size_t n, double* out) {
+    std::size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        short bytes;
+        std::memcpy(&bytes, c + i, 2);
+        __m128i mask = _mm_sub_epi64(_mm_setzero_si128(),
+            _mm_cvtepu8_epi64(_mm_cvtsi32_si128(bytes)));
+        _mm_storeu_pd(out + i, _mm_blendv_pd(_mm_loadu_pd(f + i),
+            _mm_loadu_pd(t + i), _mm_castsi128_pd(mask)));
+    }
+    return i;
+}
+
+EXPR_TARGET_SSE41
+inline std::size_t sse41_select(const bool* c, const bool* t, const bool* f,
+                                std::size_t n, bool* out) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i cv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + i));
+        __m128i tv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t + i));
+        __m128i fv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f + i));
+        __m128i unset = _mm_cmpeq_epi8(cv, _mm_setzero_si128());
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+            _mm_blendv_epi8(tv, fv, unset));
+    }
+    return i;
+}
+
+#undef EXPR_SIMD_MAP
+#undef EXPR_SIMD_CMP
+
+/// Is T one of the types the kernels handle?
+template<typename T>
+constexpr bool simd_type = std::is_same_v<T, int> || std::is_same_v<T, double>
+    || std::is_same_v<T, bool>;
+#endif
+
+/// Applies the built-in operator o to n pairs of operands, with vector
+/// kernels for the arithmetic & comparison operators on int, double &
+/// bool, and scalar loops for the rest
+template<typename T, typename A, typename B>
+void apply_op_block(op o, const A* a, const B* b, std::size_t n, T* out) {
+    std::size_t i = 0;
+#if EXPR_SIMD
+    if constexpr ( std::is_same_v<A, B> && simd_type<A> ) {
+        simd_level level = simd();
+        if constexpr ( std::is_same_v<T, bool> ) {
+            if ( is_comparison(o) && level == simd_level::avx2 ) {
+                i = avx2_compare(o, a, b, n, out);
+            } else if ( is_comparison(o) && level == simd_level::sse41 ) {
+                i = sse41_compare(o, a, b, n, out);
+            }
+        }
+        if constexpr ( std::is_same_v<T, A> && !std::is_same_v<T, bool> ) {
+            if ( level == simd_level::avx2 ) {
+                i = avx2_arith(o, a, b, n, out);
+            } else if ( level == simd_level::sse41 ) {
+                i = sse41_arith(o, a, b, n, out);
+            }
+        }
+    }
+#endif
+    apply_op_n<T, A, B>(o, a + i, b + i, n - i, out + i);
+}
+
+/// Selects out[i] = c[i] ? t[i] : f[i] without branching, with vector
+/// kernels for int, double & bool; out may be t or f
+template<typename T>
+void select_block(const bool* c, const T* t, const T* f, std::size_t n,
+                  T* out) {
+    std::size_t i = 0;
+#if EXPR_SIMD
+    if constexpr ( simd_type<T> ) {
+        simd_level level = simd();
+        if ( level == simd_level::avx2 ) {
+            i = avx2_select(c, t, f, n, out);
+        } else if ( level == simd_level::sse41 ) {
+            i = sse41_select(c, t, f, n, out);
+        }
+    }
+#endif
+    for (; i < n; ++i) out[i] = c[i] ? t[i] : f[i];
+}
@@ -0,0 +1,175 @@
+#include "expr.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+/// the operators with vector kernels
+const op ops[] = { 
+    op::add, op::sub, op::mul, op::div, 
+    op::eq, op::ne, op::lt, op::le, op::gt, op::ge 
+};
+
+/// checks the kernels for operands of type A against the scalar loops, on
+/// every length up to the size of the inputs so each tail is covered
+template<typename A>
+void check_kernels(const std::vector<A>& a, const std::vector<A>& b) {
+    for (op o : ops) {
+        std::size_t n = a.size();
+        if ( is_comparison(o) ) {
+            if constexpr ( op_applies<op::lt, bool, A, A> ) {
+                std::unique_ptr<bool[]> want{new bool[n]}, got{new bool[n]};
+                for (std::size_t m = 0; m <= n; ++m) {
+                    apply_op_n<bool, A, A>(o, a.data(), b.data(), m, want.get());
+                    apply_op_block<bool, A, A>(o, a.data(), b.data(), m, got.get());
+                    assert(std::memcmp(want.get(), got.get(), m) == 0);
+                }
+            }
+        } else if constexpr ( !std::is_same_v<A, bool> ) {
+            // integer division is left to the scalar loop, which traps on 
+            // zero like eval() does, so it isn't run here
+            if ( o == op::div && !std::is_floating_point_v<A> ) continue;
+            std::vector<A> want(n), got(n);
+            for (std::size_t m = 0; m <= n; ++m) {
+                apply_op_n<A, A, A>(o, a.data(), b.data(), m, want.data());
+                apply_op_block<A, A, A>(o, a.data(), b.data(), m, got.data());
+                assert(std::memcmp(want.data(), got.data(), m * sizeof(A)) == 0);
+            }
+        }
+    }
+}
+
+/// checks the blend kernel for values of type T against a scalar loop
+template<typename T>
+void check_select(const std::vector<T>& t, const std::vector<T>& f,
+                  const bool* c) {
+    std::size_t n = t.size();
+    std::unique_ptr<T[]> got{new T[n]};
+    for (std::size_t m = 0; m <= n; ++m) {
+        select_block(c, t.data(), f.data(), m, got.get());
+        for (std::size_t i = 0; i < m; ++i) {
+            assert(std::memcmp(&got[i], c[i] ? &t[i] : &f[i], sizeof(T)) == 0);
+        }
+    }
+}
+
+int main() {
+    const std::size_t n = 75;
+    const int int_min = std::numeric_limits<int>::min();
+    const int int_max = std::numeric_limits<int>::max();
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    std::vector<int> ia(n), ib(n);
+    std::vector<double> da(n), db(n);
+    std::unique_ptr<bool[]> ba{new bool[n]}, bb{new bool[n]};
+    for (std::size_t i = 0; i < n; ++i) {
+        ia[i] = int(i * 37 % 23) - 11;
+        ib[i] = int(i * 11 % 19) - 9;
+        da[i] = ia[i] / 4.0;
+        db[i] = ib[i] / 4.0;
+        ba[i] = i % 3 == 0;
+        bb[i] = i % 5 < 2;
+    }
+    // extremes (paired so the scalar loop doesn't overflow) & NaN, which 
+    // compares false with everything but !=
+    ia[3] = int_min;
+    ib[3] = 0;
+    ia[7] = 0;
+    ib[7] = int_max;
+    da[5] = nan;
+    db[9] = nan;
+    da[10] = db[10] = nan;
+    da[11] = -0.0;
+    db[11] = 0.0;
+
+    const simd_level levels[] = { 
+        simd_level::scalar, simd_level::sse41, simd_level::avx2 
+    };
+    std::cout << "cpu supports " << simd_name(detect_simd()) << std::endl;
+    for (simd_level level : levels) {
+        if ( level > detect_simd() ) continue;
+        set_simd_level(level);
+        std::cout << "checking " << simd_name(simd()) << " kernels" << std::endl;
+        check_kernels(ia, ib);
+        check_kernels(da, db);
+
+        // bool arrays, since std::vector<bool> isn't one
+        for (op o : { op::eq, op::ne }) {
+            bool want[n], got[n];
+            for (std::size_t m = 0; m <= n; ++m) {
+                apply_op_n<bool, bool, bool>(o, ba.get(), bb.get(), m, want);
+                apply_op_block<bool, bool, bool>(o, ba.get(), bb.get(), m, got);
+                assert(std::memcmp(want, got, m) == 0);
+            }
+        }
+
+        check_select(ia, ib, ba.get());
+        check_select(da, db, ba.get());
+        bool picked[n];
+        select_block(ba.get(), ba.get(), bb.get(), n, picked);
+        for (std::size_t i = 0; i < n; ++i) {
+            assert(picked[i] == (ba[i] ? ba[i] : bb[i]));
+        }
+    }
+    set_simd_level(detect_simd());
+
+    // blended conditionals agree with eval(); the integer division is only
+    // safe on the rows the condition selects, so that one isn't blended
+    var_scope scope;
+    auto x = scope.var<int>("x");
+    auto y = scope.var<int>("y");
+    auto w = scope.var<double>("w");
+    columns cols = scope.make_columns();
+    cols.set(x->slot(), ia.data());
+    cols.set(y->slot(), ib.data());
+    cols.set(w->slot(), da.data());
+
+    if_expr<double> blended = {
+        new bin_op_expr<bool, int, int>(op::lt, x->clone(), y->clone()),
+        new bin_op_expr<double, double, double>(
+            op::mul, w->clone(), new const_expr<double>(2.0)),
+        new bin_op_expr<double, double, double>(
+            op::div, new const_expr<double>(1.0), w)
+    };
+    if_expr<int> guarded = {
+        new bin_op_expr<bool, int, int>(op::ne, y->clone(), new const_expr<int>(0)),
+        new bin_op_expr<int, int, int>(op::div, x, y->clone()),
+        new bin_op_expr<int, int, int>(op::add, y, new const_expr<int>(1))
+    };
+
+    std::vector<double> dout(n);
+    std::vector<int> iout(n);
+    blended.eval_batch(cols, n, dout.data());
+    guarded.eval_batch(cols, n, iout.data());
+    env row = scope.make_env();
+    for (std::size_t i = 0; i < n; ++i) {
+        row.set(scope.slot("x"), ia[i]);
+        row.set(scope.slot("y"), ib[i]);
+        row.set(scope.slot("w"), da[i]);
+        double d = blended.eval(row);
+        assert(std::memcmp(&dout[i], &d, sizeof d) == 0);
+        assert(iout[i] == guarded.eval(row));
+    }
+    std::cout << blended << "\n" << guarded << std::endl;
+
+    // nor is integer arithmetic, which would overflow on the rows where
+    // the condition keeps it from being evaluated
+    var_scope capped_scope;
+    auto c = capped_scope.var<int>("c");
+    if_expr<int> capped = {
+        new bin_op_expr<bool, int, int>(
+            op::lt, c->clone(), new const_expr<int>(int_max)),
+        new bin_op_expr<int, int, int>(op::add, c->clone(), new const_expr<int>(1)),
+        c
+    };
+    const int cs[] = { int_max, 0, -5, int_max - 1, int_max };
+    columns capped_cols = capped_scope.make_columns();
+    capped_cols.set(capped_scope.slot("c"), cs);
+    int capped_out[5];
+    capped.eval_batch(capped_cols, 5, capped_out);
+    for (std::size_t i = 0; i < 5; ++i) {
+        assert(capped_out[i] == (cs[i] < int_max ? cs[i] + 1 : cs[i]));
+    }
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+// compile-time expression templates for statically known expressions
+
+#include "expr.hpp"
+
+#include <string>
+#include <type_traits>
+#include <utility>
+
+/// Expressions whose shape is known at compile time, built as nested
+/// values whose types record the whole tree. They mirror const_expr,
+/// bin_op_expr & if_expr, but need no allocation or virtual calls, and can
+/// be evaluated in constexpr contexts, e.g.
+///
+///     constexpr auto e = cx::if_(cx::lit(2) + cx::lit(2) == cx::lit(4),
+///                                cx::lit(1), cx::lit(0));
+///     static_assert(e.eval() == 1);
+///
+/// to_expr() converts one to an ordinary expression tree for printing or
+/// storage
+namespace cx {
+
+/// A constant of type T
+template<typename T>
+struct lit_t {
+    using value_type = T;
+
+    T value;
+
+    constexpr T eval() const { return value; }
+};
+
+/// Does the built-in operator O apply to compile-time expressions L & R,
+/// as it does to the operands of a bin_op_expr? (See op_applies)
+template<op O, typename L, typename R, typename = void>
+struct applies : std::false_type {};
+template<op O, typename L, typename R>
+struct applies<O, L, R, std::void_t<decltype(op_fn<O>{}(
+        std::declval<typename L::value_type>(),
+        std::declval<typename R::value_type>()))>>
+    : std::bool_constant<op_applies<O,
+        std::decay_t<decltype(op_fn<O>{}(
+            std::declval<typename L::value_type>(),
+            std::declval<typename R::value_type>()))>,
+        typename L::value_type, typename R::value_type>> {};
+
+/// The built-in binary operator O applied to L & R
+template<op O, typename L, typename R>
+struct bin_t {
+    static_assert(applies<O, L, R>::value,
+        "the operator does not apply to these operand types");
+
+    using value_type = std::decay_t<decltype(op_fn<O>{}(
+        std::declval<typename L::value_type>(),
+        std::declval<typename R::value_type>()))>;
+
+    L left;
+    R right;
+
+    constexpr value_type eval() const {
+        // && and || only evaluate their right operand if the left one
+        // doesn't decide the result
+        if constexpr ( O == op::land ) {
+            return left.eval() && right.eval();
+        } else if constexpr ( O == op::lor ) {
+            return left.eval() || right.eval();
+        } else {
+            return op_fn<O>{}(left.eval(), right.eval());
+        }
+    }
+};
+
+/// A conditional; only the branch selected by the condition is evaluated
+template<typename C, typename T, typename F>
+struct if_t {
+    static_assert(std::is_same_v<typename C::value_type, bool>,
+        "the condition must be a bool");
+    static_assert(std::is_same_v<typename T::value_type, typename F::value_type>,
+        "the branches must have the same type");
+
+    using value_type = typename T::value_type;
+
+    C cond;
+    T true_branch;
+    F false_branch;
+
+    constexpr value_type eval() const {
+        return cond.eval() ? true_branch.eval() : false_branch.eval();
+    }
+};
+
+/// Is E a compile-time expression?
+template<typename E>
+struct is_cx : std::false_type {};
+template<typename T>
+struct is_cx<lit_t<T>> : std::true_type {};
+template<op O, typename L, typename R>
+struct is_cx<bin_t<O, L, R>> : std::true_type {};
+template<typename C, typename T, typename F>
+struct is_cx<if_t<C, T, F>> : std::true_type {};
+
+/// the constant v
+template<typename T>
+constexpr lit_t<T> lit(T v) { return lit_t<T>{v}; }
+
+/// the string constant s; strings are not literal types, so these can
+/// only be evaluated at runtime
+inline lit_t<std::string> lit(const char* s) { return lit_t<std::string>{s}; }
+
+/// the conditional `if c then t else f`
+template<typename C, typename T, typename F,
+         typename = std::enable_if_t<is_cx<C>::value && is_cx<T>::value
+                                     && is_cx<F>::value>>
+constexpr if_t<C, T, F> if_(C c, T t, F f) {
+    return if_t<C, T, F>{c, t, f};
+}
+
+// operators are only defined on operands they apply to, so trees that
+// to_expr() could not convert do not compile
+#define EXPR_CX_OP(code, sym) \
+    template<typename L, typename R, \
+             typename = std::enable_if_t<std::conjunction_v< \
+                 is_cx<L>, is_cx<R>, applies<op::code, L, R>>>> \
+    constexpr bin_t<op::code, L, R> operator sym (L l, R r) { \
+        return bin_t<op::code, L, R>{l, r}; \
+    }
+EXPR_CX_OP(add, +)
+EXPR_CX_OP(sub, -)
+EXPR_CX_OP(mul, *)
+EXPR_CX_OP(div, /)
+EXPR_CX_OP(mod, %)
+EXPR_CX_OP(eq, ==)
+EXPR_CX_OP(ne, !=)
+EXPR_CX_OP(lt, <)
+EXPR_CX_OP(le, <=)
+EXPR_CX_OP(gt, >)
+EXPR_CX_OP(ge, >=)
+EXPR_CX_OP(land, &&)
+EXPR_CX_OP(lor, ||)
+#undef EXPR_CX_OP
+
+template<typename T>
+expr<T>* to_expr(const lit_t<T>& e);
+template<op O, typename L, typename R>
+expr<typename bin_t<O, L, R>::value_type>* to_expr(const bin_t<O, L, R>& e);
+template<typename C, typename T, typename F>
+expr<typename T::value_type>* to_expr(const if_t<C, T, F>& e);
+
+/// Converts a compile-time expression to an expression tree, which should
+/// be deleted by the caller
+template<typename T>
+expr<T>* to_expr(const lit_t<T>& e) {
+    return new const_expr<T>(e.value);
+}
+
+template<op O, typename L, typename R>
+expr<typename bin_t<O, L, R>::value_type>* to_expr(const bin_t<O, L, R>& e) {
+    using T = typename bin_t<O, L, R>::value_type;
+    return new bin_op_expr<T, typename L::value_type, typename R::value_type>(
+        O, to_expr(e.left), to_expr(e.right));
+}
+
+template<typename C, typename T, typename F>
+expr<typename T::value_type>* to_expr(const if_t<C, T, F>& e) {
+    return new if_expr<typename T::value_type>(
+        to_expr(e.cond), to_expr(e.true_branch), to_expr(e.false_branch));
+}
+
+}
@@ -0,0 +1,70 @@
+#include "expr_static.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// the sample rule, evaluated entirely at compile time
+constexpr auto rule = cx::if_(cx::lit(2) + cx::lit(2) == cx::lit(4),
+                              cx::lit(1), cx::lit(0));
+static_assert(rule.eval() == 1, "2 + 2 == 4");
+
+// nodes are held by value, so the whole tree is its five constants, with 
+// no pointers or vtables
+static_assert(sizeof(rule) == 5 * sizeof(int), "nodes are held by value");
+
+// && short-circuits, so the division by zero is never evaluated, which 
+// would make this ill-formed
+constexpr auto guarded = cx::lit(false)
+    && cx::lit(1) / cx::lit(0) == cx::lit(0);
+static_assert(!guarded.eval(), "false && x is false");
+
+// each operator on each inline type
+static_assert((cx::lit(17) % cx::lit(5) * cx::lit(3) - cx::lit(1)).eval() == 5, "");
+static_assert((cx::lit(7.0) / cx::lit(2.0)).eval() == 3.5, "");
+static_assert((cx::lit(1) < cx::lit(2) && cx::lit(2.0) >= cx::lit(2.0)).eval(), "");
+static_assert((cx::lit(true) != cx::lit(false) || cx::lit(3) <= cx::lit(1)).eval(), "");
+static_assert((cx::lit(3) > cx::lit(1)).eval(), "");
+
+/// can L & R be added?
+template<typename L, typename R, typename = void>
+struct can_add : std::false_type {};
+template<typename L, typename R>
+struct can_add<L, R, std::void_t<decltype(std::declval<L>() + std::declval<R>())>>
+    : std::true_type {};
+
+/// can L && R be taken?
+template<typename L, typename R, typename = void>
+struct can_and : std::false_type {};
+template<typename L, typename R>
+struct can_and<L, R, std::void_t<decltype(std::declval<L>() && std::declval<R>())>>
+    : std::true_type {};
+
+// operators apply to the operands the trees' operators do, without C++'s
+// conversions: mixed arithmetic, bool arithmetic & && on ints don't compile
+static_assert(can_add<cx::lit_t<int>, cx::lit_t<int>>::value, "");
+static_assert(!can_add<cx::lit_t<int>, cx::lit_t<double>>::value, "");
+static_assert(!can_add<cx::lit_t<bool>, cx::lit_t<bool>>::value, "");
+static_assert(can_and<cx::lit_t<bool>, cx::lit_t<bool>>::value, "");
+static_assert(!can_and<cx::lit_t<int>, cx::lit_t<int>>::value, "");
+
+int main() {
+    // converted to a tree, the expression prints & evaluates the same way
+    std::unique_ptr<expr<int>> tree{cx::to_expr(rule)};
+    std::cout << *tree << " = " << tree->eval() << std::endl;
+    assert(tree->eval() == rule.eval());
+
+    std::unique_ptr<expr<bool>> guard{cx::to_expr(guarded)};
+    std::cout << *guard << " = " << guard->eval() << std::endl;
+    assert(guard->eval() == guarded.eval());
+
+    // strings can only be evaluated at runtime
+    auto answer = cx::if_(cx::lit(8) * cx::lit(5) == cx::lit(40), 
+                          cx::lit("correct"), cx::lit("incorrect"));
+    std::unique_ptr<expr<std::string>> text{cx::to_expr(answer)};
+    std::cout << *text << " = " << answer.eval() << std::endl;
+    assert(answer.eval() == "correct" && text->eval() == answer.eval());
+}
@@ -4,17 +4,25 @@
 #include <string>
 #include <utility>
 
-/// wrapper function for addition
-int plus(int a, int b) { return a + b; }
-
-/// wrapper function for equality
-bool equals(int a, int b) { return a == b; }
-
 /// wrapper function for multiplication
-bool mult(int a, int b) {return a * b;}
+int mult(int a, int b) {return a * b;}
 
 /// wrapper function for subtraction
-bool sub(int a, int b) {return a - b;}
+int sub(int a, int b) {return a - b;}
+
+// built-in operators only apply with their own result types, so every
+// engine evaluates them alike: && and || on bools alone, comparisons
+// giving bool, and arithmetic giving its operands' type
+static_assert(op_applies<op::land, bool, bool, bool>, "");
+static_assert(!op_applies<op::land, int, int, int>, "");
+static_assert(!op_applies<op::lor, bool, int, int>, "");
+static_assert(op_applies<op::lt, bool, int, int>, "");
+static_assert(!op_applies<op::lt, int, int, int>, "");
+static_assert(op_applies<op::add, std::string, std::string, std::string>, "");
+static_assert(!op_applies<op::add, bool, int, int>, "");
+static_assert(!op_applies<op::add, double, int, int>, "");
+static_assert(!op_applies<op::add, bool, bool, bool>, "");
+static_assert(!op_supported<bool, int, int>(op::add), "");
 
 int main() {
     // constant expressions
@@ -24,10 +32,12 @@ int main() {
     // binary operators
     // note that because the expr nodes take ownership of their 
     // constructor arguments I can create these concisely in-place
+    // built-in operators are named by opcode, arbitrary C++ functions can be 
+    // used by giving the function and its name, as with `mult` below
     auto cond = new bin_op_expr<bool, int, int>(
-        equals, "==",
+        op::eq,
         new bin_op_expr<int, int, int>(
-            plus, "+",
+            op::add,
             two,
             two->clone()
         ),
@@ -59,7 +69,7 @@ int main() {
     auto five = new const_expr<int>(5);
 
     auto my_expr = new bin_op_expr<bool, int, int>(
-        equals, "==",
+        op::eq,
         new bin_op_expr<int, int, int>(
             mult, "*",
             eight,
@@ -77,4 +87,27 @@ int main() {
     std::cout << *my_expr << "\n = " << my_expr->eval() << std::endl;
     std::cout << *my_expr_two << "\n = " << my_expr_two->eval() << std::endl;
     delete my_expr_two;
+
+    // short-circuiting: the division by zero on the right of the && and in 
+    // the untaken branch are never evaluated
+    auto zero = new const_expr<int>(0);
+    if_expr<int> guarded = {
+        new and_expr(
+            new bin_op_expr<bool, int, int>(op::ne, zero, zero->clone()),
+            new bin_op_expr<bool, int, int>(
+                op::gt,
+                new bin_op_expr<int, int, int>(
+                    op::div, new const_expr<int>(10), zero->clone()),
+                new const_expr<int>(1)
+            )
+        ),
+        new bin_op_expr<int, int, int>(
+            op::div, new const_expr<int>(10), zero->clone()),
+        new const_expr<int>(-1)
+    };
+    std::cout << guarded << "\n = " << guarded.eval() << std::endl;
+
+    // copies of a conditional are deep, so each can be destroyed on its own
+    if_expr<int> copy = guarded;
+    std::cout << copy << "\n = " << copy.eval() << std::endl;
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+#pragma once
+
+// sample trees shared by the tests of the compiled engines, which each
+// check that they agree with the tree-walking evaluator on them
+
+#include "expr.hpp"
+
+#include <memory>
+#include <string>
+
+namespace samples {
+
+/// wrapper function for addition
+inline int plus(int a, int b) { return a + b; }
+
+/// wrapper function for equality
+inline bool equals(int a, int b) { return a == b; }
+
+/// wrapper function for multiplication
+inline int times(int a, int b) { return a * b; }
+
+/// wrapper function for string concatenation
+inline std::string concat(std::string a, std::string b) { return a + b; }
+
+/// calls f(e, vars) on each sample tree e, with the variables it reads
+/// in vars: constants, custom operators & boxed values, built-in
+/// operators on each inline type, nested conditionals, and && and ||
+/// guarding operands that would fail if they were evaluated. The variables
+/// are x, y, flag & w, in slots 0 to 3
+template<typename F>
+void for_each(F&& f) {
+    env none;
+    const_expr<int> two(2);
+    f(two, none);
+
+    auto cond = new bin_op_expr<bool, int, int>(
+        equals, "==",
+        new bin_op_expr<int, int, int>(
+            plus, "+", new const_expr<int>(2), new const_expr<int>(2)),
+        new const_expr<int>(4));
+    f(*cond, none);
+
+    if_expr<std::string> root = {
+        cond,
+        new const_expr<std::string>("correct"),
+        new const_expr<std::string>("incorrect")
+    };
+    f(root, none);
+
+    // a false condition, with a nested conditional in the branch taken
+    if_expr<int> nested = {
+        new bin_op_expr<bool, int, int>(
+            equals, "==",
+            new bin_op_expr<int, int, int>(
+                times, "*", new const_expr<int>(8), new const_expr<int>(5)),
+            new const_expr<int>(41)),
+        new const_expr<int>(1),
+        new if_expr<int>(
+            new const_expr<bool>(true),
+            new const_expr<int>(2),
+            new const_expr<int>(3))
+    };
+    f(nested, none);
+
+    // boxed values produced by an operator rather than a constant
+    bin_op_expr<std::string, std::string, std::string> greeting = {
+        concat, "concat",
+        new const_expr<std::string>("hello, "),
+        new const_expr<std::string>("world")
+    };
+    f(greeting, none);
+
+    // built-in operators on each of the inline cell types
+    if_expr<double> builtins = {
+        new bin_op_expr<bool, bool, bool>(
+            op::land,
+            new bin_op_expr<bool, int, int>(
+                op::lt,
+                new bin_op_expr<int, int, int>(
+                    op::mod, new const_expr<int>(17), new const_expr<int>(5)),
+                new const_expr<int>(3)),
+            new bin_op_expr<bool, double, double>(
+                op::ge, new const_expr<double>(2.5), new const_expr<double>(2.5))),
+        new bin_op_expr<double, double, double>(
+            op::div, new const_expr<double>(7.0), new const_expr<double>(2.0)),
+        new const_expr<double>(0.0)
+    };
+    f(builtins, none);
+
+    // a built-in operator on a boxed type
+    bin_op_expr<bool, std::string, std::string> less = {
+        op::lt,
+        new const_expr<std::string>("abc"),
+        new const_expr<std::string>("abd")
+    };
+    f(less, none);
+
+    // short-circuiting: neither division by zero is evaluated
+    if_expr<int> guarded = {
+        new or_expr(
+            new bin_op_expr<bool, int, int>(
+                op::eq, new const_expr<int>(0), new const_expr<int>(0)),
+            new bin_op_expr<bool, int, int>(
+                op::gt,
+                new bin_op_expr<int, int, int>(
+                    op::div, new const_expr<int>(10), new const_expr<int>(0)),
+                new const_expr<int>(1))),
+        new const_expr<int>(-1),
+        new bin_op_expr<int, int, int>(
+            op::div, new const_expr<int>(10), new const_expr<int>(0))
+    };
+    f(guarded, none);
+
+    and_expr both = {
+        new const_expr<bool>(true),
+        new bin_op_expr<bool, bool, bool>(
+            op::land, new const_expr<bool>(true), new const_expr<bool>(false))
+    };
+    f(both, none);
+
+    // variables of each inline type, read more than once, over a range of
+    // values taking each branch. They are declared first, so their slots
+    // don't depend on the order the operands are built in
+    var_scope scope;
+    scope.declare<int>("x");
+    scope.declare<int>("y");
+    scope.declare<bool>("flag");
+    scope.declare<double>("w");
+    if_expr<int> mixed = {
+        new and_expr(
+            new bin_op_expr<bool, int, int>(
+                op::lt,
+                new bin_op_expr<int, int, int>(
+                    op::mod, scope.var<int>("x"), new const_expr<int>(5)),
+                scope.var<int>("y")),
+            new bin_op_expr<bool, bool, bool>(
+                op::ne, scope.var<bool>("flag"), new const_expr<bool>(false))),
+        new bin_op_expr<int, int, int>(
+            times, "*", scope.var<int>("x"), scope.var<int>("y")),
+        new if_expr<int>(
+            new bin_op_expr<bool, double, double>(
+                op::gt, scope.var<double>("w"), new const_expr<double>(1.0)),
+            new bin_op_expr<int, int, int>(
+                op::sub, scope.var<int>("y"), scope.var<int>("x")),
+            new const_expr<int>(0))
+    };
+    env vars = scope.make_env();
+    for (int x = -6; x < 6; ++x) {
+        for (int y : { -1, 2, 4 }) {
+            vars.set(scope.slot("x"), x);
+            vars.set(scope.slot("y"), y);
+            vars.set(scope.slot("flag"), x % 2 == 0);
+            vars.set(scope.slot("w"), x * 0.75);
+            f(mixed, vars);
+        }
+    }
+}
+
+}
@@ -0,0 +1,120 @@
+#define EXPR_PROFILE 1
+
+#include "expr.hpp"
+#include "expr_variant.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// The number of copies made of the memoizing operator
+std::atomic<int> copies{0};
+
+/// Computes a Fibonacci number modulo b, remembering the results: state
+/// that is not safe to share between threads
+struct memo_fib {
+    std::unordered_map<int, int> known;
+
+    memo_fib() = default;
+    memo_fib(const memo_fib& o) : known(o.known) { ++copies; }
+    memo_fib(memo_fib&&) = default;
+
+    int operator() (int n, int b) {
+        if ( n < 2 ) return n;
+        auto it = known.find(n);
+        if ( it != known.end() ) return it->second % b;
+        int v = ((*this)(n - 1, b) + (*this)(n - 2, b)) % 1000007;
+        known[n] = v;
+        return v % b;
+    }
+};
+
+int main() {
+    const int n_threads = 8;
+    const int rounds = 500;
+
+    var_scope scope;
+    std::unique_ptr<expr<std::string>> rule{new if_expr<std::string>(
+        new and_expr(
+            new bin_op_expr<bool, int, int>(
+                op::lt, scope.var<int>("x"), new const_expr<int>(1000)),
+            new bin_op_expr<bool, double, double>(
+                op::ge, scope.var<double>("w"), new const_expr<double>(0.5))),
+        new bin_op_expr<std::string, std::string, std::string>(
+            op::add, new const_expr<std::string>("fib: "),
+            new bin_op_expr<std::string, int, int>(
+                [](int a, int b) { return std::to_string(a + b); }, "show",
+                new bin_op_expr<int, int, int>(
+                    per_thread(memo_fib()), "fib",
+                    scope.var<int>("x"), new const_expr<int>(97)),
+                new const_expr<int>(0))),
+        scope.var<std::string>("who"))};
+    std::unique_ptr<expr<int>> sum{new bin_op_expr<int, int, int>(
+        op::add,
+        new bin_op_expr<int, int, int>(
+            op::mul, scope.var<int>("x"), new const_expr<int>(3)),
+        new if_expr<int>(
+            new bin_op_expr<bool, int, int>(
+                op::eq, new bin_op_expr<int, int, int>(
+                    op::mod, scope.var<int>("x"), new const_expr<int>(2)),
+                new const_expr<int>(0)),
+            new const_expr<int>(1), new const_expr<int>(-1)))};
+    auto closure = sum->compile_closure();
+    auto closed = to_variant(*sum);
+
+    /// the env for input i
+    auto input = [&](int i) {
+        env vars = scope.make_env();
+        vars.set(scope.slot("x"), i % 300);
+        vars.set(scope.slot("w"), (i % 7) / 7.0);
+        vars.set<std::string>(scope.slot("who"), "n" + std::to_string(i % 5));
+        return vars;
+    };
+
+    // the values, computed on one thread
+    std::vector<std::string> want_rule(rounds);
+    std::vector<int> want_sum(rounds);
+    for (int i = 0; i < rounds; ++i) {
+        env vars = input(i);
+        want_rule[i] = rule->eval(vars);
+        want_sum[i] = sum->eval(vars);
+    }
+    rule->reset_profile();
+    sum->reset_profile();
+    copies = 0;
+
+    // every thread evaluates the same trees, with envs of its own & one
+    // shared env, each by every engine
+    env shared = input(42);
+    std::atomic<int> wrong{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&, t]{
+            while ( !go ) std::this_thread::yield();
+            for (int r = 0; r < rounds; ++r) {
+                int i = (r + t * 37) % rounds;
+                env vars = input(i);
+                if ( rule->eval(vars) != want_rule[i] ) ++wrong;
+                if ( sum->eval(vars) != want_sum[i] ) ++wrong;
+                if ( closure.run(vars) != want_sum[i] ) ++wrong;
+                if ( closed.eval(vars) != want_sum[i] ) ++wrong;
+                if ( rule->eval(shared) != want_rule[42] ) ++wrong;
+            }
+        });
+    }
+    go = true;
+    for (std::thread& t : threads) t.join();
+    assert(wrong == 0);
+
+    // each thread had its own copy of the stateful operator
+    assert(copies == n_threads);
+
+    // profiling counted every evaluation by eval(), from every thread
+    assert(rule->profile().count == std::uint64_t(2 * n_threads * rounds));
+    assert(sum->profile().count == std::uint64_t(n_threads * rounds));
+}
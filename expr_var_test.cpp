@@ -0,0 +1,94 @@
+#include "expr_arena.hpp"
+#include "expr_bytecode.hpp"
+#include "expr_cse.hpp"
+#include "expr_hashcons.hpp"
+#include "expr_optimize.hpp"
+#include "expr_regvm.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+
+/// wrapper function for string concatenation
+std::string concat(std::string a, std::string b) { return a + b; }
+
+int main() {
+    // variables get their slots as the tree is built, so evaluation never 
+    // looks them up by name
+    var_scope scope;
+    if_expr<std::string> rule = {
+        new and_expr(
+            new bin_op_expr<bool, int, int>(
+                op::gt, scope.var<int>("age"), new const_expr<int>(17)),
+            new bin_op_expr<bool, std::string, std::string>(
+                op::ne, scope.var<std::string>("name"),
+                new const_expr<std::string>(""))
+        ),
+        new bin_op_expr<std::string, std::string, std::string>(
+            concat, "++", new const_expr<std::string>("hello, "), 
+            scope.var<std::string>("name")),
+        new const_expr<std::string>("denied")
+    };
+    assert(scope.size() == 2);
+    assert(scope.contains("age") && scope.slot("age") != scope.slot("name"));
+    std::cout << rule << std::endl;
+
+    // one compiled program is run against many records, refilling one env
+    auto stack = compile(rule);
+    auto regs = compile_registers(rule);
+    auto memo = compile_cse(rule);
+    env record = scope.make_env();
+    const char* const names[] = { "ann", "", "bob" };
+    for (int age = 0; age < 40; ++age) {
+        record.set(scope.slot("age"), age);
+        record.set(scope.slot("name"), std::string(names[age % 3]));
+        std::string expected = age > 17 && age % 3 != 1 
+            ? "hello, " + std::string(names[age % 3]) : "denied";
+        assert(rule.eval(record) == expected);
+        assert(stack.run(record) == expected);
+        assert(regs.run(record) == expected);
+        assert(memo.run(record) == expected);
+    }
+
+    // a variable read more than once is loaded into one register: there is
+    // one constant, two variables and two temporaries
+    var_scope nums;
+    auto x = nums.var<int>("x");
+    bin_op_expr<int, int, int> square = {
+        op::add,
+        new bin_op_expr<int, int, int>(op::mul, x, x->clone()),
+        new bin_op_expr<int, int, int>(
+            op::mul, nums.var<int>("y"), new const_expr<int>(1))
+    };
+    auto square_regs = compile_registers(square);
+    std::cout << square << "\n" << square_regs;
+    assert(square_regs.registers() == 1 + 2 + 2);
+
+    // the optimizer keeps variables, but still applies identities to them
+    std::unique_ptr<expr<int>> opt{optimize(square)};
+    std::cout << *opt << std::endl;
+    assert(count_nodes(*opt) == 5);
+
+    // the same tree in an arena, and with its squares shared
+    expr_arena arena;
+    expr_arena::node root = arena.copy(square);
+    expr_factory factory;
+    const expr<int>* shared = factory.intern(square);
+    assert(factory.var<int>(nums, "x") == &shared->operand(0).operand(0));
+    auto square_memo = compile_cse(*shared);
+    assert(square_memo.shared() == 1);
+
+    env xy = nums.make_env();
+    for (int i = -50; i < 50; ++i) {
+        xy.set(nums.slot("x"), i);
+        xy.set(nums.slot("y"), 3 * i);
+        int expected = i * i + 3 * i;
+        assert(square.eval(xy) == expected);
+        assert(square_regs.run(xy) == expected);
+        assert(opt->eval(xy) == expected);
+        assert(arena.eval<int>(root, xy) == expected);
+        assert(shared->eval(xy) == expected);
+        assert(square_memo.run(xy) == expected);
+    }
+}
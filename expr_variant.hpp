@@ -0,0 +1,273 @@
+#pragma once
+
+// closed-world expressions: nodes as std::variant values in one array
+
+#include "expr.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <variant>
+#include <vector>
+
+/// Types of the `cell` fields named in EXPR_CELL_OPS
+using cell_type_b = bool;
+using cell_type_i = int;
+using cell_type_d = double;
+
+/// An expression of type T whose nodes are drawn from a closed set, each a
+/// std::variant stored by value in a single array, with operands referred
+/// to by index. Evaluation visits the variants, with no virtual calls, and
+/// building one allocates only the array.
+///
+/// The set covers constants, variables, conditionals & the built-in
+/// operators (those in EXPR_CELL_OPS) on bool, int & double, and custom
+/// operators on those types, which are called through their cell_op().
+/// Boxed values need the open expr<T> hierarchy. Converting back to a tree
+/// gives an equivalent tree, in which && and || are bin_op_expr nodes
+template<typename T>
+class variant_expr {
+public:
+    /// A constant
+    struct constant {
+        cell value;
+        value_kind kind;
+    };
+
+    /// A variable, read from an env slot
+    struct variable {
+        std::uint32_t slot;
+        /// The index in protos of a copy of the original node, for
+        /// converting back
+        std::uint32_t proto;
+    };
+
+    /// A built-in operator
+    struct builtin {
+        cell_instr instr;
+        std::uint32_t left;
+        std::uint32_t right;
+    };
+
+    /// A custom operator
+    struct call {
+        /// The index of the operator in the operator table
+        std::uint32_t fn;
+        std::uint32_t left;
+        std::uint32_t right;
+    };
+
+    /// A conditional
+    struct conditional {
+        std::uint32_t cond;
+        std::uint32_t true_branch;
+        std::uint32_t false_branch;
+        value_kind kind;
+    };
+
+    using node = std::variant<constant, variable, builtin, call, conditional>;
+
+private:
+    /// The nodes; operands come before the nodes using them, and the root
+    /// is last
+    std::vector<node> nodes;
+    /// The custom operators
+    std::vector<cell_fn> fns;
+    /// Copies of the variable & custom operator nodes (with placeholder
+    /// operands), to convert back from
+    std::vector<std::shared_ptr<const expr_node>> protos;
+    /// The index in protos of each custom operator's node
+    std::vector<std::uint32_t> fn_protos;
+    /// The number of env slots read
+    std::size_t n_vars = 0;
+
+    std::uint32_t add(const expr_node& e) {
+        assert(e.result_kind() != value_kind::other);
+        std::uint32_t ops[3] = {};
+        for (std::size_t i = 0; i < e.arity(); ++i) ops[i] = add(e.operand(i));
+
+        switch ( e.kind() ) {
+        case node_kind::constant: {
+            value_pool unused;
+            nodes.push_back(constant{e.value(unused), e.result_kind()});
+            break;
+        }
+        case node_kind::var:
+            if ( e.slot() >= n_vars ) n_vars = e.slot() + 1;
+            nodes.push_back(variable{
+                std::uint32_t(e.slot()), std::uint32_t(protos.size())});
+            protos.emplace_back(e.rebuild(nullptr));
+            break;
+        case node_kind::bin_op: {
+            int native = find_cell_op(e);
+            if ( native >= 0 ) {
+                nodes.push_back(builtin{cell_instr(native), ops[0], ops[1]});
+                break;
+            }
+            // the placeholders only stand in for the operands' types
+            cell zero;
+            zero.d = 0;
+            expr_node* placeholders[] = {
+                e.operand(0).make_constant(zero),
+                e.operand(1).make_constant(zero)
+            };
+            nodes.push_back(call{std::uint32_t(fns.size()), ops[0], ops[1]});
+            fns.push_back(e.cell_op());
+            fn_protos.push_back(std::uint32_t(protos.size()));
+            protos.emplace_back(e.rebuild(placeholders));
+            break;
+        }
+        case node_kind::cond:
+            nodes.push_back(conditional{ops[0], ops[1], ops[2], e.result_kind()});
+            break;
+        }
+        return std::uint32_t(nodes.size() - 1);
+    }
+
+    /// Evaluates nodes by visiting them
+    struct evaluator {
+        const variant_expr& e;
+        const cell* vars;
+        value_pool& scratch;
+
+        cell operator() (std::uint32_t i) const {
+            return std::visit(*this, e.nodes[i]);
+        }
+
+        cell operator() (const constant& n) const { return n.value; }
+
+        cell operator() (const variable& n) const { return vars[n.slot]; }
+
+        cell operator() (const builtin& n) const {
+            cell l = (*this)(n.left);
+            // && and || only evaluate their right operand if the left one
+            // doesn't decide the result
+            if ( n.instr == cell_instr::and_b && !l.b ) return l;
+            if ( n.instr == cell_instr::or_b && l.b ) return l;
+            cell r = (*this)(n.right);
+            cell out;
+            switch ( n.instr ) {
+#define EXPR_VARIANT_OP(name, code, arg, res, sym) \
+            case cell_instr::name: out.res = l.arg sym r.arg; break;
+            EXPR_CELL_OPS(EXPR_VARIANT_OP)
+#undef EXPR_VARIANT_OP
+            }
+            return out;
+        }
+
+        cell operator() (const call& n) const {
+            return e.fns[n.fn]((*this)(n.left), (*this)(n.right), scratch);
+        }
+
+        cell operator() (const conditional& n) const {
+            return (*this)((*this)(n.cond).b ? n.true_branch : n.false_branch);
+        }
+    };
+
+    /// Converts nodes back to a tree
+    struct converter {
+        const variant_expr& e;
+
+        expr_node* operator() (std::uint32_t i) const {
+            return std::visit(*this, e.nodes[i]);
+        }
+
+        expr_node* operator() (const constant& n) const {
+            switch ( n.kind ) {
+            case value_kind::boolean: return new const_expr<bool>(n.value.b);
+            case value_kind::integer: return new const_expr<int>(n.value.i);
+            case value_kind::real: return new const_expr<double>(n.value.d);
+            case value_kind::other: break;
+            }
+            return unimplemented<expr_node*>();
+        }
+
+        expr_node* operator() (const variable& n) const {
+            return e.protos[n.proto]->rebuild(nullptr);
+        }
+
+        expr_node* operator() (const builtin& n) const {
+            expr_node* l = (*this)(n.left);
+            expr_node* r = (*this)(n.right);
+            switch ( n.instr ) {
+#define EXPR_VARIANT_OP(name, code, arg, res, sym) \
+            case cell_instr::name: \
+                return new bin_op_expr<cell_type_##res, cell_type_##arg, \
+                                       cell_type_##arg>( \
+                    op::code, static_cast<expr<cell_type_##arg>*>(l), \
+                    static_cast<expr<cell_type_##arg>*>(r));
+            EXPR_CELL_OPS(EXPR_VARIANT_OP)
+#undef EXPR_VARIANT_OP
+            }
+            return unimplemented<expr_node*>();
+        }
+
+        expr_node* operator() (const call& n) const {
+            expr_node* ops[] = { (*this)(n.left), (*this)(n.right) };
+            return e.protos[e.fn_protos[n.fn]]->rebuild(ops);
+        }
+
+        expr_node* operator() (const conditional& n) const {
+            auto c = static_cast<expr<bool>*>((*this)(n.cond));
+            expr_node* t = (*this)(n.true_branch);
+            expr_node* f = (*this)(n.false_branch);
+            switch ( n.kind ) {
+            case value_kind::boolean:
+                return new if_expr<bool>(c, static_cast<expr<bool>*>(t),
+                                         static_cast<expr<bool>*>(f));
+            case value_kind::integer:
+                return new if_expr<int>(c, static_cast<expr<int>*>(t),
+                                        static_cast<expr<int>*>(f));
+            case value_kind::real:
+                return new if_expr<double>(c, static_cast<expr<double>*>(t),
+                                           static_cast<expr<double>*>(f));
+            case value_kind::other:
+                break;
+            }
+            return unimplemented<expr_node*>();
+        }
+    };
+
+public:
+    /// converts e, which must only use the nodes of the closed set
+    explicit variant_expr(const expr<T>& e) {
+        static_assert(value_traits<T>::kind != value_kind::other,
+            "variant_expr only holds bool, int & double expressions");
+        add(e);
+        nodes.shrink_to_fit();
+    }
+
+    /// evaluates the expression, producing the same value as eval() on
+    /// the tree it was converted from
+    T eval() const {
+        return eval(env());
+    }
+
+    /// evaluates the expression on the variables vars
+    T eval(const env& vars) const {
+        assert(vars.size() >= n_vars);
+        value_pool scratch;
+        return value_traits<T>::get(
+            evaluator{*this, vars.data(), scratch}(root()));
+    }
+
+    /// converts the expression back to a tree, which should be deleted by
+    /// the caller
+    expr<T>* to_expr() const {
+        return static_cast<expr<T>*>(converter{*this}(root()));
+    }
+
+    /// the index of the root node
+    std::uint32_t root() const { return std::uint32_t(nodes.size() - 1); }
+
+    /// the number of nodes
+    std::size_t size() const { return nodes.size(); }
+
+    /// the i'th node
+    const node& operator[] (std::size_t i) const { return nodes[i]; }
+};
+
+/// Converts an expression tree to the closed node set
+template<typename T>
+variant_expr<T> to_variant(const expr<T>& e) {
+    return variant_expr<T>(e);
+}
@@ -0,0 +1,102 @@
+#include "expr_variant.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+/// wrapper function for multiplication
+int mult(int a, int b) { return a * b; }
+
+/// the printed form of e
+template<typename T>
+std::string text(const expr<T>& e) {
+    std::ostringstream out;
+    out << e;
+    return out.str();
+}
+
+/// checks that the closed form agrees with the tree-walking evaluator, and
+/// converts back to an equivalent tree
+template<typename T>
+void check(const expr<T>& e, const env& vars = env()) {
+    auto v = to_variant(e);
+    std::unique_ptr<expr<T>> back{v.to_expr()};
+    std::cout << e << " = " << v.eval(vars) << " (" << v.size()
+              << " nodes of " << sizeof(v[0]) << " bytes)" << std::endl;
+    assert(v.eval(vars) == e.eval(vars));
+    assert(back->eval(vars) == e.eval(vars));
+    assert(text(*back) == text(e));
+}
+
+int main() {
+    // the sample rule's condition, with a custom operator
+    bin_op_expr<bool, int, int> rule = {
+        op::eq,
+        new bin_op_expr<int, int, int>(
+            mult, "*", new const_expr<int>(8), new const_expr<int>(5)),
+        new const_expr<int>(40)
+    };
+    check(rule);
+    std::unique_ptr<expr<bool>> rule_back{to_variant(rule).to_expr()};
+    assert(rule_back->equals(rule));
+
+    // nodes are small enough to share cache lines
+    assert(sizeof(variant_expr<int>::node) <= 32);
+
+    // built-in operators on each inline type, with operands of every kind
+    var_scope scope;
+    if_expr<double> mixed = {
+        new and_expr(
+            new bin_op_expr<bool, int, int>(
+                op::lt,
+                new bin_op_expr<int, int, int>(
+                    op::mod, scope.var<int>("x"), new const_expr<int>(5)),
+                scope.var<int>("y")),
+            new bin_op_expr<bool, bool, bool>(
+                op::ne, scope.var<bool>("flag"), new const_expr<bool>(false))),
+        new bin_op_expr<double, double, double>(
+            op::div, scope.var<double>("w"), new const_expr<double>(2.0)),
+        new bin_op_expr<double, double, double>(
+            op::sub, new const_expr<double>(1.0), scope.var<double>("w"))
+    };
+    env vars = scope.make_env();
+    auto closed = to_variant(mixed);
+    std::unique_ptr<expr<double>> back{closed.to_expr()};
+    for (int x = -6; x < 6; ++x) {
+        for (int y : { -1, 2, 4 }) {
+            vars.set(scope.slot("x"), x);
+            vars.set(scope.slot("y"), y);
+            vars.set(scope.slot("flag"), x % 2 == 0);
+            vars.set(scope.slot("w"), x * 0.75);
+            assert(closed.eval(vars) == mixed.eval(vars));
+            assert(back->eval(vars) == mixed.eval(vars));
+        }
+    }
+    check(mixed, vars);
+
+    // short-circuiting: neither division by zero is evaluated
+    auto zero = new const_expr<int>(0);
+    if_expr<int> guarded = {
+        new or_expr(
+            new bin_op_expr<bool, int, int>(op::eq, zero, zero->clone()),
+            new bin_op_expr<bool, int, int>(
+                op::gt,
+                new bin_op_expr<int, int, int>(
+                    op::div, new const_expr<int>(10), zero->clone()),
+                new const_expr<int>(1))),
+        new const_expr<int>(-1),
+        new bin_op_expr<int, int, int>(
+            op::div, new const_expr<int>(10), zero->clone())
+    };
+    check(guarded);
+
+    // the closed form outlives the tree it was converted from
+    std::unique_ptr<expr<bool>> tree{rule.clone()};
+    auto kept = to_variant(*tree);
+    tree.reset();
+    assert(kept.eval());
+    std::unique_ptr<expr<bool>> rebuilt{kept.to_expr()};
+    assert(rebuilt->equals(rule));
+}